@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <stdint.h>
 
 #include <gsl/gsl_matrix_int.h>
 
@@ -9,12 +10,11 @@
 #include "loaderis.h"
 #include "cache.h"
 #include "auxx.h"
+#include "weight2.h"
 
 struct amatrix_t *init_amatrix(struct configuration_t *config)
 {
-	struct amatrix_t *ret=malloc(sizeof(struct amatrix_t));
-
-	assert(ret!=NULL);
+	struct energies_ctx_t *ectx=NULL;
 
 	if((config!=NULL)&&(config->erisfile!=NULL))
 	{
@@ -23,19 +23,58 @@ struct amatrix_t *init_amatrix(struct configuration_t *config)
 		if(!in)
 			return NULL;
 
-		ret->ectx=malloc(sizeof(struct energies_ctx_t));
-		assert(ret->ectx!=NULL);
-		load_energies(in, ret->ectx);
+		ectx=malloc(sizeof(struct energies_ctx_t));
+		assert(ectx!=NULL);
+
+		/*
+			Binary ERI files are recognized from their header, otherwise
+			the text format is assumed.
+		*/
+
+		if(energies_file_is_binary(in)==true)
+		{
+			if(load_energies_binary(in, ectx)==false)
+			{
+				fclose(in);
+				free(ectx);
+				return NULL;
+			}
+		}
+		else
+		{
+			load_energies(in, ectx);
+		}
 
 		fclose(in);
 
-		ret->nr_occupied=ret->ectx->nocc;
-		ret->nr_virtual=ret->ectx->nvirt;
+		if(config->energysampling==true)
+			init_label_samplers(ectx);
+	}
+
+	return init_amatrix_with_ectx(config, ectx);
+}
+
+/*
+	Creates a new 'amatrix' with its own RNG and permutation matrices, using an already
+	loaded energies context. The energies context is never modified, so that it can be
+	shared among many amatrix_t's, e.g. one per thread.
+*/
+
+struct amatrix_t *init_amatrix_with_ectx(struct configuration_t *config, struct energies_ctx_t *ectx)
+{
+	struct amatrix_t *ret=malloc(sizeof(struct amatrix_t));
+
+	assert(ret!=NULL);
+
+	ret->ectx=ectx;
+
+	if(ectx!=NULL)
+	{
+		ret->nr_occupied=ectx->nocc;
+		ret->nr_virtual=ectx->nvirt;
 	}
 	else
 	{
-		ret->ectx=NULL;
-
 		/*
 			Here we set some default values. However, if the ERI file is not loaded,
 			the number of occupied/virtual orbitals doesn't make a lot of sense.
@@ -59,6 +98,12 @@ struct amatrix_t *init_amatrix(struct configuration_t *config)
 	ret->cached_weight=0.0f;
 	ret->cached_weight_is_valid=false;
 
+	ret->private_weight_info=malloc(sizeof(struct weight_info_t));
+	ret->weight_info=ret->private_weight_info;
+	ret->weight_info_is_valid=false;
+
+	assert(ret->private_weight_info!=NULL);
+
 	return ret;
 }
 
@@ -67,11 +112,17 @@ void fini_amatrix(struct amatrix_t *amx,bool free_ectx)
 	if(amx)
 	{
 		if((amx->ectx)&&(free_ectx==true))
+		{
+			free_energies(amx->ectx);
 			free(amx->ectx);
+		}
 
 		fini_pmatrix(amx->pmxs[0]);
 		fini_pmatrix(amx->pmxs[1]);
 
+		if(amx->private_weight_info)
+			free(amx->private_weight_info);
+
 		free(amx);
 	}
 }
@@ -99,6 +150,62 @@ int amatrix_get_entry(struct amatrix_t *amx, int i, int j)
 	return cnt;
 }
 
+/*
+	A new label for the (i,j) entry of one of the two permutation matrices.
+
+	The raw values range from 1 to nr_occupied*nr_virtual, and the label of an entry of
+	type T is given by the raw value modulo the number n_T of orbitals of that type, see
+	pmatrix_get_entry(). When the label samplers are available, the label l is drawn from
+	the alias table for type T and one of the nr_occupied*nr_virtual/n_T raw values
+	corresponding to it is chosen uniformly, otherwise the raw value itself is chosen
+	uniformly. amatrix_value_probability() gives the probability of proposing a raw value,
+	which is needed by the updates in order to correct the acceptance ratio.
+*/
+
+static const struct alias_table_t *amatrix_get_sampler(struct amatrix_t *amx, int i, int j, int *nrlabels)
+{
+	if((amx->ectx==NULL)||(amx->ectx->occupied_sampler==NULL)||(amx->ectx->virtual_sampler==NULL))
+		return NULL;
+
+	if(pmatrix_entry_type(i, j)==QTYPE_OCCUPIED)
+	{
+		*nrlabels=amx->nr_occupied;
+		return amx->ectx->occupied_sampler;
+	}
+
+	*nrlabels=amx->nr_virtual;
+	return amx->ectx->virtual_sampler;
+}
+
+int amatrix_get_new_value(struct amatrix_t *amx, int pmatrix, int i, int j)
+{
+	int nrlabels;
+	const struct alias_table_t *sampler=amatrix_get_sampler(amx, i, j, &nrlabels);
+
+	if(sampler==NULL)
+		return pmatrix_get_new_value(amx->pmxs[pmatrix], amx->rng_ctx, i, j);
+
+	int label=alias_table_sample(sampler, amx->rng_ctx);
+	int copy=gsl_rng_uniform_int(amx->rng_ctx, amx->nr_occupied*amx->nr_virtual/nrlabels);
+
+	return 1+label+nrlabels*copy;
+}
+
+double amatrix_value_probability(struct amatrix_t *amx, int i, int j, int value)
+{
+	int nrvalues=amx->nr_occupied*amx->nr_virtual;
+
+	assert((value>=1)&&(value<=nrvalues));
+
+	int nrlabels;
+	const struct alias_table_t *sampler=amatrix_get_sampler(amx, i, j, &nrlabels);
+
+	if(sampler==NULL)
+		return 1.0f/nrvalues;
+
+	return alias_table_probability(sampler, (value-1)%nrlabels)*nrlabels/nrvalues;
+}
+
 /*
 	We can save the contents of a amatrix in a 'backup' structure using the 'save' operation,
 	and then (if needed) we can reload the old contents using the 'restore' operation.
@@ -106,44 +213,133 @@ int amatrix_get_entry(struct amatrix_t *amx, int i, int j)
 
 void amatrix_save(struct amatrix_t *amx, struct amatrix_backup_t *backup)
 {
-	backup->dimensions[0]=amx->pmxs[0]->dimensions;
-	backup->dimensions[1]=amx->pmxs[1]->dimensions;
-
-	assert(backup->dimensions[0]==backup->dimensions[1]);
-	assert(backup->dimensions[0]<PMATRIX_MAX_DIMENSIONS);
+	assert(amx->pmxs[0]->dimensions==amx->pmxs[1]->dimensions);
+	assert(amx->pmxs[0]->dimensions<PMATRIX_MAX_DIMENSIONS);
+	assert((amx->pmxs[0]->undo==NULL)&&(amx->pmxs[1]->undo==NULL));
 
-	for(int i=0;i<backup->dimensions[0];i++)
-	{
-		for(int j=0;j<backup->dimensions[0];j++)
-		{
-			backup->values[0][i][j]=amx->pmxs[0]->values[i][j];
-			backup->values[1][i][j]=amx->pmxs[1]->values[i][j];
-		}
-	}
+	backup->pmxs[0]=*amx->pmxs[0];
+	backup->pmxs[1]=*amx->pmxs[1];
 
 	backup->cached_result=amx->cached_weight;
 	backup->cached_result_is_valid=amx->cached_weight_is_valid;
+	backup->weight_info=amx->weight_info;
+	backup->weight_info_is_valid=amx->weight_info_is_valid;
 }
 
 void amatrix_restore(struct amatrix_t *amx, struct amatrix_backup_t *backup)
 {
-	amx->pmxs[0]->dimensions=backup->dimensions[0];
-	amx->pmxs[1]->dimensions=backup->dimensions[1];
+	*amx->pmxs[0]=backup->pmxs[0];
+	*amx->pmxs[1]=backup->pmxs[1];
 
 	assert(amx->pmxs[0]->dimensions==amx->pmxs[1]->dimensions);
 	assert(amx->pmxs[0]->dimensions<PMATRIX_MAX_DIMENSIONS);
 
-	for(int i=0;i<amx->pmxs[0]->dimensions;i++)
+	amx->cached_weight=backup->cached_result;
+	amx->cached_weight_is_valid=backup->cached_result_is_valid;
+
+	/*
+		The contents of the 'weight_info_t' structs are never modified by the updates: entries
+		in the topology cache are immutable, and private_weight_info is only written outside of
+		updates, by amatrix_update_weight_info(). Therefore restoring the pointer is enough.
+	*/
+
+	amx->weight_info=backup->weight_info;
+	amx->weight_info_is_valid=backup->weight_info_is_valid;
+}
+
+/*
+	The state of the Markov chain, i.e. the two permutation matrices and the RNG, can be
+	written to a checkpoint file and read back later. The cached results are not saved,
+	they are recalculated when needed.
+*/
+
+bool amatrix_save_state(struct amatrix_t *amx, FILE *out)
+{
+	for(int c=0;c<2;c++)
 	{
-		for(int j=0;j<amx->pmxs[0]->dimensions;j++)
-		{
-			amx->pmxs[0]->values[i][j]=backup->values[0][i][j];
-			amx->pmxs[1]->values[i][j]=backup->values[1][i][j];
-		}
+		struct pmatrix_t pmx=*amx->pmxs[c];
+
+		assert(pmx.undo==NULL);
+
+		pmx.undo=NULL;
+
+		if(fwrite(&pmx, sizeof(struct pmatrix_t), 1, out)!=1)
+			return false;
 	}
 
-	amx->cached_weight=backup->cached_result;
-	amx->cached_weight_is_valid=backup->cached_result_is_valid;
+	return gsl_rng_fwrite(out, amx->rng_ctx)==0;
+}
+
+bool amatrix_load_state(struct amatrix_t *amx, FILE *in)
+{
+	struct pmatrix_t pmxs[2];
+
+	for(int c=0;c<2;c++)
+	{
+		if(fread(&pmxs[c], sizeof(struct pmatrix_t), 1, in)!=1)
+			return false;
+
+		if((pmxs[c].nr_occupied!=amx->nr_occupied)||(pmxs[c].nr_virtual!=amx->nr_virtual))
+			return false;
+
+		if((pmxs[c].dimensions<1)||(pmxs[c].dimensions>=PMATRIX_MAX_DIMENSIONS))
+			return false;
+
+		pmxs[c].undo=NULL;
+		pmxs[c].rank_is_valid=false;
+
+		if(pmatrix_check_consistency(&pmxs[c])==false)
+			return false;
+	}
+
+	if((pmxs[0].dimensions!=pmxs[1].dimensions)||(gsl_rng_fread(in, amx->rng_ctx)!=0))
+		return false;
+
+	*amx->pmxs[0]=pmxs[0];
+	*amx->pmxs[1]=pmxs[1];
+
+	amx->cached_weight_is_valid=false;
+	amx->weight_info_is_valid=false;
+
+	return true;
+}
+
+/*
+	The undo log: amatrix_undo_begin() starts recording the changes, and then either
+	amatrix_undo_commit() keeps them, or amatrix_undo_rollback() reverts them.
+
+	As for amatrix_restore(), the 'weight_info_t' structs are never modified during an
+	update, so it is enough to record the pointer.
+*/
+
+void amatrix_undo_begin(struct amatrix_t *amx, struct amatrix_undo_t *undo)
+{
+	pmatrix_undo_begin(amx->pmxs[0], &undo->pmxs[0]);
+	pmatrix_undo_begin(amx->pmxs[1], &undo->pmxs[1]);
+
+	undo->cached_result=amx->cached_weight;
+	undo->cached_result_is_valid=amx->cached_weight_is_valid;
+	undo->weight_info=amx->weight_info;
+	undo->weight_info_is_valid=amx->weight_info_is_valid;
+}
+
+void amatrix_undo_commit(struct amatrix_t *amx)
+{
+	pmatrix_undo_end(amx->pmxs[0]);
+	pmatrix_undo_end(amx->pmxs[1]);
+}
+
+void amatrix_undo_rollback(struct amatrix_t *amx, struct amatrix_undo_t *undo)
+{
+	pmatrix_undo_rollback(amx->pmxs[0]);
+	pmatrix_undo_rollback(amx->pmxs[1]);
+
+	assert(amx->pmxs[0]->dimensions==amx->pmxs[1]->dimensions);
+
+	amx->cached_weight=undo->cached_result;
+	amx->cached_weight_is_valid=undo->cached_result_is_valid;
+	amx->weight_info=undo->weight_info;
+	amx->weight_info_is_valid=undo->weight_info_is_valid;
 }
 
 /*
@@ -188,10 +384,10 @@ bool amatrix_is_physical(struct amatrix_t *amx)
 
 	for(int i=0;i<dimensions;i++)
 	{
-		if(pmatrix_get_entry(amx->pmxs[0], i, i)!=0)
+		if(pmatrix_get_col(amx->pmxs[0], i)==i)
 			return false;
 
-		if(pmatrix_get_entry(amx->pmxs[1], i, i)!=0)
+		if(pmatrix_get_col(amx->pmxs[1], i)==i)
 			return false;
 	}
 
@@ -366,14 +562,15 @@ bool gsl_matrix_int_check_connectedness(gsl_matrix_int *adjacency,int dimensions
 	return result;
 }
 
-bool actual_amatrix_check_connectedness(struct amatrix_t *amx)
+/*
+	The original check, based on the powers of the adjacency matrix: it is kept as a reference,
+	for validating actual_amatrix_check_connectedness() in debug builds and in mpn-buildcache.
+*/
+
+bool reference_amatrix_check_connectedness(struct amatrix_t *amx)
 {
 	int dimensions=amx->pmxs[0]->dimensions;
 
-	assert(dimensions>=1);
-	if(dimensions==1)
-		return true;
-
 	gsl_matrix_int *adjacency=gsl_matrix_int_alloc(dimensions, dimensions);
 
 	for(int i=0;i<dimensions;i++)
@@ -382,10 +579,10 @@ bool actual_amatrix_check_connectedness(struct amatrix_t *amx)
 		{
 			int value=0;
 
-			if(amx->pmxs[0]->values[i][j]!=0)
+			if(pmatrix_get_col(amx->pmxs[0], i)==j)
 				value++;
 
-			if(amx->pmxs[1]->values[i][j]!=0)
+			if(pmatrix_get_col(amx->pmxs[1], i)==j)
 				value++;
 
 			gsl_matrix_int_set(adjacency, i, j, value);
@@ -399,20 +596,69 @@ bool actual_amatrix_check_connectedness(struct amatrix_t *amx)
 	return result;
 }
 
-bool amatrix_check_connectedness(struct amatrix_t *amx)
+/*
+	The two permutation matrices define a directed graph on the rows, with an edge going
+	from i to the column of the non-zero entry on the i-th row, for each matrix. Every vertex
+	has exactly two incoming and two outgoing edges, so that every edge lies on a cycle and
+	the graph is strongly connected if and only if all vertices can be reached from the first one.
+
+	The visit uses a bitmask for the vertices already reached and a small stack, so
+	it does not allocate any memory and it takes O(n) time.
+*/
+
+bool actual_amatrix_check_connectedness(struct amatrix_t *amx)
 {
 	int dimensions=amx->pmxs[0]->dimensions;
 
+	assert(dimensions>=1);
+	assert(dimensions<=PMATRIX_MAX_DIMENSIONS);
+
 	if(dimensions==1)
-	{
 		return true;
+
+	uint32_t reached=1;
+	int stack[PMATRIX_MAX_DIMENSIONS],istack=0;
+
+	stack[istack++]=0;
+
+	while(istack>0)
+	{
+		int i=stack[--istack];
+
+		for(int c=0;c<2;c++)
+		{
+			int j=amx->pmxs[c]->cols[i];
+
+			if((reached&(1U<<j))==0)
+			{
+				reached|=(1U<<j);
+				stack[istack++]=j;
+			}
+		}
 	}
 
-	if((dimensions>1)&&(dimensions<=amatrix_cache_max_dimensions)&&(amatrix_cache_is_enabled==true))
+	bool result=(reached==((1U<<dimensions)-1));
+
+	assert(result==reference_amatrix_check_connectedness(amx));
+
+	return result;
+}
+
+/*
+	The direct check is cheaper than computing the index of the topology, so the
+	caches are used only to cross-check the result in debug builds.
+*/
+
+bool amatrix_check_connectedness(struct amatrix_t *amx)
+{
+	int dimensions=amx->pmxs[0]->dimensions;
+
+	if(dimensions==1)
 	{
-		assert(cached_amatrix_check_connectedness(amx)==actual_amatrix_check_connectedness(amx));
-		return cached_amatrix_check_connectedness(amx);
+		return true;
 	}
 
+	assert((cache_is_available(dimensions)==false)||(cached_amatrix_check_connectedness(amx)==actual_amatrix_check_connectedness(amx)));
+
 	return actual_amatrix_check_connectedness(amx);
 }
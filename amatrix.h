@@ -1,6 +1,7 @@
 #ifndef __AMATRIX_H__
 #define __AMATRIX_H__
 
+#include <stdio.h>
 #include <stdbool.h>
 #include <gsl/gsl_matrix_int.h>
 #include <gsl/gsl_rng.h>
@@ -9,6 +10,8 @@
 #include "config.h"
 #include "limits.h"
 
+struct weight_info_t;
+
 /*
 	The 'amatrix' struct: a matrix following a certain set of rules,
 	in which every non-zero entry is associated to some quantum numbers.
@@ -49,25 +52,67 @@ struct amatrix_t
 
 	double cached_weight;
 	bool cached_weight_is_valid;
+
+	/*
+		The intermediate results of the weight calculation for the current arrangement of
+		zero/non-zero entries, allowing for a fast recalculation after label-only updates.
+		It points either to an entry in the topology cache or to private_weight_info.
+
+		Updates changing the arrangement must set weight_info_is_valid to false.
+	*/
+
+	const struct weight_info_t *weight_info;
+	bool weight_info_is_valid;
+
+	struct weight_info_t *private_weight_info;
 };
 
 struct amatrix_t *init_amatrix(struct configuration_t *config);
+struct amatrix_t *init_amatrix_with_ectx(struct configuration_t *config, struct energies_ctx_t *ectx);
 void fini_amatrix(struct amatrix_t *amx,bool free_ectx);
 
 int amatrix_get_entry(struct amatrix_t *amx, int i, int j);
 
+int amatrix_get_new_value(struct amatrix_t *amx, int pmatrix, int i, int j);
+double amatrix_value_probability(struct amatrix_t *amx, int i, int j, int value);
+
 struct amatrix_backup_t
 {
-	int dimensions[2];
-	int values[2][PMATRIX_MAX_DIMENSIONS][PMATRIX_MAX_DIMENSIONS];
+	struct pmatrix_t pmxs[2];
 
 	double cached_result;
 	bool cached_result_is_valid;
+
+	const struct weight_info_t *weight_info;
+	bool weight_info_is_valid;
 };
 
 void amatrix_save(struct amatrix_t *amx, struct amatrix_backup_t *backup);
 void amatrix_restore(struct amatrix_t *amx, struct amatrix_backup_t *backup);
 
+/*
+	The updates use an undo log instead: only the entries they actually modify
+	are recorded, together with the cached results, and written back on rejection.
+*/
+
+struct amatrix_undo_t
+{
+	struct pmatrix_undo_t pmxs[2];
+
+	double cached_result;
+	bool cached_result_is_valid;
+
+	const struct weight_info_t *weight_info;
+	bool weight_info_is_valid;
+};
+
+void amatrix_undo_begin(struct amatrix_t *amx, struct amatrix_undo_t *undo);
+void amatrix_undo_commit(struct amatrix_t *amx);
+void amatrix_undo_rollback(struct amatrix_t *amx, struct amatrix_undo_t *undo);
+
+bool amatrix_save_state(struct amatrix_t *amx, FILE *out);
+bool amatrix_load_state(struct amatrix_t *amx, FILE *in);
+
 bool amatrix_check_consistency(struct amatrix_t *amx);
 bool amatrix_is_physical(struct amatrix_t *amx);
 
@@ -77,6 +122,7 @@ void amatrix_to_python(struct amatrix_t *amx);
 void amatrix_to_wolfram(struct amatrix_t *amx);
 
 bool gsl_matrix_int_check_connectedness(gsl_matrix_int *adjacency,int dimensions);
+bool reference_amatrix_check_connectedness(struct amatrix_t *amx);
 bool actual_amatrix_check_connectedness(struct amatrix_t *amx);
 bool amatrix_check_connectedness(struct amatrix_t *amx);
 
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <math.h>
 #include <curses.h>
 #include <assert.h>
@@ -447,6 +448,127 @@ int cdist_linear_search(const double *cdists, int lo, int hi, double selector)
 	return 0;
 }
 
+/*
+	Alias tables (Vose's variant of Walker's method) allow one to sample from a discrete
+	distribution in O(1), using a single uniform random number: the state is chosen
+	uniformly, and then it is either kept or replaced by its alias, according to a threshold.
+*/
+
+struct alias_table_t *init_alias_table(const double *weights, int nrstates)
+{
+	struct alias_table_t *ret;
+
+	assert(nrstates>=1);
+
+	if(!(ret=malloc(sizeof(struct alias_table_t))))
+		return NULL;
+
+	ret->nrstates=nrstates;
+	ret->probabilities=malloc(sizeof(double)*nrstates);
+	ret->thresholds=malloc(sizeof(double)*nrstates);
+	ret->aliases=malloc(sizeof(int)*nrstates);
+
+	int *small=malloc(sizeof(int)*nrstates);
+	int *large=malloc(sizeof(int)*nrstates);
+	int nrsmall=0,nrlarge=0;
+
+	assert(ret->probabilities!=NULL);
+	assert(ret->thresholds!=NULL);
+	assert(ret->aliases!=NULL);
+	assert((small!=NULL)&&(large!=NULL));
+
+	for(int c=0;c<nrstates;c++)
+	{
+		assert(weights[c]>=0.0f);
+		ret->probabilities[c]=weights[c];
+	}
+
+	normalize_distribution(ret->probabilities, nrstates);
+
+	/*
+		Each state gets a bucket of size 1/nrstates, the states whose probability
+		is smaller than that are filled up by the states that exceed it.
+	*/
+
+	for(int c=0;c<nrstates;c++)
+	{
+		ret->thresholds[c]=ret->probabilities[c]*nrstates;
+		ret->aliases[c]=c;
+
+		if(ret->thresholds[c]<1.0f)
+			small[nrsmall++]=c;
+		else
+			large[nrlarge++]=c;
+	}
+
+	while((nrsmall>0)&&(nrlarge>0))
+	{
+		int s=small[--nrsmall];
+		int l=large[--nrlarge];
+
+		ret->aliases[s]=l;
+		ret->thresholds[l]-=1.0f-ret->thresholds[s];
+
+		if(ret->thresholds[l]<1.0f)
+			small[nrsmall++]=l;
+		else
+			large[nrlarge++]=l;
+	}
+
+	/*
+		Whatever is left over is full, up to rounding errors.
+	*/
+
+	while(nrlarge>0)
+		ret->thresholds[large[--nrlarge]]=1.0f;
+
+	while(nrsmall>0)
+		ret->thresholds[small[--nrsmall]]=1.0f;
+
+	free(small);
+	free(large);
+
+	return ret;
+}
+
+void fini_alias_table(struct alias_table_t *table)
+{
+	if(table)
+	{
+		free(table->probabilities);
+		free(table->thresholds);
+		free(table->aliases);
+		free(table);
+	}
+}
+
+int alias_table_sample(const struct alias_table_t *table, gsl_rng *rng)
+{
+	double x=gsl_rng_uniform(rng)*table->nrstates;
+	int c=(int)(x);
+
+	assert((c>=0)&&(c<table->nrstates));
+
+	return ((x-c)<table->thresholds[c])?(c):(table->aliases[c]);
+}
+
+double alias_table_probability(const struct alias_table_t *table, int state)
+{
+	assert((state>=0)&&(state<table->nrstates));
+
+	return table->probabilities[state];
+}
+
+void order_description(char *buf,int length,int order)
+{
+	if(order==1)
+		snprintf(buf,length,"HF");
+	else
+		snprintf(buf,length,"MP%d",order);
+
+	buf[length-1]='\0';
+}
+
 void remove_char(char *s,char c)
 {
 	int j;
@@ -36,6 +36,20 @@ void to_cumulative_distribution(const double *dists, double *cdists, int nrstate
 int cdist_search(const double *cdists, int lo, int hi, double selector);
 int cdist_linear_search(const double *cdists, int lo, int hi, double selector);
 
+struct alias_table_t
+{
+	int nrstates;
+
+	double *probabilities,*thresholds;
+	int *aliases;
+};
+
+struct alias_table_t *init_alias_table(const double *weights, int nrstates);
+void fini_alias_table(struct alias_table_t *table);
+int alias_table_sample(const struct alias_table_t *table, gsl_rng *rng);
+double alias_table_probability(const struct alias_table_t *table, int state);
+
 void remove_char(char *s,char c);
+void order_description(char *buf,int length,int order);
 
 #endif //__AUXX_H__
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/time.h>
+
+#include <gsl/gsl_rng.h>
+
+#include "config.h"
+#include "cache.h"
+#include "mc.h"
+#include "weight.h"
+
+/*
+	A microbenchmark for the weight evaluation and for the updates.
+
+	A set of diagrams is sampled from a Markov chain, using the parameters in the
+	configuration file. Then the weight of each diagram is calculated again and again,
+	either from scratch or reusing the intermediate results for its topology.
+
+	Finally the chain is run again, timing each update separately.
+*/
+
+#define BENCH_NR_DIAGRAMS	(4096)
+#define BENCH_DECORRELATION	(64)
+
+void usage(char *argv0)
+{
+	printf("Usage: %s <inifile> [<evaluations>]\n",argv0);
+
+	exit(0);
+}
+
+int main(int argc,char *argv[])
+{
+	if(argc<2)
+		usage(argv[0]);
+
+	long int evaluations=(argc>=3)?(atol(argv[2])):(10000000);
+
+	amatrix_cache_is_enabled=true;
+	init_cache(6);
+
+	struct configuration_t config;
+
+	load_config_defaults(&config);
+
+	if(load_configuration(argv[1],&config)==false)
+		return 0;
+
+	struct amatrix_t *amx=init_amatrix(&config);
+
+	if(!amx)
+	{
+		fprintf(stderr,"Error: couldn't load the ERIs file (%s).\n",config.erisfile);
+		return 0;
+	}
+
+	/*
+		We sample the diagrams, the chain moves only between the minimum and the maximum order.
+	*/
+
+	struct amatrix_backup_t *diagrams=malloc(sizeof(struct amatrix_backup_t)*BENCH_NR_DIAGRAMS);
+	int nr_diagrams=0;
+
+	while(nr_diagrams<BENCH_NR_DIAGRAMS)
+	{
+		for(int c=0;c<BENCH_DECORRELATION;c++)
+			updates[gsl_rng_uniform_int(amx->rng_ctx,DIAGRAM_NR_UPDATES)](amx,false);
+
+		if((amx->pmxs[0]->dimensions<config.minorder)||(amatrix_weight(amx)==0.0f))
+			continue;
+
+		amatrix_save(amx,&diagrams[nr_diagrams++]);
+	}
+
+	/*
+		Then we time the weight evaluations, order by order.
+	*/
+
+	printf("# <Order> <Diagrams> <Full evaluations/s> <Reconstructions/s>\n");
+
+	for(int order=config.minorder;order<=config.maxorder;order++)
+	{
+		int indices[BENCH_NR_DIAGRAMS],nr_indices=0;
+
+		for(int c=0;c<nr_diagrams;c++)
+			if(diagrams[c].pmxs[0].dimensions==order)
+				indices[nr_indices++]=c;
+
+		if(nr_indices==0)
+			continue;
+
+		double rates[2];
+
+		for(int mode=0;mode<2;mode++)
+		{
+			long int repetitions=1+evaluations/nr_indices;
+			double total=0.0f,elapsedtime=0.0f;
+
+			for(int c=0;c<nr_indices;c++)
+			{
+				amatrix_restore(amx,&diagrams[indices[c]]);
+				amx->weight_info_is_valid=false;
+
+				/*
+					In the second mode the intermediate results are built only once
+					for each diagram, as it happens for label-only updates.
+				*/
+
+				if(mode==1)
+					amatrix_update_weight_info(amx);
+
+				struct timeval starttime;
+				gettimeofday(&starttime,NULL);
+
+				for(long int d=0;d<repetitions;d++)
+				{
+					amx->cached_weight_is_valid=false;
+					total+=amatrix_weight(amx);
+				}
+
+				elapsedtime+=elapsed_time_since(&starttime);
+			}
+
+			rates[mode]=repetitions*nr_indices/elapsedtime;
+
+			if(total==0.0f)
+				printf("# Warning: all weights vanish.\n");
+		}
+
+		printf("%d %d %e %e\n",order,nr_indices,rates[0],rates[1]);
+	}
+
+	/*
+		The updates are proposed with equal probabilities, as in the sampling
+		of the diagrams, and each one of them is timed separately.
+	*/
+
+	long int proposed[DIAGRAM_NR_UPDATES]={0},accepted[DIAGRAM_NR_UPDATES]={0};
+	double elapsedtime[DIAGRAM_NR_UPDATES]={0.0f};
+
+	for(long int c=0;c<evaluations;c++)
+	{
+		int update_type=gsl_rng_uniform_int(amx->rng_ctx,DIAGRAM_NR_UPDATES);
+		double start=chain_clock();
+
+		int status=updates[update_type](amx,false);
+
+		elapsedtime[update_type]+=chain_clock()-start;
+		proposed[update_type]++;
+
+		if(status==UPDATE_ACCEPTED)
+			accepted[update_type]++;
+	}
+
+	printf("# <Update> <Proposals> <Acceptance> <Proposals/s>\n");
+
+	for(int c=0;c<DIAGRAM_NR_UPDATES;c++)
+	{
+		double acceptance=(proposed[c]>0)?(((double)(accepted[c]))/proposed[c]):(0.0f);
+		double rate=(elapsedtime[c]>0.0f)?(proposed[c]/elapsedtime[c]):(0.0f);
+
+		printf("%s %ld %f %e\n",update_names[c],proposed[c],acceptance,rate);
+	}
+
+	free(diagrams);
+	fini_amatrix(amx,true);
+
+	/*
+		The benchmark does not add the topologies it visited to the shared sparse caches.
+	*/
+
+	free_cache(false);
+
+	return 0;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "cache.h"
+#include "amatrix.h"
+#include "multiplicity.h"
+#include "permutations.h"
+#include "auxx.h"
+#include "mc.h"
+
+/*
+	Builds the cache files for all the orders up to a given one, so that they can be
+	prepared once, e.g. on a cluster, and then be shared by all the runs.
+
+	With --validate, instead, the routines calculating multiplicity and connectedness
+	are compared with the reference ones, over all the topologies up to the given order.
+*/
+
+void usage(char *argv0)
+{
+	printf("Usage: %s [-j <threads>] [--validate] <maxorder>\n",argv0);
+	printf("Builds the files cache.2.bin ... cache.<maxorder>.bin in the current directory, with 2 <= maxorder <= 8.\n");
+	printf("Files that are already present are checked, and rebuilt if they are corrupted.\n");
+	printf("By default all the available processors are used.\n");
+
+	exit(0);
+}
+
+bool validate(int maxorder)
+{
+	struct amatrix_t *amx=init_amatrix(NULL);
+	bool result=true;
+
+	for(int dimensions=2;dimensions<=maxorder;dimensions++)
+	{
+		int nr_permutations=ifactorial(dimensions);
+		long int checked,mismatches;
+
+		amx->pmxs[0]->dimensions=amx->pmxs[1]->dimensions=dimensions;
+		checked=mismatches=0;
+
+		for(int i=0;i<nr_permutations;i++)
+		{
+			for(int k=0;k<dimensions;k++)
+				pmatrix_place_entry(amx->pmxs[0], k, get_permutation(dimensions,i,k)-1, 1);
+
+			for(int j=0;j<nr_permutations;j++)
+			{
+				for(int k=0;k<dimensions;k++)
+					pmatrix_place_entry(amx->pmxs[1], k, get_permutation(dimensions,j,k)-1, 1);
+
+				if(actual_amatrix_multiplicity(amx)!=reference_amatrix_multiplicity(amx))
+					mismatches++;
+				else if(actual_amatrix_check_connectedness(amx)!=reference_amatrix_check_connectedness(amx))
+					mismatches++;
+
+				checked++;
+			}
+		}
+
+		printf("Order %d: %ld topologies checked, %ld mismatches.\n",dimensions,checked,mismatches);
+
+		if(mismatches!=0)
+			result=false;
+	}
+
+	fini_amatrix(amx,true);
+
+	return result;
+}
+
+int main(int argc,char *argv[])
+{
+	int maxorder=-1;
+	bool do_validate=false;
+
+	for(int c=1;c<argc;c++)
+	{
+		if((strcmp(argv[c],"-j")==0)&&((c+1)<argc))
+			cache_build_threads=atoi(argv[++c]);
+		else if(strcmp(argv[c],"--validate")==0)
+			do_validate=true;
+		else
+			maxorder=atoi(argv[c]);
+	}
+
+	if((maxorder<2)||(maxorder>8))
+		usage(argv[0]);
+
+	if(do_validate==true)
+		return (validate(maxorder)==true)?(0):(1);
+
+	struct timeval starttime;
+
+	gettimeofday(&starttime,NULL);
+
+	/*
+		The files that are already present are checked in full, and rebuilt if they are corrupted.
+	*/
+
+	amatrix_cache_is_enabled=true;
+	cache_verify_checksums=true;
+	init_cache(maxorder);
+
+	printf("Cache built in %f seconds.\n",elapsed_time_since(&starttime));
+
+	free_cache(false);
+
+	return 0;
+}
@@ -1,5 +1,14 @@
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_matrix_int.h>
@@ -10,15 +19,50 @@
 #include "multiplicity.h"
 #include "permutations.h"
 #include "limits.h"
+#include "weight2.h"
 
 /*
-	The global variables where the actual cache content is kept
+	The global variables where the actual cache content is kept.
+
+	Up to amatrix_cache_max_dimensions the cache is dense, with one byte for each of the (n!)^2
+	possible topologies. Above that, up to CACHE_MAX_DIMENSIONS, the cache is sparse: only connected
+	topologies are stored, as a sorted table of 64-bit entries, see the comments below.
 */
 
 uint8_t *amatrix_cache[MAX_ORDER];
 int amatrix_cache_max_dimensions=-1;
 bool amatrix_cache_is_enabled=true;
 
+uint64_t *sparse_cache[MAX_ORDER];
+uint64_t sparse_cache_entries[MAX_ORDER];
+
+/*
+	The topology cache: for each connected topology that has been visited, the corresponding
+	'weight_info_t' struct, i.e. everything in the weight that does not depend on the quantum numbers.
+
+	It is filled lazily and shared by all the Markov chains. Entries are never modified nor removed
+	once they have been inserted, so that they can be read without locking; insertions are done
+	by atomically prepending the new entry to the list of its bucket.
+*/
+
+#define TOPOLOGY_CACHE_BUCKETS		(1<<20)
+
+struct topology_entry_t
+{
+	struct topology_entry_t *next;
+	uint64_t index;
+	int dimensions;
+
+	/*
+		This has to be the last field, since only weight_info_size() bytes are allocated for it.
+	*/
+
+	struct weight_info_t awt;
+};
+
+static _Atomic(struct topology_entry_t *) *topology_cache=NULL;
+static atomic_size_t topology_cache_size;
+
 /*
 	The function amatrix_to_index(), given a amatrix_t struct, returns a unique index,
 	representative of the arrangement of the zero/non-zero entries.
@@ -26,101 +70,243 @@ bool amatrix_cache_is_enabled=true;
 	Note that there's nothing about the quantum numbers, since it would be
 	too expensive to cache that information. Because of this we cannot directly
 	cache the weight, that depends on the quantum numbers.
+
+	The ranks of the two permutations are kept in the pmatrix_t structs and recalculated
+	only when the arrangement changes, so in most cases this is just a couple of loads.
 */
 
-int amatrix_to_index(struct amatrix_t *amx)
+static const uint64_t index_factorials[CACHE_MAX_DIMENSIONS+1]=
+{
+	1, 1, 2, 6, 24, 120, 720, 5040, 40320, 362880, 3628800, 39916800, 479001600
+};
+
+uint64_t amatrix_to_index(struct amatrix_t *amx)
 {
 	assert(amx->pmxs[0]->dimensions==amx->pmxs[1]->dimensions);
 	int dimensions=amx->pmxs[0]->dimensions;
 
-	int pa[16],pb[16];
+	assert(dimensions<=CACHE_MAX_DIMENSIONS);
+	assert(index_factorials[dimensions]==(uint64_t)(ifactorial(dimensions)));
+
+	uint64_t index=index_factorials[dimensions]*pmatrix_get_rank(amx->pmxs[1])+pmatrix_get_rank(amx->pmxs[0]);
+
+#ifndef NDEBUG
+	int pa[PMATRIX_MAX_DIMENSIONS],pb[PMATRIX_MAX_DIMENSIONS];
 
 	pmatrix_to_permutation(amx->pmxs[0],pa);
 	pmatrix_to_permutation(amx->pmxs[1],pb);
 
-	return ifactorial(dimensions)*get_permutation_index(pb,dimensions)+get_permutation_index(pa,dimensions);
+	assert(index==((uint64_t)(ifactorial(dimensions)))*get_permutation_index(pb,dimensions)+get_permutation_index(pa,dimensions));
+#endif
+
+	return index;
 }
 
 /*
-	Returns the value of the largest index you can get from amatrix_to_index()
-
-	WARNING: If we change this to return a 64-bit integer, we have to check everywhere
-	the function is called.
+	Returns the number of different indices you can get from amatrix_to_index(), note that
+	this does not fit in 32 bits for dimensions larger than 8.
 */
 
-int cache_largest_index(int dimensions)
+uint64_t cache_largest_index(int dimensions)
 {
-	return ifactorial(dimensions)*ifactorial(dimensions);
+	assert(dimensions<=CACHE_MAX_DIMENSIONS);
+
+	return ((uint64_t)(ifactorial(dimensions)))*((uint64_t)(ifactorial(dimensions)));
 }
 
 /*
 	The multiplicity can take only values that are powers of two, and working
 	with matrices of dimension at most 10, the maximum value is 32.
 
-	Here we convert the double value returned by amatrix_multiplicity to an int.
+	Here we convert the double value returned by amatrix_multiplicity to an int,
+	or to its base-2 logarithm.
 */
 
+int multiplicity_to_log2(double multiplicity)
+{
+	for(int c=0;c<31;c++)
+		if(gsl_fcmp(multiplicity,(double)(1<<c),1e-6)==0)
+			return c;
+
+	assert(false);
+	return 0;
+}
+
 int multiplicity_to_int(double multiplicity)
 {
-	if(gsl_fcmp(multiplicity,1.0,1e-6)==0)
-		return 1;
+	return 1<<multiplicity_to_log2(multiplicity);
+}
 
-	if(gsl_fcmp(multiplicity,2.0,1e-6)==0)
-		return 2;
+/*
+	Cache files start with a 'cache_header_t' header, followed by the entries. They are mapped
+	in memory as read-only shared mappings, so that all the processes running on the same node
+	share the same copy, through the page cache.
+
+	The checksum is written together with the file. Checking it means reading the whole file,
+	1.6 GB at order 8, so when a file is mapped only its header and its size are validated,
+	unless cache_verify_checksums is set (e.g. by mpn-buildcache). The sparse caches are always
+	checked before being merged and saved again, so that a corrupted file is not propagated.
+*/
 
-	if(gsl_fcmp(multiplicity,4.0,1e-6)==0)
-		return 4;
+bool cache_verify_checksums=false;
+
+uint64_t cache_checksum(const void *data, uint64_t size)
+{
+	const uint8_t *bytes=data;
+	uint64_t hash=0xcbf29ce484222325ULL,c;
 
-	if(gsl_fcmp(multiplicity,8.0,1e-6)==0)
-		return 8;
+	for(c=0;(c+8)<=size;c+=8)
+	{
+		uint64_t word;
 
-	if(gsl_fcmp(multiplicity,16.0,1e-6)==0)
-		return 16;
+		memcpy(&word, bytes+c, 8);
+		hash=(hash^word)*0x100000001b3ULL;
+	}
 
-	if(gsl_fcmp(multiplicity,32.0,1e-6)==0)
-		return 32;
+	for(;c<size;c++)
+		hash=(hash^bytes[c])*0x100000001b3ULL;
 
-	assert(false);
-	return 0;
+	return hash;
 }
 
-bool load_cache_from_file(int dimensions)
+/*
+	Maps a cache file, returning a pointer to its entries, or NULL if the file does not exist or
+	is not valid. If expected_entries is non-zero, the file must contain exactly that many entries.
+*/
+
+void *map_cache_file(const char *filename, int dimensions, uint32_t entry_size, uint64_t expected_entries, bool verify_checksum, uint64_t *nr_entries)
 {
-	uint64_t size=cache_largest_index(dimensions);
-	uint8_t *memory_location=amatrix_cache[dimensions];
+	struct cache_header_t header;
+	int fd;
 
-	char filename[128];
+	if((fd=open(filename, O_RDONLY))<0)
+		return NULL;
 
-	snprintf(filename,128,"cache.%d.bin",dimensions);
-	filename[127]='\0';
+	struct stat st;
 
-	FILE *f;
+	if((fstat(fd, &st)!=0)||(read(fd, &header, sizeof(struct cache_header_t))!=sizeof(struct cache_header_t)))
+	{
+		printf("Cache file %s is not valid, ignoring it.\n",filename);
+		close(fd);
+		return NULL;
+	}
 
-	if(!(f=fopen(filename,"r")))
+	if((memcmp(header.magic, CACHE_FILE_MAGIC, 8)!=0)||(header.version!=CACHE_FILE_VERSION))
 	{
-		printf("Cache file %s not found, recalculating it.\n",filename);
-		fflush(stdout);
+		printf("Cache file %s has an unknown format or version, ignoring it.\n",filename);
+		close(fd);
+		return NULL;
+	}
 
-		return false;
+	if((header.dimensions!=(uint32_t)(dimensions))||(header.entry_size!=entry_size)||
+	   ((expected_entries!=0)&&(header.nr_entries!=expected_entries))||
+	   ((uint64_t)(st.st_size)!=(sizeof(struct cache_header_t)+header.nr_entries*entry_size)))
+	{
+		printf("Cache file %s does not match the expected order or size, ignoring it.\n",filename);
+		close(fd);
+		return NULL;
 	}
 
-	printf("Cache file %s found, loading... ",filename);
-	fflush(stdout);
+	void *mapping=mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if(mapping==MAP_FAILED)
+	{
+		printf("Cache file %s could not be mapped, ignoring it.\n",filename);
+		return NULL;
+	}
+
+	void *entries=((uint8_t *)(mapping))+sizeof(struct cache_header_t);
+
+	if((verify_checksum==true)&&(cache_checksum(entries, header.nr_entries*entry_size)!=header.checksum))
+	{
+		printf("Cache file %s is corrupted (wrong checksum), ignoring it.\n",filename);
+		munmap(mapping, st.st_size);
+		return NULL;
+	}
+
+	*nr_entries=header.nr_entries;
+
+	return entries;
+}
+
+void unmap_cache_file(void *entries, uint32_t entry_size, uint64_t nr_entries)
+{
+	munmap(((uint8_t *)(entries))-sizeof(struct cache_header_t), sizeof(struct cache_header_t)+nr_entries*entry_size);
+}
+
+/*
+	The file is first written under a temporary name and then renamed, so that other
+	processes never see a partially written file.
+*/
+
+bool write_cache_file(const char *filename, int dimensions, uint32_t entry_size, const void *entries, uint64_t nr_entries)
+{
+	struct cache_header_t header;
+
+	memset(&header, 0, sizeof(struct cache_header_t));
+	memcpy(header.magic, CACHE_FILE_MAGIC, 8);
+	header.version=CACHE_FILE_VERSION;
+	header.dimensions=dimensions;
+	header.entry_size=entry_size;
+	header.nr_entries=nr_entries;
+	header.checksum=cache_checksum(entries, nr_entries*entry_size);
+
+	char tmpfilename[160];
+
+	snprintf(tmpfilename,160,"%s.%d.tmp",filename,(int)(getpid()));
+	tmpfilename[159]='\0';
+
+	FILE *f;
+
+	if(!(f=fopen(tmpfilename,"w+")))
+		return false;
 
-	uint64_t size_read;
+	bool success=(fwrite(&header, sizeof(struct cache_header_t), 1, f)==1)&&
+	             (fwrite(entries, entry_size, nr_entries, f)==nr_entries);
 
-	if((size_read=fread(memory_location, 1, size, f))!=size)
+	if((fclose(f)!=0)||(success==false)||(rename(tmpfilename,filename)!=0))
 	{
-		if(f)
-			fclose(f);
+		remove(tmpfilename);
+		return false;
+	}
+
+	return true;
+}
 
-		printf("FAIL (%llu != %llu)!\n",size,size_read);
+/*
+	The dense cache files: one byte for each topology
+*/
+
+bool amatrix_cache_is_mapped[MAX_ORDER];
+
+void dense_cache_filename(char *filename, int length, int dimensions)
+{
+	snprintf(filename,length,"cache.%d.bin",dimensions);
+	filename[length-1]='\0';
+}
+
+bool load_cache_from_file(int dimensions)
+{
+	char filename[128];
+	dense_cache_filename(filename,128,dimensions);
+
+	uint64_t nr_entries;
+	uint8_t *entries=map_cache_file(filename, dimensions, 1, cache_largest_index(dimensions), cache_verify_checksums, &nr_entries);
+
+	if(entries==NULL)
+	{
+		printf("Cache file %s not available, recalculating it.\n",filename);
 		fflush(stdout);
 
 		return false;
 	}
 
-	printf("SUCCESS!\n");
+	amatrix_cache[dimensions]=entries;
+	amatrix_cache_is_mapped[dimensions]=true;
+
+	printf("Cache file %s mapped.\n",filename);
 	fflush(stdout);
 
 	return true;
@@ -128,108 +314,197 @@ bool load_cache_from_file(int dimensions)
 
 void save_cache_to_file(int dimensions)
 {
-	uint64_t size=cache_largest_index(dimensions);
-	uint8_t *memory_location=amatrix_cache[dimensions];
+	char filename[128];
+	dense_cache_filename(filename,128,dimensions);
+
+	if(write_cache_file(filename, dimensions, 1, amatrix_cache[dimensions], cache_largest_index(dimensions))==false)
+		printf("Cache file %s could not be saved.\n",filename);
+}
+
+/*
+	The sparse cache: a sorted table with an entry for each connected topology, containing
+	the index in the upper 58 bits and the base-2 logarithm of the multiplicity in the lower
+	6 bits. The index fits in 58 bits up to dimension 12.
+
+	Topologies that are not in the table are either disconnected, or have never been visited.
+	The connected topologies visited during a run are saved in the topology cache, and at the
+	end of the run they are merged into the table on disk, so that it grows over time.
+
+	After the header, the file contains the sorted array of 64-bit entries, so that it can be used in place.
+*/
 
+#define SPARSE_ENTRY_INDEX(entry)		((entry)>>6)
+#define SPARSE_ENTRY_LOG2_MULTIPLICITY(entry)	((entry)&0x3F)
+#define SPARSE_ENTRY(index,log2multiplicity)	(((index)<<6)|((uint64_t)(log2multiplicity)))
+
+void sparse_cache_filename(char *filename, int length, int dimensions)
+{
+	snprintf(filename,length,"cache.%d.sparse.bin",dimensions);
+	filename[length-1]='\0';
+}
+
+bool load_sparse_cache_from_file(int dimensions)
+{
 	char filename[128];
+	sparse_cache_filename(filename,128,dimensions);
 
-	snprintf(filename,128,"cache.%d.bin",dimensions);
-	filename[127]='\0';
+	uint64_t nr_entries;
+	uint64_t *entries=map_cache_file(filename, dimensions, sizeof(uint64_t), 0, cache_verify_checksums, &nr_entries);
 
-	FILE *f;
+	if(entries==NULL)
+		return false;
 
-	if(!(f=fopen(filename,"w+")))
-		return;
+	sparse_cache[dimensions]=entries;
+	sparse_cache_entries[dimensions]=nr_entries;
 
-	fwrite(memory_location, 1, size, f);
+	printf("Sparse cache file %s mapped (%llu connected topologies).\n",filename,(unsigned long long)(nr_entries));
+	fflush(stdout);
 
-	if(f)
-		fclose(f);
+	return true;
 }
 
-void fill_cache(int dimensions,long int expected_connected,long int expected_not_connected)
+bool sparse_cache_lookup(uint64_t index, int dimensions, int *log2multiplicity)
 {
-	assert(sizeof(long int)>=8);
+	uint64_t *entries=sparse_cache[dimensions];
+	uint64_t lo=0,hi=sparse_cache_entries[dimensions];
 
-	if(load_cache_from_file(dimensions)==true)
+	while(lo<hi)
+	{
+		uint64_t mid=lo+(hi-lo)/2;
+
+		if(SPARSE_ENTRY_INDEX(entries[mid])<index)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+
+	if((lo<sparse_cache_entries[dimensions])&&(SPARSE_ENTRY_INDEX(entries[lo])==index))
+	{
+		*log2multiplicity=SPARSE_ENTRY_LOG2_MULTIPLICITY(entries[lo]);
+		return true;
+	}
+
+	return false;
+}
+
+int compare_uint64(const void *a, const void *b)
+{
+	uint64_t x=*((const uint64_t *)(a));
+	uint64_t y=*((const uint64_t *)(b));
+
+	return (x>y)-(x<y);
+}
+
+/*
+	Merges the connected topologies found in the topology cache into the sparse table,
+	and saves it.
+
+	Many runs may share the same directory, and each one saves its table at the end: the
+	entries are then merged with the file as it is now, and not with the one mapped at the
+	beginning of the run, so that the topologies saved in the meantime by the other runs
+	are kept. The file is locked while doing so. Since it is replaced by rename(), the lock
+	is taken on a separate file, as a lock on the old file would not exclude a process
+	that opens the new one.
+*/
+
+void save_sparse_cache_to_file(int dimensions, uint64_t *new_entries, uint64_t nr_new_entries)
+{
+	if(nr_new_entries==0)
 		return;
 
+	qsort(new_entries, nr_new_entries, sizeof(uint64_t), compare_uint64);
+
+	char filename[128],lockfilename[160];
+	sparse_cache_filename(filename,128,dimensions);
+
+	snprintf(lockfilename,160,"%s.lock",filename);
+	lockfilename[159]='\0';
+
+	int lockfd;
+
+	if(((lockfd=open(lockfilename, O_RDWR|O_CREAT, 0644))<0)||(flock(lockfd, LOCK_EX)!=0))
+		printf("Warning: couldn't lock %s, the sparse cache is saved without locking.\n",lockfilename);
+
+	uint64_t nr_old_entries=0;
+	uint64_t *old_entries=map_cache_file(filename, dimensions, sizeof(uint64_t), 0, true, &nr_old_entries);
+
+	if(old_entries==NULL)
+		nr_old_entries=0;
+
+	uint64_t *merged=malloc(sizeof(uint64_t)*(nr_old_entries+nr_new_entries));
+	uint64_t i=0,j=0,k=0;
+
+	assert(merged!=NULL);
+
+	while((i<nr_old_entries)||(j<nr_new_entries))
+	{
+		uint64_t entry;
+
+		if((j>=nr_new_entries)||((i<nr_old_entries)&&(old_entries[i]<=new_entries[j])))
+			entry=old_entries[i++];
+		else
+			entry=new_entries[j++];
+
+		if((k==0)||(SPARSE_ENTRY_INDEX(merged[k-1])!=SPARSE_ENTRY_INDEX(entry)))
+			merged[k++]=entry;
+	}
+
+	if(old_entries!=NULL)
+		unmap_cache_file(old_entries, sizeof(uint64_t), nr_old_entries);
+
+	if(write_cache_file(filename, dimensions, sizeof(uint64_t), merged, k)==true)
+		printf("Sparse cache file %s saved (%llu connected topologies).\n",filename,(unsigned long long)(k));
+	else
+		printf("Sparse cache file %s could not be saved.\n",filename);
+
+	if(lockfd>=0)
+		close(lockfd);
+
+	free(merged);
+}
+
+/*
+	The cache is filled by a number of threads, each one taking the next value of the
+	outer permutation index, and then looping over the inner one. Each thread has its own
+	'amatrix', whose entries are set directly from the permutation tables.
+*/
+
+int cache_build_threads=0;
+
+struct fill_cache_ctx_t
+{
+	int dimensions,nr_permutations;
+
+	atomic_int next;
+	atomic_long connected,not_connected;
+};
+
+static void permutation_to_pmatrix(struct pmatrix_t *pmx, int dimensions, int pindex)
+{
+	for(int k=0;k<dimensions;k++)
+		pmatrix_place_entry(pmx, k, get_permutation(dimensions,pindex,k)-1, 1);
+}
+
+void *fill_cache_worker(void *data)
+{
+	struct fill_cache_ctx_t *ctx=data;
 	struct amatrix_t *amx=init_amatrix(NULL);
 
-	int nr_permutations;
+	int dimensions=ctx->dimensions;
 	long int connected,not_connected;
 
 	amx->pmxs[0]->dimensions=amx->pmxs[1]->dimensions=dimensions;
-
 	connected=not_connected=0;
-	nr_permutations=ifactorial(dimensions);
 
-	for(int i=0;i<nr_permutations;i++)
-	{
-		for(int j=0;j<nr_permutations;j++)
-		{
-			gsl_matrix_int *a,*b;
+	int i;
 
-			switch(dimensions)
-			{
-				case 2:
-				a=permutation_to_matrix(permutations2[i], dimensions);
-				b=permutation_to_matrix(permutations2[j], dimensions);
-				break;
-
-				case 3:
-				a=permutation_to_matrix(permutations3[i], dimensions);
-				b=permutation_to_matrix(permutations3[j], dimensions);
-				break;
-
-				case 4:
-				a=permutation_to_matrix(permutations4[i], dimensions);
-				b=permutation_to_matrix(permutations4[j], dimensions);
-				break;
-
-				case 5:
-				a=permutation_to_matrix(permutations5[i], dimensions);
-				b=permutation_to_matrix(permutations5[j], dimensions);
-				break;
-
-				case 6:
-				a=permutation_to_matrix(permutations6[i], dimensions);
-				b=permutation_to_matrix(permutations6[j], dimensions);
-				break;
-
-				case 7:
-				a=permutation_to_matrix(permutations7[i], dimensions);
-				b=permutation_to_matrix(permutations7[j], dimensions);
-				break;
-
-				case 8:
-				a=permutation_to_matrix(permutations8[i], dimensions);
-				b=permutation_to_matrix(permutations8[j], dimensions);
-				break;
-
-				case 9:
-				a=permutation_to_matrix(permutations9[i], dimensions);
-				b=permutation_to_matrix(permutations9[j], dimensions);
-				break;
-
-				case 10:
-				a=permutation_to_matrix(permutations10[i], dimensions);
-				b=permutation_to_matrix(permutations10[j], dimensions);
-				break;
-
-				default:
-				a=b=NULL;
-				assert(false);
-			}
+	while((i=atomic_fetch_add(&ctx->next,1))<ctx->nr_permutations)
+	{
+		permutation_to_pmatrix(amx->pmxs[0], dimensions, i);
 
-			for(int k=0;k<dimensions;k++)
-			{
-				for(int l=0;l<dimensions;l++)
-				{
-					amx->pmxs[0]->values[k][l]=gsl_matrix_int_get(a, k, l);
-					amx->pmxs[1]->values[k][l]=gsl_matrix_int_get(b, k, l);
-				}
-			}
+		for(int j=0;j<ctx->nr_permutations;j++)
+		{
+			permutation_to_pmatrix(amx->pmxs[1], dimensions, j);
 
 			bool is_connected=actual_amatrix_check_connectedness(amx);
 			double multiplicity=actual_amatrix_multiplicity(amx);
@@ -239,50 +514,110 @@ void fill_cache(int dimensions,long int expected_connected,long int expected_not
 			else
 				not_connected++;
 
-			cache_set_entry(amatrix_to_index(amx), dimensions, multiplicity_to_int(multiplicity), is_connected);
+			/*
+				Each thread writes to different entries, no locking is needed.
+			*/
 
-			gsl_matrix_int_free(a);
-			gsl_matrix_int_free(b);
+			cache_set_entry(amatrix_to_index(amx), dimensions, multiplicity_to_int(multiplicity), is_connected);
 		}
 	}
 
+	atomic_fetch_add(&ctx->connected,connected);
+	atomic_fetch_add(&ctx->not_connected,not_connected);
+
 	fini_amatrix(amx,true);
 
-	assert((connected==expected_connected)&&(not_connected==expected_not_connected));
+	return NULL;
+}
+
+void fill_cache(int dimensions,long int expected_connected,long int expected_not_connected)
+{
+	assert(sizeof(long int)>=8);
+
+	if(load_cache_from_file(dimensions)==true)
+		return;
+
+	uint64_t size=cache_largest_index(dimensions);
+
+	amatrix_cache[dimensions]=malloc(size);
+	amatrix_cache_is_mapped[dimensions]=false;
+
+	assert(amatrix_cache[dimensions]!=NULL);
+
+	for(uint64_t c=0;c<size;c++)
+		amatrix_cache[dimensions][c]=0;
+
+	struct fill_cache_ctx_t ctx;
+
+	ctx.dimensions=dimensions;
+	ctx.nr_permutations=ifactorial(dimensions);
+	atomic_init(&ctx.next,0);
+	atomic_init(&ctx.connected,0);
+	atomic_init(&ctx.not_connected,0);
+
+	int nr_threads=cache_build_threads;
+
+	if(nr_threads<=0)
+		nr_threads=sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(nr_threads>ctx.nr_permutations)
+		nr_threads=ctx.nr_permutations;
+
+	if(nr_threads<=1)
+	{
+		fill_cache_worker(&ctx);
+	}
+	else
+	{
+		pthread_t *threads=malloc(sizeof(pthread_t)*nr_threads);
+		assert(threads!=NULL);
+
+		int nr_created=0;
+
+		while((nr_created<nr_threads)&&(pthread_create(&threads[nr_created], NULL, fill_cache_worker, &ctx)==0))
+			nr_created++;
+
+		/*
+			If some threads could not be created, the current one takes part in the work,
+			which is shared through ctx.next, so that the cache is filled anyway.
+		*/
+
+		if(nr_created<nr_threads)
+			fill_cache_worker(&ctx);
+
+		for(int c=0;c<nr_created;c++)
+			pthread_join(threads[c], NULL);
+
+		free(threads);
+	}
+
+	assert((atomic_load(&ctx.connected)==expected_connected)&&(atomic_load(&ctx.not_connected)==expected_not_connected));
 
 	save_cache_to_file(dimensions);
 }
 
 bool init_cache(int max_dimensions)
 {
-	/*
-		In this file we assume many times that the maximum dimension is 6.
-		In case we want to go to higher orders, one needs to slightly revamp those bits.
-	*/
-
-	assert((max_dimensions>1)&&(max_dimensions<=10));
-	int total_alloced=0;
+	uint64_t total_alloced=0;
 
 	for(int dimensions=0;dimensions<MAX_ORDER;dimensions++)
+	{
 		amatrix_cache[dimensions]=NULL;
+		amatrix_cache_is_mapped[dimensions]=false;
+		sparse_cache[dimensions]=NULL;
+		sparse_cache_entries[dimensions]=0;
+	}
 
 	/*
-		In order to go beyond dimension 8, here we would need size_of_current_allocation
-		to be an 64-bit integer.
+		The dense cache takes (n!)^2 bytes, i.e. 1.6 GB at dimension 8, and it is not
+		feasible to go beyond that. Higher dimensions, up to CACHE_MAX_DIMENSIONS, use
+		the sparse cache.
 	*/
 
-	assert(max_dimensions<=8);
+	assert((max_dimensions>1)&&(max_dimensions<=8));
 
 	for(int dimensions=2;dimensions<=max_dimensions;dimensions++)
-	{
-		int size_of_current_allocation=cache_largest_index(dimensions);
-
-		amatrix_cache[dimensions]=malloc(size_of_current_allocation);
-		total_alloced+=size_of_current_allocation;
-
-		for(int c=0;c<size_of_current_allocation;c++)
-			amatrix_cache[dimensions][c]=0;
-	}
+		total_alloced+=cache_largest_index(dimensions);
 
 	printf("Cache size: ");
 	print_file_size(stdout,total_alloced);
@@ -290,6 +625,18 @@ bool init_cache(int max_dimensions)
 
 	amatrix_cache_max_dimensions=max_dimensions;
 
+	/*
+		The topology cache is initially empty.
+	*/
+
+	topology_cache=malloc(sizeof(_Atomic(struct topology_entry_t *))*TOPOLOGY_CACHE_BUCKETS);
+	assert(topology_cache!=NULL);
+
+	for(int c=0;c<TOPOLOGY_CACHE_BUCKETS;c++)
+		atomic_init(&topology_cache[c], NULL);
+
+	atomic_init(&topology_cache_size, 0);
+
 	/*
 		Now we just fill the caches.
 
@@ -307,24 +654,138 @@ bool init_cache(int max_dimensions)
 	if(max_dimensions>=6) fill_cache(6,413640,104760);
 	if(max_dimensions>=7) fill_cache(7,20946960,4454640);
 	if(max_dimensions>=8) fill_cache(8,1377648720,248053680);
-	if(max_dimensions>=9) fill_cache(9,114078384000,17603510400);
-	if(max_dimensions>=10) fill_cache(10,11611761920640,1556427519360);
+
+	/*
+		The sparse caches are loaded from disk, if present, otherwise they start empty.
+	*/
+
+	for(int dimensions=max_dimensions+1;dimensions<=CACHE_MAX_DIMENSIONS;dimensions++)
+		load_sparse_cache_from_file(dimensions);
 
 	return true;
 }
 
-void free_cache(void)
+/*
+	If save_sparse_caches is true, the connected topologies visited during the run are added to
+	the sparse cache files. Tools that do not run the Markov chains, or where many processes
+	share the same directory, can skip this.
+*/
+
+void free_cache(bool save_sparse_caches)
 {
 	for(int dimensions=0;dimensions<MAX_ORDER;dimensions++)
-		if(amatrix_cache[dimensions]!=NULL)
+	{
+		if((amatrix_cache[dimensions]!=NULL)&&(amatrix_cache_is_mapped[dimensions]==true))
+			unmap_cache_file(amatrix_cache[dimensions], 1, cache_largest_index(dimensions));
+		else if(amatrix_cache[dimensions]!=NULL)
 			free(amatrix_cache[dimensions]);
+
+		amatrix_cache[dimensions]=NULL;
+		amatrix_cache_is_mapped[dimensions]=false;
+	}
+
+	if(topology_cache!=NULL)
+	{
+		/*
+			The connected topologies not yet in the sparse caches are saved to disk, if requested
+		*/
+
+		uint64_t *new_entries[MAX_ORDER],nr_new_entries[MAX_ORDER];
+
+		for(int dimensions=0;dimensions<MAX_ORDER;dimensions++)
+		{
+			new_entries[dimensions]=NULL;
+			nr_new_entries[dimensions]=0;
+		}
+
+		for(int pass=0;(save_sparse_caches==true)&&(pass<2);pass++)
+		{
+			for(int c=0;c<TOPOLOGY_CACHE_BUCKETS;c++)
+			{
+				for(struct topology_entry_t *entry=atomic_load(&topology_cache[c]);entry!=NULL;entry=entry->next)
+				{
+					int dimensions=entry->dimensions;
+					int log2multiplicity;
+
+					if((dimensions<=amatrix_cache_max_dimensions)||(sparse_cache_lookup(entry->index, dimensions, &log2multiplicity)==true))
+						continue;
+
+					if(pass==1)
+					{
+						log2multiplicity=multiplicity_to_log2(entry->awt.multiplicity);
+						new_entries[dimensions][nr_new_entries[dimensions]]=SPARSE_ENTRY(entry->index, log2multiplicity);
+					}
+
+					nr_new_entries[dimensions]++;
+				}
+			}
+
+			for(int dimensions=0;dimensions<MAX_ORDER;dimensions++)
+			{
+				if(pass==0)
+				{
+					if(nr_new_entries[dimensions]>0)
+					{
+						new_entries[dimensions]=malloc(sizeof(uint64_t)*nr_new_entries[dimensions]);
+						assert(new_entries[dimensions]!=NULL);
+					}
+
+					nr_new_entries[dimensions]=0;
+				}
+				else if(new_entries[dimensions]!=NULL)
+				{
+					save_sparse_cache_to_file(dimensions, new_entries[dimensions], nr_new_entries[dimensions]);
+					free(new_entries[dimensions]);
+				}
+			}
+		}
+
+		for(int c=0;c<TOPOLOGY_CACHE_BUCKETS;c++)
+		{
+			struct topology_entry_t *entry=atomic_load(&topology_cache[c]);
+
+			while(entry!=NULL)
+			{
+				struct topology_entry_t *next=entry->next;
+
+				free(entry);
+				entry=next;
+			}
+		}
+
+		free(topology_cache);
+		topology_cache=NULL;
+	}
+
+	for(int dimensions=0;dimensions<MAX_ORDER;dimensions++)
+	{
+		if(sparse_cache[dimensions]!=NULL)
+			unmap_cache_file(sparse_cache[dimensions], sizeof(uint64_t), sparse_cache_entries[dimensions]);
+
+		sparse_cache[dimensions]=NULL;
+		sparse_cache_entries[dimensions]=0;
+	}
+
+	amatrix_cache_max_dimensions=-1;
+}
+
+/*
+	Tells whether the cache can be used for a given dimension, either the dense or the sparse one.
+*/
+
+bool cache_is_available(int dimensions)
+{
+	if((amatrix_cache_max_dimensions==-1)||(amatrix_cache_is_enabled==false))
+		return false;
+
+	return (dimensions>1)&&(dimensions<=CACHE_MAX_DIMENSIONS);
 }
 
 /*
 	Low level functions to get/set a cache entry
 */
 
-uint8_t cache_get_entry(int index, int dimensions)
+uint8_t cache_get_entry(uint64_t index, int dimensions)
 {
 	assert((dimensions>1)&&(dimensions<=amatrix_cache_max_dimensions));
 	assert(amatrix_cache[dimensions]!=NULL);
@@ -333,7 +794,7 @@ uint8_t cache_get_entry(int index, int dimensions)
 	return amatrix_cache[dimensions][index];
 }
 
-void cache_set_entry(int index, int dimensions, int multiplicity, bool isconnected)
+void cache_set_entry(uint64_t index, int dimensions, int multiplicity, bool isconnected)
 {
 	assert((dimensions>1)&&(dimensions<=amatrix_cache_max_dimensions));
 	assert(amatrix_cache[dimensions]!=NULL);
@@ -356,6 +817,35 @@ void cache_set_entry(int index, int dimensions, int multiplicity, bool isconnect
 	amatrix_cache[dimensions][index]=byte;
 }
 
+/*
+	Looks up a connected topology in the sparse cache, and then in the topology cache,
+	which contains all the connected topologies visited so far.
+*/
+
+bool sparse_cache_get_entry(uint64_t index, int dimensions, int *multiplicity)
+{
+	int log2multiplicity;
+
+	if(sparse_cache_lookup(index, dimensions, &log2multiplicity)==true)
+	{
+		*multiplicity=1<<log2multiplicity;
+		return true;
+	}
+
+	if(topology_cache_is_available(dimensions)==true)
+	{
+		const struct weight_info_t *awt=topology_cache_get_entry(index, dimensions);
+
+		if(awt!=NULL)
+		{
+			*multiplicity=multiplicity_to_int(awt->multiplicity);
+			return true;
+		}
+	}
+
+	return false;
+}
+
 /*
 	High-level functions for dealing with cache entries given an 'amatrix'
 */
@@ -365,6 +855,16 @@ int cached_amatrix_multiplicity(struct amatrix_t *amx)
 	assert(amx->pmxs[0]->dimensions==amx->pmxs[1]->dimensions);
 	int dimensions=amx->pmxs[0]->dimensions;
 
+	if(dimensions>amatrix_cache_max_dimensions)
+	{
+		int multiplicity;
+
+		if(sparse_cache_get_entry(amatrix_to_index(amx), dimensions, &multiplicity)==true)
+			return multiplicity;
+
+		return multiplicity_to_int(actual_amatrix_multiplicity(amx));
+	}
+
 	uint8_t result=cache_get_entry(amatrix_to_index(amx), dimensions);
 
 	/*
@@ -386,6 +886,21 @@ bool cached_amatrix_check_connectedness(struct amatrix_t *amx)
 	assert(amx->pmxs[0]->dimensions==amx->pmxs[1]->dimensions);
 	int dimensions=amx->pmxs[0]->dimensions;
 
+	/*
+		The sparse cache contains only connected topologies, if a topology is not
+		found it could be disconnected, or it might have never been visited.
+	*/
+
+	if(dimensions>amatrix_cache_max_dimensions)
+	{
+		int multiplicity;
+
+		if(sparse_cache_get_entry(amatrix_to_index(amx), dimensions, &multiplicity)==true)
+			return true;
+
+		return actual_amatrix_check_connectedness(amx);
+	}
+
 	uint8_t result=cache_get_entry(amatrix_to_index(amx), dimensions);
 
 	/*
@@ -401,3 +916,74 @@ bool cached_amatrix_check_connectedness(struct amatrix_t *amx)
 
 	return (result&0x20)?(true):(false);
 }
+
+/*
+	The topology cache, see above
+*/
+
+bool topology_cache_is_available(int dimensions)
+{
+	if((topology_cache==NULL)||(amatrix_cache_is_enabled==false))
+		return false;
+
+	return (dimensions>1)&&(dimensions<=CACHE_MAX_DIMENSIONS);
+}
+
+static inline int topology_cache_bucket(uint64_t index, int dimensions)
+{
+	uint64_t hash=(index*MAX_ORDER+dimensions)*0x9E3779B97F4A7C15ULL;
+
+	return hash>>(64-20);
+}
+
+const struct weight_info_t *topology_cache_get_entry(uint64_t index, int dimensions)
+{
+	assert(topology_cache_is_available(dimensions));
+
+	struct topology_entry_t *entry=atomic_load_explicit(&topology_cache[topology_cache_bucket(index, dimensions)], memory_order_acquire);
+
+	while(entry!=NULL)
+	{
+		if((entry->index==index)&&(entry->dimensions==dimensions))
+			return &entry->awt;
+
+		entry=entry->next;
+	}
+
+	return NULL;
+}
+
+/*
+	Inserts a copy of 'awt' in the topology cache, returning a pointer to it. If the cache
+	is full NULL is returned, and the caller has to keep using its own copy.
+
+	If two threads insert the same topology at the same time we end up with two identical
+	entries, which is harmless.
+*/
+
+const struct weight_info_t *topology_cache_set_entry(uint64_t index, int dimensions, const struct weight_info_t *awt)
+{
+	assert(topology_cache_is_available(dimensions));
+
+	size_t size=offsetof(struct topology_entry_t, awt)+weight_info_size(awt);
+
+	if((atomic_fetch_add(&topology_cache_size, size)+size)>TOPOLOGY_CACHE_MAX_SIZE)
+	{
+		atomic_fetch_sub(&topology_cache_size, size);
+		return NULL;
+	}
+
+	struct topology_entry_t *entry=malloc(size);
+	assert(entry!=NULL);
+
+	entry->index=index;
+	entry->dimensions=dimensions;
+	memcpy(&entry->awt, awt, weight_info_size(awt));
+
+	_Atomic(struct topology_entry_t *) *bucket=&topology_cache[topology_cache_bucket(index, dimensions)];
+
+	entry->next=atomic_load_explicit(bucket, memory_order_relaxed);
+	while(!atomic_compare_exchange_weak_explicit(bucket, &entry->next, entry, memory_order_release, memory_order_relaxed));
+
+	return &entry->awt;
+}
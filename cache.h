@@ -9,23 +9,56 @@
 #include "amatrix.h"
 #include "pmatrix.h"
 
+struct weight_info_t;
+
+/*
+	The largest dimension for which amatrix_to_index() can be used: (12!)^2 still fits in 58 bits.
+*/
+
+#define CACHE_MAX_DIMENSIONS	(12)
+
+/*
+	The header of the cache files, see cache.c
+*/
+
+#define CACHE_FILE_MAGIC	"MPNCACHE"
+#define CACHE_FILE_VERSION	(1)
+
+struct cache_header_t
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t dimensions;
+	uint32_t entry_size;
+	uint32_t reserved;
+	uint64_t nr_entries;
+	uint64_t checksum;
+};
+
 extern int amatrix_cache_max_dimensions;
 extern bool amatrix_cache_is_enabled;
+extern int cache_build_threads;
+extern bool cache_verify_checksums;
 
-int amatrix_to_index(struct amatrix_t *amx);
-int cache_largest_index(int dimensions);
+uint64_t amatrix_to_index(struct amatrix_t *amx);
+uint64_t cache_largest_index(int dimensions);
 
 gsl_matrix_int *permutation_to_matrix(const int *permutation,int dimensions);
 void matrix_to_permutation(gsl_matrix_int *m,int *permutation);
 void pmatrix_to_permutation(struct pmatrix_t *m,int *permutation);
 
 bool init_cache(int max_dimensions);
-void free_cache(void);
+void free_cache(bool save_sparse_caches);
 
-uint8_t cache_get_entry(int index, int dimensions);
-void cache_set_entry(int index, int dimensions, int multiplicity, bool isconnected);
+bool cache_is_available(int dimensions);
+uint8_t cache_get_entry(uint64_t index, int dimensions);
+void cache_set_entry(uint64_t index, int dimensions, int multiplicity, bool isconnected);
 
 int cached_amatrix_multiplicity(struct amatrix_t *amx);
 bool cached_amatrix_check_connectedness(struct amatrix_t *amx);
 
+bool topology_cache_is_available(int dimensions);
+const struct weight_info_t *topology_cache_get_entry(uint64_t index, int dimensions);
+const struct weight_info_t *topology_cache_set_entry(uint64_t index, int dimensions, const struct weight_info_t *awt);
+
 #endif //__CACHE_H__
@@ -3,6 +3,7 @@
 
 #include "config.h"
 #include "auxx.h"
+#include "limits.h"
 #include "inih/ini.h"
 
 /*
@@ -88,6 +89,15 @@ int configuration_handler(void *user,const char *section,const char *name,const
 		else
 			return 0;
 	}
+	else if(MATCH("general","livestats"))
+	{
+		if(!strcmp(value,"true"))
+			pconfig->livestats=true;
+		else if(!strcmp(value,"false"))
+			pconfig->livestats=false;
+		else
+			return 0;
+	}
 	else if(MATCH("parameters","unphysicalpenalty"))
 	{
 		pconfig->unphysicalpenalty=atof(value);
@@ -116,6 +126,106 @@ int configuration_handler(void *user,const char *section,const char *name,const
 	{
 		pconfig->decorrelation=atoi(value);
 	}
+	else if(MATCH("sampling","threads"))
+	{
+		pconfig->threads=atoi(value);
+
+		if(pconfig->threads<1)
+			return 0;
+	}
+	else if(MATCH("sampling","extendsqueezeweight"))
+	{
+		if((pconfig->extendsqueezeweight=atoi(value))<0)
+			return 0;
+	}
+	else if(MATCH("sampling","shuffleweight"))
+	{
+		if((pconfig->shuffleweight=atoi(value))<0)
+			return 0;
+	}
+	else if(MATCH("sampling","modifyweight"))
+	{
+		if((pconfig->modifyweight=atoi(value))<0)
+			return 0;
+	}
+	else if(MATCH("sampling","swapweight"))
+	{
+		if((pconfig->swapweight=atoi(value))<0)
+			return 0;
+	}
+	else if(MATCH("sampling","flip1weight"))
+	{
+		if((pconfig->flip1weight=atoi(value))<0)
+			return 0;
+	}
+	else if(MATCH("sampling","flip2weight"))
+	{
+		if((pconfig->flip2weight=atoi(value))<0)
+			return 0;
+	}
+	else if(MATCH("sampling","adaptiveupdates"))
+	{
+		if(!strcmp(value,"true"))
+			pconfig->adaptiveupdates=true;
+		else if(!strcmp(value,"false"))
+			pconfig->adaptiveupdates=false;
+		else
+			return 0;
+	}
+	else if(MATCH("sampling","checkpoint"))
+	{
+		if((pconfig->checkpoint=atof(value))<0.0f)
+			return 0;
+	}
+	else if(MATCH("sampling","resume"))
+	{
+		if(!strcmp(value,"true"))
+			pconfig->resume=true;
+		else if(!strcmp(value,"false"))
+			pconfig->resume=false;
+		else
+			return 0;
+	}
+	else if(MATCH("sampling","timeseries"))
+	{
+		if(!strcmp(value,"true"))
+			pconfig->timeseries=true;
+		else if(!strcmp(value,"false"))
+			pconfig->timeseries=false;
+		else
+			return 0;
+	}
+	else if(MATCH("sampling","replicas"))
+	{
+		pconfig->replicas=atoi(value);
+
+		if((pconfig->replicas<1)||(pconfig->replicas>MAX_REPLICAS))
+			return 0;
+	}
+	else if(MATCH("sampling","replicapenalty"))
+	{
+		if((pconfig->replicapenalty=atof(value))<=0.0f)
+			return 0;
+	}
+	else if(MATCH("sampling","replicaexchange"))
+	{
+		if((pconfig->replicaexchange=(long int)(dstrtol(value,(char **)NULL,10)))<1)
+			return 0;
+	}
+	else if(MATCH("sampling","reportinterval"))
+	{
+		if((pconfig->reportinterval=atof(value))<0.0f)
+			return 0;
+	}
+	else if(MATCH("sampling","energysampling"))
+	{
+		if(!strcmp(value,"true"))
+			pconfig->energysampling=true;
+		else if(!strcmp(value,"false"))
+			pconfig->energysampling=false;
+		else
+			return 0;
+	}
 	else
 	{
 		/* Unknown section/name, error */
@@ -131,6 +241,7 @@ void load_config_defaults(struct configuration_t *config)
 	config->progressbar=false;
 	config->erisfile=NULL;
 	config->seedrng=true;
+	config->livestats=true;
 
 	config->unphysicalpenalty=0.01f;
 	config->minorder=1;
@@ -140,6 +251,25 @@ void load_config_defaults(struct configuration_t *config)
 	config->thermalization=config->iterations/100;
 	config->timelimit=0.0f;
 	config->decorrelation=10;
+	config->threads=1;
+	config->energysampling=true;
+
+	config->extendsqueezeweight=1;
+	config->shuffleweight=1;
+	config->modifyweight=1;
+	config->swapweight=1;
+	config->flip1weight=1;
+	config->flip2weight=1;
+	config->adaptiveupdates=false;
+
+	config->checkpoint=0.0f;
+	config->resume=false;
+	config->timeseries=false;
+	config->reportinterval=0.0f;
+
+	config->replicas=1;
+	config->replicapenalty=1.0f;
+	config->replicaexchange=1024;
 
 	config->inipath=NULL;
 }
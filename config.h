@@ -11,6 +11,7 @@ struct configuration_t
 	bool progressbar;
 	char *erisfile;
 	bool seedrng;
+	bool livestats;
 
 	/* "parameters" section */
 
@@ -23,6 +24,35 @@ struct configuration_t
 	long int thermalization;
 	double timelimit;
 	int decorrelation;
+	int threads;
+	bool energysampling;
+
+	/* Relative weights of the updates, Extend and Squeeze share the same one */
+
+	int extendsqueezeweight,shuffleweight,modifyweight,swapweight,flip1weight,flip2weight;
+	bool adaptiveupdates;
+
+	/* Checkpoints: interval in seconds (0 disables them), and whether to resume from them */
+
+	double checkpoint;
+	bool resume;
+
+	/* Whether all the measured samples are also written to a file, see timeseries.h */
+
+	bool timeseries;
+
+	/*
+		Replica exchange: number of replicas, penalty of the last one, and number of
+		iterations between swap proposals. Replica exchange is disabled with a single replica.
+	*/
+
+	int replicas;
+	double replicapenalty;
+	long int replicaexchange;
+
+	/* Interval in seconds between partial reports when running with MPI (0 disables them) */
+
+	double reportinterval;
 
 	/* The name of the file the configuration has been loaded from */
 
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "loaderis.h"
+
+/*
+	Converts an ERI file from the text format produced by the scripts in the psi4 folder
+	to the binary format, which is much faster to load.
+*/
+
+void usage(char *argv0)
+{
+	printf("Usage: %s <input text file> <output binary file>\n",argv0);
+
+	exit(0);
+}
+
+int main(int argc,char *argv[])
+{
+	if(argc!=3)
+		usage(argv[0]);
+
+	FILE *in,*out;
+
+	if(!(in=fopen(argv[1],"r")))
+	{
+		fprintf(stderr,"Error: couldn't open %s for reading.\n",argv[1]);
+		return 1;
+	}
+
+	if(energies_file_is_binary(in)==true)
+	{
+		fprintf(stderr,"Error: %s is already a binary ERI file.\n",argv[1]);
+		fclose(in);
+		return 1;
+	}
+
+	struct energies_ctx_t ctx;
+
+	bool success=load_energies(in, &ctx);
+
+	fclose(in);
+
+	if(success==false)
+	{
+		fprintf(stderr,"Error: %s is not a valid ERI file.\n",argv[1]);
+		free_energies(&ctx);
+		return 1;
+	}
+
+	if(!(out=fopen(argv[2],"w")))
+	{
+		fprintf(stderr,"Error: couldn't open %s for writing.\n",argv[2]);
+		free_energies(&ctx);
+		return 1;
+	}
+
+	success=save_energies_binary(out, &ctx);
+
+	if((fclose(out)!=0)||(success==false))
+	{
+		fprintf(stderr,"Error: couldn't write %s.\n",argv[2]);
+		remove(argv[2]);
+		free_energies(&ctx);
+		return 1;
+	}
+
+	printf("Converted %s to %s (nocc=%d, nvirt=%d).\n",argv[1],argv[2],ctx.nocc,ctx.nvirt);
+
+	free_energies(&ctx);
+
+	return 0;
+}
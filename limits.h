@@ -21,3 +21,19 @@
 #ifndef MAX_NUMERATORS
 #define MAX_NUMERATORS		(16)
 #endif
+
+/*
+	Maximum number of replicas in replica exchange mode, see mc.c
+*/
+
+#ifndef MAX_REPLICAS
+#define MAX_REPLICAS		(32)
+#endif
+
+/*
+	Maximum amount of memory used by the topology cache, see cache.c
+*/
+
+#ifndef TOPOLOGY_CACHE_MAX_SIZE
+#define TOPOLOGY_CACHE_MAX_SIZE	(1ULL<<30)
+#endif
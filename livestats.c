@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "livestats.h"
+
+#define LIVESTATS_MAX_ATTEMPTS		(1024)
+
+struct livestats_t
+{
+	char name[64];
+
+	struct livestats_header_t *header;
+	size_t length;
+};
+
+static size_t livestats_length(int nr_chains)
+{
+	return sizeof(struct livestats_header_t)+nr_chains*sizeof(struct livestats_chain_t);
+}
+
+/*
+	A PID alone does not identify a process: /dev/shm can be shared by containers with their
+	own PID namespaces, where the same PID means a different process, and PIDs are reused.
+	The header also records the PID namespace of the process (the inode of /proc/self/ns/pid)
+	and its start time (in clock ticks since boot, from /proc/<pid>/stat). Both are 0 if they
+	are not available, e.g. on systems without /proc.
+*/
+
+static uint64_t livestats_pid_namespace(void)
+{
+	struct stat st;
+
+	if(stat("/proc/self/ns/pid",&st)!=0)
+		return 0;
+
+	return st.st_ino;
+}
+
+static uint64_t livestats_start_time(pid_t pid)
+{
+	char filename[64],line[1024];
+	FILE *in;
+
+	snprintf(filename,64,"/proc/%d/stat",(int)(pid));
+	filename[63]='\0';
+
+	if(!(in=fopen(filename,"r")))
+		return 0;
+
+	size_t length=fread(line, 1, 1023, in);
+	line[length]='\0';
+	fclose(in);
+
+	/*
+		The start time is the 22nd field, the second one is the name of the executable
+		in parentheses, which may contain spaces.
+	*/
+
+	char *field=strrchr(line,')');
+
+	for(int c=2;(field!=NULL)&&(c<22);c++)
+		field=strchr(field+1,' ');
+
+	return (field!=NULL)?(strtoull(field+1,NULL,10)):(0);
+}
+
+/*
+	A segment is stale if its process is in the same PID namespace as the caller, and either
+	it does not exist anymore, or the PID now belongs to a process started at a different time.
+	Segments coming from other namespaces are never considered stale, since their processes
+	cannot be checked from here.
+*/
+
+bool livestats_is_stale(const struct livestats_header_t *header)
+{
+	uint64_t pidns=livestats_pid_namespace();
+
+	if((pidns==0)||(header->pidns!=pidns))
+		return false;
+
+	if((kill(header->pid,0)!=0)&&(errno==ESRCH))
+		return true;
+
+	uint64_t starttime=livestats_start_time(header->pid);
+
+	return (starttime!=0)&&(header->starttime!=0)&&(starttime!=header->starttime);
+}
+
+/*
+	The segments left behind by processes that have been killed (e.g. with SIGKILL, or by the
+	batch system) are removed. Segments that cannot be read, or that belong to other users,
+	are left alone.
+*/
+
+void livestats_remove_stale(void)
+{
+	DIR *dir;
+
+	if(!(dir=opendir("/dev/shm")))
+		return;
+
+	struct dirent *entry;
+
+	while((entry=readdir(dir))!=NULL)
+	{
+		const struct livestats_header_t *header;
+		char name[1024];
+		size_t length;
+
+		if(strncmp(entry->d_name,LIVESTATS_PREFIX+1,strlen(LIVESTATS_PREFIX)-1)!=0)
+			continue;
+
+		snprintf(name,1024,"/%s",entry->d_name);
+		name[1023]='\0';
+
+		if(!(header=livestats_map(name,&length)))
+			continue;
+
+		bool stale=livestats_is_stale(header);
+
+		livestats_unmap(header,length);
+
+		if(stale==true)
+			shm_unlink(name);
+	}
+
+	closedir(dir);
+}
+
+/*
+	The segment is created and zeroed, then the header is copied: the magic is written last, so
+	that a reader never sees an incomplete header. Returns NULL if the segment cannot be created.
+*/
+
+struct livestats_t *init_livestats(const struct livestats_header_t *header)
+{
+	livestats_remove_stale();
+
+	struct livestats_t *ret=malloc(sizeof(struct livestats_t));
+	assert(ret!=NULL);
+
+	snprintf(ret->name,64,"%s%d",LIVESTATS_PREFIX,(int)(getpid()));
+	ret->name[63]='\0';
+	ret->length=livestats_length(header->nr_chains);
+
+	int fd;
+
+	if((fd=shm_open(ret->name,O_RDWR|O_CREAT|O_TRUNC,0644))<0)
+	{
+		free(ret);
+		return NULL;
+	}
+
+	void *segment=MAP_FAILED;
+
+	if(ftruncate(fd,ret->length)==0)
+		segment=mmap(NULL,ret->length,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+
+	close(fd);
+
+	if(segment==MAP_FAILED)
+	{
+		shm_unlink(ret->name);
+		free(ret);
+		return NULL;
+	}
+
+	ret->header=(struct livestats_header_t *)(segment);
+
+	memcpy(ret->header, header, sizeof(struct livestats_header_t));
+	memset(ret->header->magic, 0, 8);
+	ret->header->version=LIVESTATS_VERSION;
+	ret->header->pid=getpid();
+	ret->header->pidns=livestats_pid_namespace();
+	ret->header->starttime=livestats_start_time(getpid());
+
+	atomic_thread_fence(memory_order_release);
+	memcpy(ret->header->magic, LIVESTATS_MAGIC, 8);
+
+	return ret;
+}
+
+void fini_livestats(struct livestats_t *ls)
+{
+	if(ls)
+	{
+		munmap(ls->header,ls->length);
+		shm_unlink(ls->name);
+		free(ls);
+	}
+}
+
+struct livestats_chain_t *livestats_get_chain(struct livestats_t *ls,int chain)
+{
+	assert((chain>=0)&&(chain<ls->header->nr_chains));
+
+	return &((struct livestats_chain_t *)(ls->header+1))[chain];
+}
+
+/*
+	Only the chain owning a slot writes to it, between these two calls.
+*/
+
+struct livestats_data_t *livestats_begin_update(struct livestats_chain_t *slot)
+{
+	uint64_t sequence=atomic_load_explicit(&slot->sequence,memory_order_relaxed);
+
+	atomic_store_explicit(&slot->sequence,sequence+1,memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	return &slot->data;
+}
+
+void livestats_end_update(struct livestats_chain_t *slot)
+{
+	uint64_t sequence=atomic_load_explicit(&slot->sequence,memory_order_relaxed);
+
+	atomic_store_explicit(&slot->sequence,sequence+1,memory_order_release);
+}
+
+/*
+	Maps the segment of another process, read-only: returns NULL if it is not a valid segment.
+*/
+
+const struct livestats_header_t *livestats_map(const char *name,size_t *length)
+{
+	int fd;
+	struct stat st;
+
+	if((fd=shm_open(name,O_RDONLY,0))<0)
+		return NULL;
+
+	if((fstat(fd,&st)!=0)||(st.st_size<(off_t)(sizeof(struct livestats_header_t))))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	void *segment=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+
+	close(fd);
+
+	if(segment==MAP_FAILED)
+		return NULL;
+
+	const struct livestats_header_t *header=(const struct livestats_header_t *)(segment);
+
+	bool valid=(memcmp(header->magic, LIVESTATS_MAGIC, 8)==0);
+
+	atomic_thread_fence(memory_order_acquire);
+
+	if((valid==false)||(header->version!=LIVESTATS_VERSION)||(header->nr_chains<0)||
+	   (header->nr_updates<0)||(header->nr_updates>LIVESTATS_MAX_UPDATES)||
+	   (header->minorder<0)||(header->minorder>header->maxorder)||(header->maxorder>=MAX_ORDER)||
+	   ((size_t)(st.st_size)<livestats_length(header->nr_chains)))
+	{
+		munmap(segment,st.st_size);
+		return NULL;
+	}
+
+	*length=st.st_size;
+
+	return header;
+}
+
+void livestats_unmap(const struct livestats_header_t *header,size_t length)
+{
+	munmap((void *)(header),length);
+}
+
+const struct livestats_chain_t *livestats_get_mapped_chain(const struct livestats_header_t *header,int chain)
+{
+	assert((chain>=0)&&(chain<header->nr_chains));
+
+	return &((const struct livestats_chain_t *)(header+1))[chain];
+}
+
+/*
+	The data are copied, and the copy is valid only if the sequence number was even and did
+	not change in the meantime. Returns false if the chain was always caught writing.
+*/
+
+bool livestats_read_chain(const struct livestats_chain_t *slot,struct livestats_data_t *data)
+{
+	for(int attempt=0;attempt<LIVESTATS_MAX_ATTEMPTS;attempt++)
+	{
+		uint64_t before=atomic_load_explicit((_Atomic uint64_t *)(&slot->sequence),memory_order_acquire);
+
+		if((before%2)!=0)
+			continue;
+
+		memcpy(data, &slot->data, sizeof(struct livestats_data_t));
+		atomic_thread_fence(memory_order_acquire);
+
+		uint64_t after=atomic_load_explicit((_Atomic uint64_t *)(&slot->sequence),memory_order_relaxed);
+
+		if(before==after)
+			return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,97 @@
+#ifndef __LIVESTATS_H__
+#define __LIVESTATS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "limits.h"
+
+/*
+	Live statistics: every running mpn process publishes the progress of its chains in a POSIX
+	shared memory segment, named after its PID, where they can be read at any time by mpn-top.
+
+	The segment contains this header, written once before the chains start, followed by a slot
+	for each chain. Each chain updates its own slot every LIVESTATS_INTERVAL iterations, without
+	locks: the sequence number is odd while the data are being written, so a reader knows
+	it has to try again if it is odd, or if it has changed while the data were being copied.
+*/
+
+#define LIVESTATS_PREFIX		"/mpn."
+#define LIVESTATS_MAGIC			"MPNLIVES"
+#define LIVESTATS_VERSION		(2)
+
+#define LIVESTATS_INTERVAL		(16384)
+#define LIVESTATS_MAX_UPDATES		(8)
+
+struct livestats_header_t
+{
+	char magic[8];
+	uint32_t version;
+	int32_t pid,nr_chains,nr_updates;
+	int32_t minorder,maxorder;
+	int64_t iterations;
+
+	/*
+		Together with the PID, these identify the process, see livestats_is_stale()
+	*/
+
+	uint64_t pidns,starttime;
+
+	char prefix[64];
+	char update_names[LIVESTATS_MAX_UPDATES][16];
+};
+
+struct livestats_data_t
+{
+	int32_t id;
+	bool finished;
+
+	int64_t counter;
+	double elapsed,rate;
+
+	int64_t proposed[LIVESTATS_MAX_UPDATES],accepted[LIVESTATS_MAX_UPDATES];
+	int64_t nr_samples,nr_physical_samples;
+
+	/*
+		The measurements at each order, and the contributions with their current error estimate
+	*/
+
+	int64_t nr_positive[MAX_ORDER],nr_negative[MAX_ORDER];
+	double contribution[MAX_ORDER],stderror[MAX_ORDER];
+};
+
+struct livestats_chain_t
+{
+	_Atomic uint64_t sequence;
+	struct livestats_data_t data;
+};
+
+/*
+	The writer side, used by mpn
+*/
+
+struct livestats_t;
+
+struct livestats_t *init_livestats(const struct livestats_header_t *header);
+void fini_livestats(struct livestats_t *ls);
+
+struct livestats_chain_t *livestats_get_chain(struct livestats_t *ls,int chain);
+struct livestats_data_t *livestats_begin_update(struct livestats_chain_t *slot);
+void livestats_end_update(struct livestats_chain_t *slot);
+
+/*
+	The reader side, used by mpn-top
+*/
+
+const struct livestats_header_t *livestats_map(const char *name,size_t *length);
+void livestats_unmap(const struct livestats_header_t *header,size_t length);
+
+bool livestats_is_stale(const struct livestats_header_t *header);
+void livestats_remove_stale(void);
+
+const struct livestats_chain_t *livestats_get_mapped_chain(const struct livestats_header_t *header,int chain);
+bool livestats_read_chain(const struct livestats_chain_t *slot,struct livestats_data_t *data);
+
+#endif //__LIVESTATS_H__
@@ -3,27 +3,169 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "loaderis.h"
 #include "auxx.h"
 
-int eritensor_index(int i, int j, int a, int b, int nocc, int nvirt)
+/*
+	The antisymmetrized integrals satisfy
+
+	<ij||ab> = -<ji||ab> = -<ij||ba> = <ji||ba> = <ab||ij>
+
+	and they vanish when i=j or a=b. Therefore we only store about 1/8 of the full tensor.
+
+	Moreover the tensor is sliced in blocks, according to the occupied/virtual character of
+	the indices: each pair of indices is reordered so that it is of type oo, ov or vv, and then
+	the two pairs are reordered so that the first one has the "larger" type, giving the six blocks
+	oo|oo, ov|oo, ov|ov, vv|oo, vv|ov and vv|vv, each one stored contiguously. Within each block the
+	indices are local, i.e. counted separately for occupied and virtual orbitals.
+
+	The weight calculation always accesses the tensor with a fixed occupied/virtual pattern for each
+	numerator, that can be determined when the 'weight_info_t' struct is built, so that the lookup
+	only involves a small region of memory, see get_eri_pattern().
+*/
+
+#define ERI_PAIR_OO	(0)
+#define ERI_PAIR_OV	(1)
+#define ERI_PAIR_VV	(2)
+
+static inline int eri_block(int X, int Y)
+{
+	assert(X>=Y);
+
+	return X*(X+1)/2+Y;
+}
+
+static inline int64_t eri_pair_index(int type, int p, int q, int nocc)
+{
+	/*
+		For oo and vv pairs we have p<q, for ov pairs p is occupied and q is virtual.
+	*/
+
+	if(type==ERI_PAIR_OV)
+		return ((int64_t)(q))*nocc+p;
+
+	assert(p<q);
+
+	return ((int64_t)(q))*(q-1)/2+p;
+}
+
+void eri_setup_blocks(struct energies_ctx_t *ctx)
+{
+	ctx->eri_nr_pairs[ERI_PAIR_OO]=((int64_t)(ctx->nocc))*(ctx->nocc-1)/2;
+	ctx->eri_nr_pairs[ERI_PAIR_OV]=((int64_t)(ctx->nocc))*ctx->nvirt;
+	ctx->eri_nr_pairs[ERI_PAIR_VV]=((int64_t)(ctx->nvirt))*(ctx->nvirt-1)/2;
+
+	int64_t offset=0;
+
+	for(int X=0;X<3;X++)
+	{
+		for(int Y=0;Y<=X;Y++)
+		{
+			int64_t nX=ctx->eri_nr_pairs[X];
+			int64_t nY=ctx->eri_nr_pairs[Y];
+
+			ctx->eri_block_offsets[eri_block(X, Y)]=offset;
+			offset+=(X==Y)?(nX*(nX+1)/2):(nX*nY);
+		}
+	}
+
+	ctx->eri_block_offsets[6]=offset;
+}
+
+uint64_t eritensor_size(int nocc, int nvirt)
 {
-	int ntot=nocc+nvirt;
+	struct energies_ctx_t ctx;
 
-	assert((i>=0)&&(i<ntot));
-	assert((j>=0)&&(j<ntot));
-	assert((a>=0)&&(a<ntot));
-	assert((b>=0)&&(b<ntot));
+	ctx.nocc=nocc;
+	ctx.nvirt=nvirt;
+	eri_setup_blocks(&ctx);
 
-	return ((i*ntot+j)*ntot+a)*ntot+b;
+	return ctx.eri_block_offsets[6];
 }
 
-int eritensor_size(int nocc, int nvirt)
+/*
+	Returns the position of <ij||ab> in the tensor, and the sign it has to be multiplied by,
+	or -1 if the integral vanishes by symmetry. The indices are local, and the bits of 'pattern'
+	tell which ones are virtual: bit 0 for i, bit 1 for j, bit 2 for a and bit 3 for b.
+*/
+
+static inline int64_t eritensor_index(struct energies_ctx_t *ctx, int pattern, int i, int j, int a, int b, int *sign)
 {
-	int ntot=nocc+nvirt;
+	int ti=(pattern>>0)&1;
+	int tj=(pattern>>1)&1;
+	int ta=(pattern>>2)&1;
+	int tb=(pattern>>3)&1;
+
+	if(((ti==tj)&&(i==j))||((ta==tb)&&(a==b)))
+		return -1;
+
+	*sign=1;
+
+	if((ti>tj)||((ti==tj)&&(i>j)))
+	{
+		int tmp=i;
+		i=j;
+		j=tmp;
+
+		*sign=-*sign;
+	}
+
+	if((ta>tb)||((ta==tb)&&(a>b)))
+	{
+		int tmp=a;
+		a=b;
+		b=tmp;
+
+		*sign=-*sign;
+	}
+
+	int X=ti+tj;
+	int Y=ta+tb;
+
+	int64_t P=eri_pair_index(X, i, j, ctx->nocc);
+	int64_t R=eri_pair_index(Y, a, b, ctx->nocc);
 
-	return 1+eritensor_index(ntot-1, ntot-1, ntot-1, ntot-1, nocc, nvirt);
+	if((X<Y)||((X==Y)&&(P<R)))
+	{
+		int tmp=X;
+		X=Y;
+		Y=tmp;
+
+		int64_t tmp64=P;
+		P=R;
+		R=tmp64;
+	}
+
+	int64_t offset=(X==Y)?(P*(P+1)/2+R):(P*ctx->eri_nr_pairs[Y]+R);
+
+	return ctx->eri_block_offsets[eri_block(X, Y)]+offset;
+}
+
+/*
+	Converts global indices, in which the virtual orbitals come after the occupied ones,
+	to local indices, returning the occupied/virtual pattern.
+*/
+
+static inline int eri_global_to_local(struct energies_ctx_t *ctx, int *i, int *j, int *a, int *b)
+{
+	int pattern=0;
+	int *indices[4]={i, j, a, b};
+
+	for(int c=0;c<4;c++)
+	{
+		if(*indices[c]>=ctx->nocc)
+		{
+			*indices[c]-=ctx->nocc;
+			pattern|=(1<<c);
+		}
+	}
+
+	return pattern;
 }
 
 #define MAX_TOKENS		(1024)
@@ -136,16 +278,51 @@ bool parse_tokens(char tokens[MAX_TOKENS][TOKEN_MAX_LENGTH],int nrtokens,struct
 			printf("\n");
 
 			ctx->eritensor=malloc(sizeof(double)*eritensor_size(ctx->nocc, ctx->nvirt));
+			assert(ctx->eritensor!=NULL);
+
+			eri_setup_blocks(ctx);
+
+			/*
+				Entries that are never set are marked with a NaN
+			*/
+
+			for(uint64_t c=0;c<eritensor_size(ctx->nocc, ctx->nvirt);c++)
+				ctx->eritensor[c]=NAN;
 		}
 
-		int i,j,a,b;
+		int i,j,a,b,sign,ntot=ctx->nocc+ctx->nvirt;
 
 		i=atoi(tokens[1]);
 		j=atoi(tokens[2]);
 		a=atoi(tokens[3]);
 		b=atoi(tokens[4]);
 
-		ctx->eritensor[eritensor_index(i, j, a, b, ctx->nocc, ctx->nvirt)]=atof(tokens[5]);
+		if((i<0)||(i>=ntot)||(j<0)||(j>=ntot)||(a<0)||(a>=ntot)||(b<0)||(b>=ntot))
+			return false;
+
+		double value=atof(tokens[5]);
+		int pattern=eri_global_to_local(ctx, &i, &j, &a, &b);
+		int64_t index=eritensor_index(ctx, pattern, i, j, a, b, &sign);
+
+		/*
+			The integrals that are related by symmetry should be the same, up to
+			numerical noise, otherwise the packed storage cannot be used.
+		*/
+
+		if(index==-1)
+		{
+			if(fabs(value)>ERIS_SYMMETRY_TOLERANCE)
+				ctx->nr_asymmetric++;
+		}
+		else
+		{
+			double *entry=&ctx->eritensor[index];
+
+			if((!isnan(*entry))&&(fabs(*entry-sign*value)>ERIS_SYMMETRY_TOLERANCE))
+				ctx->nr_asymmetric++;
+
+			*entry=sign*value;
+		}
 	}
 	else
 	{
@@ -173,6 +350,14 @@ bool load_energies(FILE *in, struct energies_ctx_t *ctx)
 
 	ctx->eritensor=NULL;
 
+	ctx->buffer=NULL;
+	ctx->buffer_size=0;
+	ctx->buffer_is_mapped=false;
+
+	ctx->nr_asymmetric=0;
+
+	ctx->occupied_sampler=ctx->virtual_sampler=NULL;
+
 	while((!feof(in))&&(!ferror(in)))
 	{
 		char line[1024];
@@ -241,9 +426,241 @@ bool load_energies(FILE *in, struct energies_ctx_t *ctx)
 	if(ctx->eritensor==NULL)
 		return false;
 
+	if(ctx->nr_asymmetric>0)
+	{
+		printf("Error: %ld integrals do not have the symmetries of antisymmetrized integrals!\n",ctx->nr_asymmetric);
+		return false;
+	}
+
+	uint64_t nr_missing=0;
+
+	for(uint64_t c=0;c<eritensor_size(ctx->nocc, ctx->nvirt);c++)
+	{
+		if(isnan(ctx->eritensor[c]))
+		{
+			ctx->eritensor[c]=0.0f;
+			nr_missing++;
+		}
+	}
+
+	if(nr_missing>0)
+		printf("Warning: %llu integrals are missing, setting them to zero.\n",(unsigned long long)(nr_missing));
+
 	return true;
 }
 
+/*
+	Binary files can be loaded much faster: the file is mapped in memory, so that the
+	tensor is not even copied, or if that is not possible it is read in one shot.
+*/
+
+bool energies_file_is_binary(FILE *in)
+{
+	char magic[8];
+	bool ret;
+
+	ret=(fread(magic, 1, 8, in)==8)&&(memcmp(magic, ERIS_FILE_MAGIC, 8)==0);
+	rewind(in);
+
+	return ret;
+}
+
+bool load_energies_binary(FILE *in, struct energies_ctx_t *ctx)
+{
+	struct eris_header_t header;
+	struct stat st;
+
+	ctx->eocc=ctx->evirt=ctx->hdiag=ctx->eritensor=NULL;
+	ctx->buffer=NULL;
+	ctx->buffer_size=0;
+	ctx->buffer_is_mapped=false;
+	ctx->nr_asymmetric=0;
+	ctx->occupied_sampler=ctx->virtual_sampler=NULL;
+
+	if((fstat(fileno(in), &st)!=0)||(fread(&header, sizeof(struct eris_header_t), 1, in)!=1))
+		return false;
+
+	if((memcmp(header.magic, ERIS_FILE_MAGIC, 8)!=0)||(header.version!=ERIS_FILE_VERSION))
+	{
+		printf("Unknown ERIs file format or version, please convert the file again with mpn-convert-eris!\n");
+		return false;
+	}
+
+	if((header.nocc<=0)||(header.nvirt<=0)||(header.nso!=(header.nocc+header.nvirt)))
+		return false;
+
+	if(header.tensor_size!=eritensor_size(header.nocc, header.nvirt))
+		return false;
+
+	size_t size=sizeof(struct eris_header_t)+sizeof(double)*(2*header.nocc+header.nvirt+header.tensor_size);
+
+	if((size_t)(st.st_size)!=size)
+	{
+		printf("The ERIs file has the wrong size (%llu != %llu)!\n",(unsigned long long)(st.st_size),(unsigned long long)(size));
+		return false;
+	}
+
+	void *buffer=mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+
+	if(buffer!=MAP_FAILED)
+	{
+		ctx->buffer_is_mapped=true;
+	}
+	else
+	{
+		buffer=malloc(size);
+
+		if((buffer==NULL)||(fseek(in, 0, SEEK_SET)!=0)||(fread(buffer, 1, size, in)!=size))
+		{
+			if(buffer)
+				free(buffer);
+
+			return false;
+		}
+
+		ctx->buffer_is_mapped=false;
+	}
+
+	ctx->buffer=buffer;
+	ctx->buffer_size=size;
+
+	ctx->nso=header.nso;
+	ctx->nocc=header.nocc;
+	ctx->nvirt=header.nvirt;
+	ctx->hfe=header.hfe;
+	ctx->enuc=header.enuc;
+
+	double *data=(double *)(((char *)(buffer))+sizeof(struct eris_header_t));
+
+	ctx->eocc=data;
+	ctx->evirt=ctx->eocc+ctx->nocc;
+	ctx->hdiag=ctx->evirt+ctx->nvirt;
+	ctx->eritensor=ctx->hdiag+ctx->nocc;
+
+	eri_setup_blocks(ctx);
+
+	printf("Tensor size: ");
+	print_file_size(stdout,sizeof(double)*header.tensor_size);
+	printf("\n");
+
+	return true;
+}
+
+bool save_energies_binary(FILE *out, struct energies_ctx_t *ctx)
+{
+	struct eris_header_t header;
+
+	memset(&header, 0, sizeof(struct eris_header_t));
+	memcpy(header.magic, ERIS_FILE_MAGIC, 8);
+	header.version=ERIS_FILE_VERSION;
+	header.nso=ctx->nso;
+	header.nocc=ctx->nocc;
+	header.nvirt=ctx->nvirt;
+	header.hfe=ctx->hfe;
+	header.enuc=ctx->enuc;
+	header.tensor_size=eritensor_size(ctx->nocc, ctx->nvirt);
+
+	if(fwrite(&header, sizeof(struct eris_header_t), 1, out)!=1)
+		return false;
+
+	if(fwrite(ctx->eocc, sizeof(double), ctx->nocc, out)!=(size_t)(ctx->nocc))
+		return false;
+
+	if(fwrite(ctx->evirt, sizeof(double), ctx->nvirt, out)!=(size_t)(ctx->nvirt))
+		return false;
+
+	if(fwrite(ctx->hdiag, sizeof(double), ctx->nocc, out)!=(size_t)(ctx->nocc))
+		return false;
+
+	if(fwrite(ctx->eritensor, sizeof(double), header.tensor_size, out)!=header.tensor_size)
+		return false;
+
+	return true;
+}
+
+/*
+	Frees the arrays in the context, but not the context itself.
+*/
+
+void free_energies(struct energies_ctx_t *ctx)
+{
+	if(ctx->buffer!=NULL)
+	{
+		if(ctx->buffer_is_mapped==true)
+			munmap(ctx->buffer, ctx->buffer_size);
+		else
+			free(ctx->buffer);
+	}
+	else
+	{
+		if(ctx->eocc)
+			free(ctx->eocc);
+
+		if(ctx->evirt)
+			free(ctx->evirt);
+
+		if(ctx->hdiag)
+			free(ctx->hdiag);
+
+		if(ctx->eritensor)
+			free(ctx->eritensor);
+	}
+
+	ctx->eocc=ctx->evirt=ctx->hdiag=ctx->eritensor=NULL;
+	ctx->buffer=NULL;
+
+	fini_alias_table(ctx->occupied_sampler);
+	fini_alias_table(ctx->virtual_sampler);
+	ctx->occupied_sampler=ctx->virtual_sampler=NULL;
+}
+
+/*
+	The labels of the orbitals are proposed according to the energy denominators they
+	can contribute to: an occupied orbital i is weighted by 1/(e_LUMO-e_i) and a virtual
+	orbital a by 1/(e_a-e_HOMO), so that the low-lying excitations, which dominate the
+	weight of a diagram, are proposed more often.
+
+	If the gap between occupied and virtual orbitals is not positive the weights make no
+	sense, and the tables are not created, falling back to uniform sampling.
+*/
+
+bool init_label_samplers(struct energies_ctx_t *ctx)
+{
+	assert((ctx->nocc>0)&&(ctx->nvirt>0));
+
+	double homo=ctx->eocc[0];
+	double lumo=ctx->evirt[0];
+
+	for(int i=1;i<ctx->nocc;i++)
+		homo=MAX(homo, ctx->eocc[i]);
+
+	for(int a=1;a<ctx->nvirt;a++)
+		lumo=MIN(lumo, ctx->evirt[a]);
+
+	if(lumo<=homo)
+	{
+		printf("Warning: the HOMO-LUMO gap is not positive, the labels will be sampled uniformly.\n");
+		return false;
+	}
+
+	double *weights=malloc(sizeof(double)*MAX(ctx->nocc, ctx->nvirt));
+	assert(weights!=NULL);
+
+	for(int i=0;i<ctx->nocc;i++)
+		weights[i]=1.0f/(lumo-ctx->eocc[i]);
+
+	ctx->occupied_sampler=init_alias_table(weights, ctx->nocc);
+
+	for(int a=0;a<ctx->nvirt;a++)
+		weights[a]=1.0f/(ctx->evirt[a]-homo);
+
+	ctx->virtual_sampler=init_alias_table(weights, ctx->nvirt);
+
+	free(weights);
+
+	return (ctx->occupied_sampler!=NULL)&&(ctx->virtual_sampler!=NULL);
+}
+
 /*
 	Remember that in this context the indices can take the following values:
 
@@ -294,5 +711,28 @@ double get_eri(struct energies_ctx_t *ctx, int i, int j, int a, int b)
 	assert((a>=0)&&(a<(ctx->nocc+ctx->nvirt)));
 	assert((b>=0)&&(b<(ctx->nocc+ctx->nvirt)));
 
-	return ctx->eritensor[eritensor_index(i, j, a, b, ctx->nocc, ctx->nvirt)];
+	int pattern=eri_global_to_local(ctx, &i, &j, &a, &b);
+
+	return get_eri_pattern(ctx, pattern, i, j, a, b);
+}
+
+/*
+	Same as get_eri(), but with local indices and with the occupied/virtual pattern
+	given explicitly, see eritensor_index() and eri_pattern().
+*/
+
+double get_eri_pattern(struct energies_ctx_t *ctx, int pattern, int i, int j, int a, int b)
+{
+	int sign;
+	int64_t index=eritensor_index(ctx, pattern, i, j, a, b, &sign);
+
+	if(index==-1)
+		return 0.0f;
+
+	return (sign>0)?(ctx->eritensor[index]):(-ctx->eritensor[index]);
+}
+
+int eri_pattern(bool ivirtual, bool jvirtual, bool avirtual, bool bvirtual)
+{
+	return ((ivirtual==true)?(1):(0))|((jvirtual==true)?(2):(0))|((avirtual==true)?(4):(0))|((bvirtual==true)?(8):(0));
 }
@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 
 struct energies_ctx_t
 {
@@ -12,9 +14,69 @@ struct energies_ctx_t
 	double enuc;
 	double *hdiag;
 	double *eritensor;
+
+	/*
+		When loaded from a binary file, all the arrays above point inside this buffer,
+		which is either a memory mapping of the file or a copy of it.
+	*/
+
+	void *buffer;
+	size_t buffer_size;
+	bool buffer_is_mapped;
+
+	/*
+		Number of integrals not satisfying the antisymmetry, when loading a text file.
+	*/
+
+	long nr_asymmetric;
+
+	/*
+		The number of oo, ov and vv pairs, and the position of the six blocks
+		of the tensor (the last one is the total size), see loaderis.c
+	*/
+
+	int64_t eri_nr_pairs[3];
+	int64_t eri_block_offsets[7];
+
+	/*
+		Alias tables for proposing the labels of occupied and virtual
+		orbitals according to their energies, see init_label_samplers()
+	*/
+
+	struct alias_table_t *occupied_sampler,*virtual_sampler;
 };
 
+/*
+	Integrals related by symmetry are allowed to differ at most by this amount
+*/
+
+#define ERIS_SYMMETRY_TOLERANCE	(1e-8)
+
+/*
+	The binary ERI file: this header, followed by eocc[nocc], evirt[nvirt], hdiag[nocc]
+	and by the packed ERI tensor (see loaderis.c), all as doubles in the native byte order.
+*/
+
+#define ERIS_FILE_MAGIC		"MPNERIS"
+#define ERIS_FILE_VERSION	(3)
+
+struct eris_header_t
+{
+	char magic[8];
+	uint32_t version;
+	int32_t nso,nocc,nvirt;
+	double hfe,enuc;
+	uint64_t tensor_size;
+};
+
+uint64_t eritensor_size(int nocc, int nvirt);
+
 bool load_energies(FILE *in, struct energies_ctx_t *ctx);
+bool load_energies_binary(FILE *in, struct energies_ctx_t *ctx);
+bool save_energies_binary(FILE *out, struct energies_ctx_t *ctx);
+bool energies_file_is_binary(FILE *in);
+void free_energies(struct energies_ctx_t *ctx);
+bool init_label_samplers(struct energies_ctx_t *ctx);
 
 double get_occupied_energy(struct energies_ctx_t *ctx,int n);
 double get_virtual_energy(struct energies_ctx_t *ctx,int n);
@@ -22,5 +84,7 @@ double get_hfe(struct energies_ctx_t *ctx);
 double get_enuc(struct energies_ctx_t *ctx);
 double get_hdiag(struct energies_ctx_t *ctx,int n);
 double get_eri(struct energies_ctx_t *ctx, int i, int j, int a, int b);
+double get_eri_pattern(struct energies_ctx_t *ctx, int pattern, int i, int j, int a, int b);
+int eri_pattern(bool ivirtual, bool jvirtual, bool avirtual, bool bvirtual);
 
 #endif //__READER_H__
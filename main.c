@@ -3,10 +3,13 @@
 
 #include <gsl/gsl_rng.h>
 
+#ifdef MPN_WITH_MPI
+#include <mpi.h>
+#endif
+
 #include "config.h"
 #include "cache.h"
 #include "mc.h"
-#include "permutations.h"
 
 void usage(char *argv0)
 {
@@ -17,6 +20,31 @@ void usage(char *argv0)
 
 int main(int argc,char *argv[])
 {
+#ifdef MPN_WITH_MPI
+	int provided,rank;
+
+	/*
+		Only the main thread of each process makes MPI calls, see do_diagmc().
+	*/
+
+	MPI_Init_thread(&argc,&argv,MPI_THREAD_FUNNELED,&provided);
+	MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+
+	if(provided<MPI_THREAD_FUNNELED)
+	{
+		fprintf(stderr,"Error: the MPI library does not support threads.\n");
+		MPI_Abort(MPI_COMM_WORLD,1);
+	}
+
+	/*
+		The processes other than the first one would only repeat the same messages,
+		errors and warnings printed on stderr are still shown.
+	*/
+
+	if(rank!=0)
+		freopen("/dev/null","w",stdout);
+#endif
+
 	if(argc<2)
 		usage(argv[0]);
 
@@ -30,8 +58,6 @@ int main(int argc,char *argv[])
 		{
 			printf("Diagrammatic Monte Carlo for Møller-Plesset theory.\n");
 
-			init_permutation_tables(8);
-
 			amatrix_cache_is_enabled=true;
 			init_cache(6);
 		}
@@ -48,5 +74,18 @@ int main(int argc,char *argv[])
 			printf("\n");
 	}
 
-	free_cache();
+	/*
+		With MPI all the processes usually share the same directory, and only the first
+		one saves the sparse caches, see save_sparse_cache_to_file().
+	*/
+
+#ifdef MPN_WITH_MPI
+	free_cache(rank==0);
+#else
+	free_cache(true);
+#endif
+
+#ifdef MPN_WITH_MPI
+	MPI_Finalize();
+#endif
 }
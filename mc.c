@@ -1,7 +1,17 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <math.h>
 #include <assert.h>
+#include <time.h>
 #include <sys/time.h>
 #include <signal.h>
+#include <pthread.h>
+
+#ifdef MPN_WITH_MPI
+#include <mpi.h>
+#endif
 
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_rng.h>
@@ -15,6 +25,8 @@
 #include "weight.h"
 #include "sampling.h"
 #include "rfactors.h"
+#include "results.h"
+#include "livestats.h"
 
 #include "libprogressbar/progressbar.h"
 
@@ -30,10 +42,10 @@ int update_extend(struct amatrix_t *amx, bool always_accept)
 	if(amx->pmxs[0]->dimensions>=amx->config->maxorder)
 		return UPDATE_UNPHYSICAL;
 
-	struct amatrix_backup_t backup;
-	amatrix_save(amx, &backup);
+	struct amatrix_undo_t undo;
+	amatrix_undo_begin(amx, &undo);
 
-	extend_probability=1.0f/pow(amx->pmxs[0]->dimensions+1, 2.0f)/pow(amx->nr_occupied*amx->nr_virtual,2.0f);
+	extend_probability=1.0f/pow(amx->pmxs[0]->dimensions+1, 2.0f);
 	squeeze_probability=1.0f;
 
 	int i1, j1, i2, j2;
@@ -41,10 +53,22 @@ int update_extend(struct amatrix_t *amx, bool always_accept)
 	pmatrix_extend(amx->pmxs[0], amx->rng_ctx, &i1, &j1);
 	pmatrix_extend(amx->pmxs[1], amx->rng_ctx, &i2, &j2);
 
-	pmatrix_set_raw_entry(amx->pmxs[0],i1,j1,pmatrix_get_new_value(amx->pmxs[0],amx->rng_ctx,i1,j1));
-	pmatrix_set_raw_entry(amx->pmxs[1],i2,j2,pmatrix_get_new_value(amx->pmxs[1],amx->rng_ctx,i2,j2));
+	/*
+		The labels of the two new entries are not uniformly distributed, see
+		amatrix_get_new_value(), and their probability enters the acceptance ratio.
+	*/
+
+	int value1=amatrix_get_new_value(amx, 0, i1, j1);
+	int value2=amatrix_get_new_value(amx, 1, i2, j2);
+
+	pmatrix_set_raw_entry(amx->pmxs[0], i1, j1, value1);
+	pmatrix_set_raw_entry(amx->pmxs[1], i2, j2, value2);
+
+	extend_probability*=amatrix_value_probability(amx, i1, j1, value1);
+	extend_probability*=amatrix_value_probability(amx, i2, j2, value2);
 
 	amx->cached_weight_is_valid=false;
+	amx->weight_info_is_valid=false;
 
 	/*
 		Finally we calculate the acceptance ratio for the update.
@@ -60,10 +84,11 @@ int update_extend(struct amatrix_t *amx, bool always_accept)
 
 	if((is_accepted==false)&&(always_accept==false))
 	{
-		amatrix_restore(amx, &backup);
+		amatrix_undo_rollback(amx, &undo);
 		return UPDATE_REJECTED;
 	}
 
+	amatrix_undo_commit(amx);
 	return UPDATE_ACCEPTED;
 }
 
@@ -75,16 +100,29 @@ int update_squeeze(struct amatrix_t *amx, bool always_accept)
 	if(amx->pmxs[0]->dimensions<=amx->config->minorder)
 		return UPDATE_UNPHYSICAL;
 
-	struct amatrix_backup_t backup;
-	amatrix_save(amx, &backup);
+	struct amatrix_undo_t undo;
+	amatrix_undo_begin(amx, &undo);
 
-	extend_probability=1.0f/pow(amx->pmxs[0]->dimensions, 2.0f)/pow(amx->nr_occupied*amx->nr_virtual,2.0f);
+	extend_probability=1.0f/pow(amx->pmxs[0]->dimensions, 2.0f);
 	squeeze_probability=1.0f;
 
+	/*
+		The inverse update would propose again the labels that are being discarded.
+	*/
+
+	for(int c=0;c<2;c++)
+	{
+		int i, j;
+
+		pmatrix_squeeze_target(amx->pmxs[c], &i, &j);
+		extend_probability*=amatrix_value_probability(amx, i, j, pmatrix_get_raw_entry(amx->pmxs[c], i, j));
+	}
+
 	pmatrix_squeeze(amx->pmxs[0], amx->rng_ctx);
 	pmatrix_squeeze(amx->pmxs[1], amx->rng_ctx);
 
 	amx->cached_weight_is_valid=false;
+	amx->weight_info_is_valid=false;
 
 	double acceptance_ratio;
 
@@ -95,10 +133,11 @@ int update_squeeze(struct amatrix_t *amx, bool always_accept)
 
 	if((is_accepted==false)&&(always_accept==false))
 	{
-		amatrix_restore(amx, &backup);
+		amatrix_undo_rollback(amx, &undo);
 		return UPDATE_REJECTED;
 	}
 
+	amatrix_undo_commit(amx);
 	return UPDATE_ACCEPTED;
 }
 
@@ -118,8 +157,8 @@ int update_shuffle(struct amatrix_t *amx, bool always_accept)
 
 	double weightratio=1.0f/fabs(amatrix_weight(amx));
 
-	struct amatrix_backup_t backup;
-	amatrix_save(amx, &backup);
+	struct amatrix_undo_t undo;
+	amatrix_undo_begin(amx, &undo);
 
 	/*
 		We select which one of the permutation matrices we want to play with
@@ -158,6 +197,7 @@ int update_shuffle(struct amatrix_t *amx, bool always_accept)
 	}
 
 	amx->cached_weight_is_valid=false;
+	amx->weight_info_is_valid=false;
 
 	double acceptance_ratio;
 
@@ -168,10 +208,11 @@ int update_shuffle(struct amatrix_t *amx, bool always_accept)
 
 	if((is_accepted==false)&&(always_accept==false))
 	{
-		amatrix_restore(amx, &backup);
+		amatrix_undo_rollback(amx, &undo);
 		return UPDATE_REJECTED;
 	}
 
+	amatrix_undo_commit(amx);
 	return UPDATE_ACCEPTED;
 }
 
@@ -182,16 +223,24 @@ int update_modify(struct amatrix_t *amx, bool always_accept)
 	assert(amx->pmxs[0]->dimensions==amx->pmxs[1]->dimensions);
 	assert(amx->pmxs[0]->dimensions>=1);
 
+	/*
+		The arrangement of zero/non-zero entries is not modified by this update,
+		so that the weight can be recalculated quickly.
+	*/
+
+	amatrix_update_weight_info(amx);
+
 	double weightratio=1.0f/fabs(amatrix_weight(amx));
 
-	struct amatrix_backup_t backup;
-	amatrix_save(amx, &backup);
+	struct amatrix_undo_t undo;
+	amatrix_undo_begin(amx, &undo);
 
 	/*
 		We select which one of the permutation matrices we want to play with
 	*/
 
-	struct pmatrix_t *target=amx->pmxs[gsl_rng_uniform_int(amx->rng_ctx, 2)];
+	int pmatrix=gsl_rng_uniform_int(amx->rng_ctx, 2);
+	struct pmatrix_t *target=amx->pmxs[pmatrix];
 
 	/*
 		We select the row the element we want to modify lies in. Since there's one
@@ -199,31 +248,35 @@ int update_modify(struct amatrix_t *amx, bool always_accept)
 	*/
 
 	int i=gsl_rng_uniform_int(amx->rng_ctx, dimensions);
+	int j=pmatrix_get_col(target, i);
 
-	for(int j=0;j<dimensions;j++)
-		if(pmatrix_get_entry(target, i, j)!=0)
-			pmatrix_set_raw_entry(target, i, j, pmatrix_get_new_value(target, amx->rng_ctx, i, j));
+	int oldvalue=pmatrix_get_raw_entry(target, i, j);
+	int newvalue=amatrix_get_new_value(amx, pmatrix, i, j);
 
-	amx->cached_weight_is_valid=false;
+	amatrix_relabel(amx, pmatrix, i, j, newvalue);
 
 	/*
-		The update is balanced with itself, the acceptance ratio is simply given
-		by the (modulus of the) weights ratio.
+		The update is balanced with itself, the acceptance ratio is given by the
+		(modulus of the) weights ratio, times the ratio of the probabilities
+		of proposing the old and the new label.
 	*/
 
 	double acceptance_ratio;
 
 	weightratio*=fabs(amatrix_weight(amx));
 	acceptance_ratio=weightratio;
+	acceptance_ratio*=amatrix_value_probability(amx, i, j, oldvalue);
+	acceptance_ratio/=amatrix_value_probability(amx, i, j, newvalue);
 
 	bool is_accepted=(gsl_rng_uniform(amx->rng_ctx)<acceptance_ratio)?(true):(false);
 
 	if((is_accepted==false)&&(always_accept==false))
 	{
-		amatrix_restore(amx, &backup);
+		amatrix_undo_rollback(amx, &undo);
 		return UPDATE_REJECTED;
 	}
 
+	amatrix_undo_commit(amx);
 	return UPDATE_ACCEPTED;
 }
 
@@ -234,10 +287,13 @@ int update_swap(struct amatrix_t *amx, bool always_accept)
 	assert(amx->pmxs[0]->dimensions==amx->pmxs[1]->dimensions);
 	assert(amx->pmxs[0]->dimensions>=1);
 
-	double weightratio=1.0f/fabs(amatrix_weight(amx));
+	/*
+		Also in this case the arrangement of zero/non-zero entries is not modified.
+	*/
 
-	struct amatrix_backup_t backup;
-	amatrix_save(amx, &backup);
+	amatrix_update_weight_info(amx);
+
+	double weightratio=1.0f/fabs(amatrix_weight(amx));
 
 	/*
 		Do we play with virtual or with occupied states?
@@ -253,27 +309,31 @@ int update_swap(struct amatrix_t *amx, bool always_accept)
 
 	int icandidates=0;
 
+	/*
+		The candidates are collected row by row, and within each row in column order,
+		the first permutation matrix coming first when both entries are in the same column.
+	*/
+
 	for(int i=0;i<dimensions;i++)
 	{
-		for(int j=0;j<dimensions;j++)
+		int cols[2];
+
+		cols[0]=pmatrix_get_col(amx->pmxs[0],i);
+		cols[1]=pmatrix_get_col(amx->pmxs[1],i);
+
+		int first=(cols[1]<cols[0])?(1):(0);
+
+		for(int c=0;c<2;c++)
 		{
+			int pmatrix=(c==0)?(first):(1-first);
+			int j=cols[pmatrix];
+
 			if(pmatrix_entry_type(i,j)==target_type)
 			{
-				if(pmatrix_get_entry(amx->pmxs[0],i,j)!=0)
-				{
-					candidates[icandidates].i=i;
-					candidates[icandidates].j=j;
-					candidates[icandidates].pmatrix=0;
-					icandidates++;
-				}
-
-				if(pmatrix_get_entry(amx->pmxs[1],i,j)!=0)
-				{
-					candidates[icandidates].i=i;
-					candidates[icandidates].j=j;
-					candidates[icandidates].pmatrix=1;
-					icandidates++;
-				}
+				candidates[icandidates].i=i;
+				candidates[icandidates].j=j;
+				candidates[icandidates].pmatrix=pmatrix;
+				icandidates++;
 			}
 		}
 	}
@@ -281,6 +341,9 @@ int update_swap(struct amatrix_t *amx, bool always_accept)
 	if(icandidates<2)
 		return UPDATE_UNPHYSICAL;
 
+	struct amatrix_undo_t undo;
+	amatrix_undo_begin(amx, &undo);
+
 	assert(icandidates<32);
 
 	int values[32];
@@ -309,10 +372,11 @@ int update_swap(struct amatrix_t *amx, bool always_accept)
 
 	if((is_accepted==false)&&(always_accept==false))
 	{
-		amatrix_restore(amx, &backup);
+		amatrix_undo_rollback(amx, &undo);
 		return UPDATE_REJECTED;
 	}
 
+	amatrix_undo_commit(amx);
 	return UPDATE_ACCEPTED;
 }
 
@@ -325,39 +389,54 @@ int update_flip1(struct amatrix_t *amx, bool always_accept)
 
 	double weightratio=1.0f/fabs(amatrix_weight(amx));
 
-	struct amatrix_backup_t backup;
-	amatrix_save(amx, &backup);
+	/*
+		All the entries are moved, so we need a copy of the old matrices.
+	*/
+
+	struct pmatrix_t old[2]={*amx->pmxs[0],*amx->pmxs[1]};
+
+	struct amatrix_undo_t undo;
+	amatrix_undo_begin(amx, &undo);
 
 	int selector=gsl_rng_uniform_int(amx->rng_ctx, 3);
 
-	for(size_t i=0;i<dimensions;i++)
+	/*
+		The entry in row i and column j of the old matrix is moved to
+		row iprime and column jprime.
+	*/
+
+	for(int pmatrix=0;pmatrix<2;pmatrix++)
 	{
-		for(size_t j=0;j<dimensions;j++)
+		for(int i=0;i<dimensions;i++)
 		{
+			int j=pmatrix_get_col(&old[pmatrix], i);
+			int iprime,jprime;
+
 			switch(selector)
 			{
 				case 0:
-				amx->pmxs[0]->values[i][j]=backup.values[0][j][i];
-				amx->pmxs[1]->values[i][j]=backup.values[1][j][i];
+				iprime=j;
+				jprime=i;
 				break;
 
 				case 1:
-				amx->pmxs[0]->values[dimensions-j-1][dimensions-i-1]=backup.values[0][j][i];
-				amx->pmxs[1]->values[dimensions-j-1][dimensions-i-1]=backup.values[1][j][i];
+				iprime=dimensions-i-1;
+				jprime=dimensions-j-1;
 				break;
 
 				case 2:
-				amx->pmxs[0]->values[dimensions-i-1][dimensions-j-1]=backup.values[0][j][i];
-				amx->pmxs[1]->values[dimensions-i-1][dimensions-j-1]=backup.values[1][j][i];
-				break;
-
 				default:
+				iprime=dimensions-j-1;
+				jprime=dimensions-i-1;
 				break;
 			}
+
+			pmatrix_place_entry(amx->pmxs[pmatrix], iprime, jprime, old[pmatrix].values[i]);
 		}
 	}
 
 	amx->cached_weight_is_valid=false;
+	amx->weight_info_is_valid=false;
 
 	/*
 		The update is balanced with itself, the acceptance ratio is simply given
@@ -373,10 +452,11 @@ int update_flip1(struct amatrix_t *amx, bool always_accept)
 
 	if((is_accepted==false)&&(always_accept==false))
 	{
-		amatrix_restore(amx, &backup);
+		amatrix_undo_rollback(amx, &undo);
 		return UPDATE_REJECTED;
 	}
 
+	amatrix_undo_commit(amx);
 	return UPDATE_ACCEPTED;
 }
 
@@ -392,25 +472,34 @@ int update_flip2(struct amatrix_t *amx, bool always_accept)
 
 	double weightratio=1.0f/fabs(amatrix_weight(amx));
 
-	struct amatrix_backup_t backup;
-	amatrix_save(amx, &backup);
+	/*
+		All the entries are moved, so we need a copy of the old matrices.
+	*/
+
+	struct pmatrix_t old[2]={*amx->pmxs[0],*amx->pmxs[1]};
+
+	struct amatrix_undo_t undo;
+	amatrix_undo_begin(amx, &undo);
 
-	int selectori=gsl_rng_uniform_int(amx->rng_ctx, ifactorial(dimensions));
-	int selectorj=gsl_rng_uniform_int(amx->rng_ctx, ifactorial(dimensions));
+	int permutationi[PMATRIX_MAX_DIMENSIONS],permutationj[PMATRIX_MAX_DIMENSIONS];
 
-	for(size_t i=0;i<dimensions;i++)
+	unrank_permutation(dimensions,get_random_permutation_index(amx->rng_ctx, dimensions),permutationi);
+	unrank_permutation(dimensions,get_random_permutation_index(amx->rng_ctx, dimensions),permutationj);
+
+	for(int pmatrix=0;pmatrix<2;pmatrix++)
 	{
-		for(size_t j=0;j<dimensions;j++)
+		for(int i=0;i<dimensions;i++)
 		{
-			int iprime=get_permutation(dimensions,selectori,i)-1;
-			int jprime=get_permutation(dimensions,selectorj,j)-1;
+			int j=pmatrix_get_col(&old[pmatrix], i);
+			int iprime=permutationi[i]-1;
+			int jprime=permutationj[j]-1;
 
-			amx->pmxs[0]->values[iprime][jprime]=backup.values[0][i][j];
-			amx->pmxs[1]->values[iprime][jprime]=backup.values[1][i][j];
+			pmatrix_place_entry(amx->pmxs[pmatrix], iprime, jprime, old[pmatrix].values[i]);
 		}
 	}
 
 	amx->cached_weight_is_valid=false;
+	amx->weight_info_is_valid=false;
 
 	/*
 		The update is balanced with itself, the acceptance ratio is simply given
@@ -426,13 +515,13 @@ int update_flip2(struct amatrix_t *amx, bool always_accept)
 
 	if((is_accepted==false)&&(always_accept==false))
 	{
-		amatrix_restore(amx, &backup);
+		amatrix_undo_rollback(amx, &undo);
 		return UPDATE_REJECTED;
 	}
 
+	amatrix_undo_commit(amx);
 	return UPDATE_ACCEPTED;
 }
-
 /*
 	Auxiliary functions
 */
@@ -454,8 +543,36 @@ void show_update_statistics(FILE *out,long int proposed,long int accepted,long i
 	fprintf(out,"proposed %ld, accepted %ld (%f%%), rejected %ld (%f%%).\n",proposed,accepted,accepted_pct,rejected,rejected_pct);
 }
 
-static volatile int keep_running=1;
-static volatile int print_summary=0;
+double elapsed_time_since(struct timeval *starttime)
+{
+	struct timeval now;
+	double elapsedtime;
+
+	gettimeofday(&now,NULL);
+
+	elapsedtime=(now.tv_sec-starttime->tv_sec)*1000.0;
+	elapsedtime+=(now.tv_usec-starttime->tv_usec)/1000.0;
+	elapsedtime/=1000;
+
+	return elapsedtime;
+}
+
+/*
+	The signal handler only records which signals have been received, every chain
+	then polls these counters and keeps track of which ones it has already processed.
+*/
+
+static volatile sig_atomic_t sigint_received=0;
+static volatile sig_atomic_t sigterm_received=0;
+static volatile sig_atomic_t sigusr1_received=0;
+static volatile sig_atomic_t sigusr2_received=0;
+
+/*
+	Set when the whole run has to stop, e.g. when another MPI process
+	received a signal or exceeded the time limit.
+*/
+
+static volatile sig_atomic_t stop_requested=0;
 
 static void signal_handler(int signo)
 {
@@ -463,15 +580,19 @@ static void signal_handler(int signo)
 	{
 
 		case SIGINT:
-		keep_running=0;
+		sigint_received=1;
+		break;
+
+		case SIGTERM:
+		sigterm_received=1;
 		break;
 
 		case SIGUSR1:
-		print_summary=1;
+		sigusr1_received++;
 		break;
 
 		case SIGUSR2:
-		print_summary=2;
+		sigusr2_received++;
 		break;
 
 		default:
@@ -480,357 +601,1772 @@ static void signal_handler(int signo)
 }
 
 /*
-	The actual DiagMC routine.
+	The updates we will be using, see mc.h
 */
 
-int do_diagmc(struct configuration_t *config)
+int (*updates[DIAGRAM_NR_UPDATES])(struct amatrix_t *amx, bool always_accept)=
+{
+	update_extend,
+	update_squeeze,
+	update_shuffle,
+	update_modify,
+	update_swap,
+	update_flip1,
+	update_flip2
+};
+
+const char *update_names[DIAGRAM_NR_UPDATES]=
+{
+	"Extend",
+	"Squeeze",
+	"Shuffle",
+	"Modify",
+	"Swap",
+	"Flip1",
+	"Flip2"
+};
+
+/*
+	A plain copy of the statistics of a chain, from which the report is written. When running
+	with MPI the snapshots of all chains in all processes are collected by the first process.
+*/
+
+struct chain_snapshot_t
 {
+	long int counter;
+	int update_probability[DIAGRAM_NR_UPDATES];
+	long int proposed[DIAGRAM_NR_UPDATES], accepted[DIAGRAM_NR_UPDATES], rejected[DIAGRAM_NR_UPDATES];
+	long int proposed_swaps[MAX_REPLICAS], accepted_swaps[MAX_REPLICAS];
+	struct sampling_summary_t summary;
+};
+
+struct replica_set_t;
+
+/*
+	Everything a single Markov chain owns. All the chains in a process share the
+	configuration, the energies context and the topology cache, which are read-only.
+*/
 
-#define DIAGRAM_NR_UPDATES        (7)
+struct chain_ctx_t
+{
+	int id;
 
-	int (*updates[DIAGRAM_NR_UPDATES])(struct amatrix_t *amx, bool always_accept);
-	const char *update_names[DIAGRAM_NR_UPDATES];
+	struct configuration_t *config;
+	struct amatrix_t *amx;
+	struct sampling_ctx_t *sctx;
+	struct rfactors_ctx_t *rctx;
 
+	const int *configured_probability;
+	int update_probability[DIAGRAM_NR_UPDATES], cumulative_probability[DIAGRAM_NR_UPDATES];
 	long int proposed[DIAGRAM_NR_UPDATES], accepted[DIAGRAM_NR_UPDATES], rejected[DIAGRAM_NR_UPDATES];
-	int update_probability[DIAGRAM_NR_UPDATES],cumulative_probability[DIAGRAM_NR_UPDATES];
+	long int counter;
+
+	/*
+		Time spent in each update, measured only while the update
+		probabilities are being adapted, see chain_adapt_updates()
+	*/
+
+	double elapsed[DIAGRAM_NR_UPDATES];
 
 	/*
-		We set up the updates we will be using
+		Per-chain signal handling state
 	*/
 
-	updates[0]=update_extend;
-	updates[1]=update_squeeze;
-	updates[2]=update_shuffle;
-	updates[3]=update_modify;
-	updates[4]=update_swap;
-	updates[5]=update_flip1;
-	updates[6]=update_flip2;
+	bool keep_running;
+	sig_atomic_t sigusr1_processed, sigusr2_processed;
+
+	progressbar *progress;
+	struct timeval *starttime;
+
+	/*
+		Whether the chain has been restored from a checkpoint,
+		and when the last checkpoint has been written.
+	*/
 
-	update_names[0]="Extend";
-	update_names[1]="Squeeze";
-	update_names[2]="Shuffle";
-	update_names[3]="Modify";
-	update_names[4]="Swap";
-	update_names[5]="Flip1";
-	update_names[6]="Flip2";
+	bool resumed;
+	struct timeval last_checkpoint;
 
 	/*
-		Update probabilities: note that they must be the same for complementary update pairs,
-		see the assert()'s below.
+		When running with MPI, the chains hand a snapshot of their statistics
+		to the main thread on request, see chain_serve_snapshot().
 	*/
 
-	update_probability[0]=1;
-	update_probability[1]=1;
-	update_probability[2]=1;
-	update_probability[3]=1;
-	update_probability[4]=1;
-	update_probability[5]=1;
-	update_probability[6]=1;
+	bool finished;
+	sig_atomic_t snapshot_served;
+	struct chain_snapshot_t *snapshot;
 
-	assert(update_probability[0]==update_probability[1]);
+	/*
+		Replica exchange: the set of replicas the chain belongs to (NULL if disabled) and
+		its position in it. Only replica #0, at the target penalty, is measured.
+	*/
+
+	struct replica_set_t *replicas;
+	int replica;
 
 	/*
-		Here we calculate the cumulative probabilities from the update probabilities.
+		The slot where the chain publishes its statistics for mpn-top (NULL if disabled),
+		and the iteration and the time of the last update, to calculate the rate.
 	*/
 
-	cumulative_probability[0]=update_probability[0];
+	struct livestats_chain_t *livestats;
+	long int livestats_counter;
+	double livestats_elapsed;
+};
 
-	for(int c=1;c<DIAGRAM_NR_UPDATES;c++)
-		cumulative_probability[c]=update_probability[c]+cumulative_probability[c-1];
+/*
+	Replica exchange: every chain is accompanied by a set of replicas, each one run by its own
+	thread, with the unphysical penalty increasing geometrically from the target one to
+	'replicapenalty'. Every 'replicaexchange' iterations all the replicas stop, and swaps of the
+	diagrams between neighbouring replicas are proposed, alternating between even and odd pairs.
+
+	A diagram x at penalty p_r and a diagram y at penalty p_{r+1} are swapped with probability
+	min(1, W_r(y) W_{r+1}(x) / (W_r(x) W_{r+1}(y))). The physical sector has the same weight
+	at all penalties, so the measurements of the target replica are unaffected, while the
+	diagrams it receives from the replicas moving more freely through the unphysical sector
+	make it decorrelate faster.
+*/
+
+struct replica_set_t
+{
+	int nr_replicas;
+	struct chain_ctx_t *chains[MAX_REPLICAS];
 
 	/*
-		We reset the update statistics and prepare a sampling context for the measurements
+		The configurations of the replicas other than the target one, differing only in the penalty
 	*/
 
-	for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
-		proposed[d]=accepted[d]=rejected[d]=0;
+	struct configuration_t configs[MAX_REPLICAS];
+
+	/*
+		A stop is requested by the target replica, but it is decided only while all
+		the replicas are waiting for the exchange, see replica_exchange().
+	*/
 
-	struct sampling_ctx_t *sctx=init_sampling_ctx(config->maxorder);
-	rfactors_init();
+	pthread_barrier_t barrier;
+	bool stop_requested,stopping;
+	int parity;
 
 	/*
-		We print some informative message, and then we open the log file
+		Swaps proposed and accepted between replica #r and replica #r+1
 	*/
 
-	printf("Performing %ld iterations\n",config->iterations);
+	long int proposed_swaps[MAX_REPLICAS], accepted_swaps[MAX_REPLICAS];
+};
 
-	FILE *out;
-	char output[1024];
+/*
+	The output of different chains should not get mixed up on stdout
+*/
 
-	snprintf(output,1024,"%s.dat",config->prefix);
-	output[1023]='\0';
+static pthread_mutex_t stdout_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+void print_update_statistics(FILE *out,const long int *proposed,const long int *accepted,const long int *rejected)
+{
+	long int total_proposed,total_accepted,total_rejected;
+	total_proposed=total_accepted=total_rejected=0;
+
+	fprintf(out,"# Update statistics:\n");
 
-	if(!(out=fopen(output,"w+")))
+	for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
 	{
-		fprintf(stderr,"Error: couldn't open %s for writing\n",output);
-		return 0;
+		fprintf(out,"# Update #%d (%s): ",d,update_names[d]);
+		show_update_statistics(out,proposed[d],accepted[d],rejected[d]);
+
+		total_proposed+=proposed[d];
+		total_accepted+=accepted[d];
+		total_rejected+=rejected[d];
 	}
 
-	printf("Writing results to '%s'\n",output);
+	fprintf(out,"# Total: ");
+	show_update_statistics(out,total_proposed,total_accepted,total_rejected);
+	fprintf(out,"#\n");
+}
 
+void chain_set_update_probabilities(struct chain_ctx_t *chain,const int *update_probability)
+{
 	/*
-		The diagram parameters are loaded from the configuration, as a new 'amatrix' is created
+		Extend and Squeeze are complementary, their probabilities must be the same.
 	*/
 
-	struct amatrix_t *amx=init_amatrix(config);
+	assert(update_probability[0]==update_probability[1]);
 
-	if(!amx)
+	for(int c=0;c<DIAGRAM_NR_UPDATES;c++)
 	{
-		fprintf(stderr,"Error: couldn't load the ERIs file (%s).\n",config->erisfile);
-		return 0;
+		assert(update_probability[c]>=0);
+		chain->update_probability[c]=update_probability[c];
 	}
 
 	/*
-		Let's extend the matrix until we hit the minimum allowed dimensions.
+		Here we calculate the cumulative probabilities from the update probabilities.
 	*/
 
-	assert(config->maxorder>config->minorder);
-	assert(config->maxorder<MAX_ORDER);
+	chain->cumulative_probability[0]=update_probability[0];
 
-	struct amatrix_backup_t root;
-	amatrix_save(amx,&root);
+	for(int c=1;c<DIAGRAM_NR_UPDATES;c++)
+		chain->cumulative_probability[c]=update_probability[c]+chain->cumulative_probability[c-1];
+
+	assert(chain->cumulative_probability[DIAGRAM_NR_UPDATES-1]>0);
+}
+
+/*
+	During thermalization the probabilities of the updates other than Extend and Squeeze can
+	be adapted, making them proportional to the number of accepted proposals per second of CPU
+	time, as measured so far. A fraction of the probability is still distributed according to
+	the weights in the configuration, so that no update is ever switched off, and the updates
+	that are disabled in the configuration stay disabled. Extend and Squeeze keep their share.
+
+	The probabilities are frozen at the end of thermalization, before any measurement is made,
+	so that detailed balance holds during the actual sampling.
+*/
 
-	while(amx->pmxs[0]->dimensions<config->minorder)
+#define ADAPTIVE_UPDATES_WINDOW		(65536)
+#define ADAPTIVE_UPDATES_SCALE		(1024)
+#define ADAPTIVE_UPDATES_MIN_FRACTION	(0.1f)
+
+void chain_adapt_updates(struct chain_ctx_t *chain,const int *configured_probability)
+{
+	double efficiency[DIAGRAM_NR_UPDATES],total_efficiency=0.0f;
+	int total_configured=0;
+
+	for(int c=2;c<DIAGRAM_NR_UPDATES;c++)
 	{
-		struct amatrix_backup_t backup;
+		efficiency[c]=0.0f;
 
-		amatrix_save(amx,&backup);
+		if(configured_probability[c]==0)
+			continue;
 
-		int c=0;
-		while(update_extend(amx, false)!=UPDATE_ACCEPTED)
-		{
-			/*
-				If we get stuck, we can go back to the very beginning.
-			*/
-			
-			if(++c>32768)
-			{
-				amatrix_restore(amx, &root);
-				break;
-			}
-		}
-		
-		if(amatrix_check_connectedness(amx)==false)
-			amatrix_restore(amx, &backup);
+		/*
+			Not enough information yet to adapt the probabilities.
+		*/
+
+		if((chain->proposed[c]==0)||(chain->elapsed[c]<=0.0f))
+			return;
+
+		efficiency[c]=chain->accepted[c]/chain->elapsed[c];
+		total_efficiency+=efficiency[c];
+		total_configured+=configured_probability[c];
 	}
 
-	/*
-		We setup a signal handler to gracefully handle a CTRL-C (i.e. SIGINT),
-		and to print a short summary on SIGUSR1.
-	*/
+	if((total_configured==0)||(total_efficiency<=0.0f))
+		return;
 
-	keep_running=1;
-	print_summary=0;
+	int update_probability[DIAGRAM_NR_UPDATES];
+	int total=ADAPTIVE_UPDATES_SCALE*total_configured;
 
-	signal(SIGINT,signal_handler);
-	signal(SIGUSR1,signal_handler);
-	signal(SIGUSR2,signal_handler);
+	update_probability[0]=update_probability[1]=ADAPTIVE_UPDATES_SCALE*configured_probability[0];
 
-	/*
-		We initialize the progress bar
-	*/
+	for(int c=2;c<DIAGRAM_NR_UPDATES;c++)
+	{
+		double fraction=ADAPTIVE_UPDATES_MIN_FRACTION*configured_probability[c]/total_configured;
 
-	progressbar *progress;
+		fraction+=(1.0f-ADAPTIVE_UPDATES_MIN_FRACTION)*efficiency[c]/total_efficiency;
 
-	if(config->progressbar==true)
-		progress=progressbar_new("Progress",config->iterations/262144);
-	else
-		progress=NULL;
+		update_probability[c]=lround(total*fraction);
+	}
 
-	/*
-		We save the start time
-	*/
+	chain_set_update_probabilities(chain,update_probability);
+}
 
-	struct timeval starttime;
-	gettimeofday(&starttime,NULL);
+void print_update_probabilities(FILE *out,const int *update_probability)
+{
+	int total=0;
 
-	/*
-		This is the main DiagMC loop
-	*/
+	for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
+		total+=update_probability[d];
 
-	long int counter;
-	for(counter=0;(counter<config->iterations)&&(keep_running==1);counter++)
+	fprintf(out,"# Update probabilities:");
+
+	for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
 	{
-		int update_type,status,selector;
+		double p=((double)(update_probability[d]))/total;
 
-		selector=gsl_rng_uniform_int(amx->rng_ctx, cumulative_probability[DIAGRAM_NR_UPDATES-1]);
-		update_type=-1;
+		fprintf(out," %s %f%s",update_names[d],p,(d!=(DIAGRAM_NR_UPDATES-1))?(","):("\n"));
+	}
+}
 
-		for(int c=0;c<DIAGRAM_NR_UPDATES;c++)
-		{
-			if(cumulative_probability[c]>selector)
-			{
-				update_type=c;
-				break;
-			}
-		}
+double replica_penalty(struct configuration_t *config,int replica)
+{
+	if(config->replicas<=1)
+		return config->unphysicalpenalty;
 
-		assert(update_type!=-1);
+	double x=((double)(replica))/(config->replicas-1);
 
-		status=updates[update_type](amx, false);
-		proposed[update_type]++;
+	return config->unphysicalpenalty*pow(config->replicapenalty/config->unphysicalpenalty,x);
+}
 
-		switch(status)
-		{
-			case UPDATE_ACCEPTED:
-			accepted[update_type]++;
-			break;
+/*
+	The replicas are created from the target chain, once it has been initialized.
+*/
 
-			case UPDATE_UNPHYSICAL:
-			case UPDATE_REJECTED:
-			rejected[update_type]++;
-			break;
+struct replica_set_t *init_replica_set(struct chain_ctx_t *target,int first_seed)
+{
+	struct configuration_t *config=target->config;
+	struct replica_set_t *set=malloc(sizeof(struct replica_set_t));
 
-			case UPDATE_ERROR:
-			default:
-			assert(false);
-		}
+	assert(set!=NULL);
+	assert((config->replicas>1)&&(config->replicas<=MAX_REPLICAS));
 
-		sampling_ctx_measure(sctx,amx,config,counter);
+	set->nr_replicas=config->replicas;
+	set->chains[0]=target;
+	set->stop_requested=set->stopping=false;
+	set->parity=0;
 
-		if((counter%262144)==0)
-		{
-			struct timeval now;
-			double elapsedtime;
+	for(int r=0;r<set->nr_replicas;r++)
+		set->proposed_swaps[r]=set->accepted_swaps[r]=0;
 
-			if(config->progressbar==true)
-				progressbar_inc(progress);
+	target->replicas=set;
+	target->replica=0;
 
-			gettimeofday(&now,NULL);
+	for(int r=1;r<set->nr_replicas;r++)
+	{
+		struct chain_ctx_t *replica=malloc(sizeof(struct chain_ctx_t));
 
-			elapsedtime=(now.tv_sec-starttime.tv_sec)*1000.0;
-			elapsedtime+=(now.tv_usec-starttime.tv_usec)/1000.0;
-			elapsedtime/=1000;
+		assert(replica!=NULL);
 
-			if((config->timelimit>0.0f)&&(elapsedtime>config->timelimit))
-				keep_running=0;
+		set->configs[r]=*config;
+		set->configs[r].unphysicalpenalty=replica_penalty(config,r);
 
-			if(print_summary==1)
-			{
-				sampling_ctx_print_report(sctx,amx,stdout,false);
-				print_summary=0;
-			}
+		*replica=*target;
+		replica->config=&set->configs[r];
+		replica->amx=init_amatrix_with_ectx(replica->config,target->amx->ectx);
+		replica->replica=r;
 
-			if(print_summary==2)
-			{
-				fprintf(stdout,"# Iterations in the physical sector: %f%%\n",sampling_ctx_get_physical_pct(sctx));
+		assert(replica->amx!=NULL);
 
-				long int total_proposed,total_accepted,total_rejected;
-				total_proposed=total_accepted=total_rejected=0;
+		/*
+			The replicas never measure, nor report their progress.
+		*/
 
-				fprintf(stdout,"# Update statistics:\n");
+		replica->sctx=NULL;
+		replica->rctx=NULL;
+		replica->progress=NULL;
+		replica->snapshot=NULL;
 
-				for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
-				{
-					fprintf(stdout,"# Update #%d (%s): ",d,update_names[d]);
-					show_update_statistics(stdout,proposed[d],accepted[d],rejected[d]);
+		if(config->seedrng==false)
+			gsl_rng_set(replica->amx->rng_ctx,first_seed+r-1);
 
-					total_proposed+=proposed[d];
-					total_accepted+=accepted[d];
-					total_rejected+=rejected[d];
-				}
+		set->chains[r]=replica;
+	}
 
-				fprintf(stdout,"# Total: ");
-				show_update_statistics(stdout,total_proposed,total_accepted,total_rejected);
-				fprintf(stdout,"#\n");
-				fflush(stdout);
+	pthread_barrier_init(&set->barrier,NULL,set->nr_replicas);
 
-				print_summary=0;
-			}
-		}
-	}
+	return set;
+}
 
-	if(keep_running==0)
+void fini_replica_set(struct replica_set_t *set)
+{
+	for(int r=1;r<set->nr_replicas;r++)
 	{
-		printf("Caught SIGINT or time limit exceeded, exiting earlier.\n");
+		fini_amatrix(set->chains[r]->amx,false);
+		free(set->chains[r]);
 	}
 
-	if(config->progressbar)
-		progressbar_finish(progress);
+	pthread_barrier_destroy(&set->barrier);
+	free(set);
+}
 
-	/*
-		Now we print the statistics we collected to the output file in a nice way.
-	*/
+/*
+	Exchanges the diagrams of two replicas, each one keeping its own penalty.
+*/
 
-	fprintf(out,"# Diagrammatic Monte Carlo for Møller-Plesset theory\n");
-	fprintf(out,"#\n");
-	fprintf(out,"# Electron repulsion integrals loaded from '%s'\n",config->erisfile);
-	fprintf(out,"# Output file is '%s'\n",output);
-	fprintf(out,"# Binary compiled from git commit %s\n",GITCOMMIT);
-	fprintf(out,"#\n");
+void replica_swap_diagrams(struct chain_ctx_t *a,struct chain_ctx_t *b)
+{
+	struct amatrix_t *tmp=a->amx;
+
+	a->amx=b->amx;
+	b->amx=tmp;
+
+	a->amx->config=a->config;
+	b->amx->config=b->config;
+
+	a->amx->cached_weight_is_valid=false;
+	b->amx->cached_weight_is_valid=false;
+}
+
+void replica_set_propose_swaps(struct replica_set_t *set)
+{
+	gsl_rng *rng_ctx=set->chains[0]->amx->rng_ctx;
+
+	for(int r=set->parity;r<(set->nr_replicas-1);r+=2)
+	{
+		struct chain_ctx_t *lower=set->chains[r], *upper=set->chains[r+1];
+		double before,after;
+
+		before=fabs(amatrix_weight(lower->amx)*amatrix_weight(upper->amx));
+		replica_swap_diagrams(lower,upper);
+		after=fabs(amatrix_weight(lower->amx)*amatrix_weight(upper->amx));
+
+		set->proposed_swaps[r]++;
+
+		if((gsl_rng_uniform(rng_ctx)*before)<after)
+			set->accepted_swaps[r]++;
+		else
+			replica_swap_diagrams(lower,upper);
+	}
+
+	set->parity=1-set->parity;
+}
+
+/*
+	In replica exchange mode, a stop is deferred to the next exchange, so that all the replicas stop together.
+*/
+
+void chain_stop(struct chain_ctx_t *chain)
+{
+	if(chain->replicas!=NULL)
+		chain->replicas->stop_requested=true;
+	else
+		chain->keep_running=false;
+}
+
+void chain_take_snapshot(struct chain_ctx_t *chain,struct chain_snapshot_t *snapshot)
+{
+	memset(snapshot, 0, sizeof(struct chain_snapshot_t));
+
+	snapshot->counter=chain->counter;
+
+	for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
+	{
+		snapshot->update_probability[d]=chain->update_probability[d];
+		snapshot->proposed[d]=chain->proposed[d];
+		snapshot->accepted[d]=chain->accepted[d];
+		snapshot->rejected[d]=chain->rejected[d];
+	}
+
+	if(chain->replicas!=NULL)
+	{
+		for(int r=0;r<chain->replicas->nr_replicas;r++)
+		{
+			snapshot->proposed_swaps[r]=chain->replicas->proposed_swaps[r];
+			snapshot->accepted_swaps[r]=chain->replicas->accepted_swaps[r];
+		}
+	}
+
+	sampling_ctx_summarize(chain->sctx,&snapshot->summary);
+}
+
+/*
+	The statistics of a chain are published for mpn-top, see livestats.h: they are prepared
+	in advance, so that the slot is being written only for the time needed to copy them.
+*/
+
+void chain_publish_livestats(struct chain_ctx_t *chain,bool finished)
+{
+	struct sampling_summary_t summary;
+	struct livestats_data_t data;
+
+	sampling_ctx_summarize(chain->sctx,&summary);
+	memset(&data, 0, sizeof(struct livestats_data_t));
+
+	data.id=chain->id;
+	data.finished=finished;
+	data.counter=chain->counter;
+	data.elapsed=elapsed_time_since(chain->starttime);
+
+	if(data.elapsed>chain->livestats_elapsed)
+		data.rate=(chain->counter-chain->livestats_counter)/(data.elapsed-chain->livestats_elapsed);
+
+	chain->livestats_counter=chain->counter;
+	chain->livestats_elapsed=data.elapsed;
+
+	for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
+	{
+		data.proposed[d]=chain->proposed[d];
+		data.accepted[d]=chain->accepted[d];
+	}
+
+	data.nr_samples=summary.nr_samples;
+	data.nr_physical_samples=summary.nr_physical_samples;
+
+	for(int order=chain->config->minorder;order<=chain->config->maxorder;order++)
+	{
+		data.nr_positive[order]=summary.results.nr_positive[order];
+		data.nr_negative[order]=summary.results.nr_negative[order];
+		data.contribution[order]=results_mean(&summary.results,1,order);
+		data.stderror[order]=sqrt(results_covariance(&summary.results,1,order,order));
+	}
+
+	*livestats_begin_update(chain->livestats)=data;
+	livestats_end_update(chain->livestats);
+}
+
+/*
+	The report, written from the snapshots of all the chains. With MPI, the output file
+	can be written many times during the run, so it is truncated every time.
+*/
+
+void write_report(FILE *out,struct configuration_t *config,const char *output,struct chain_snapshot_t *snapshots,int nr_snapshots,int nr_processes,double elapsedtime)
+{
+	/*
+		The statistics collected by all chains are merged.
+	*/
+
+	long int counter=0;
+	long int proposed[DIAGRAM_NR_UPDATES], accepted[DIAGRAM_NR_UPDATES], rejected[DIAGRAM_NR_UPDATES];
+
+	for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
+		proposed[d]=accepted[d]=rejected[d]=0;
+
+	struct sampling_summary_t *summaries=malloc(sizeof(struct sampling_summary_t)*nr_snapshots);
+	assert(summaries!=NULL);
+
+	for(int c=0;c<nr_snapshots;c++)
+	{
+		counter+=snapshots[c].counter;
+
+		for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
+		{
+			proposed[d]+=snapshots[c].proposed[d];
+			accepted[d]+=snapshots[c].accepted[d];
+			rejected[d]+=snapshots[c].rejected[d];
+		}
+
+		summaries[c]=snapshots[c].summary;
+	}
+
+	/*
+		Now we print the statistics we collected to the output file in a nice way.
+	*/
+
+	fflush(out);
+
+	if(ftruncate(fileno(out),0)!=0)
+		fprintf(stderr,"Warning: couldn't truncate the output file '%s'\n",output);
+
+	rewind(out);
+
+	fprintf(out,"# Diagrammatic Monte Carlo for Møller-Plesset theory\n");
+	fprintf(out,"#\n");
+	fprintf(out,"# Electron repulsion integrals loaded from '%s'\n",config->erisfile);
+	fprintf(out,"# Output file is '%s'\n",output);
+	fprintf(out,"# Binary compiled from git commit %s\n",GITCOMMIT);
+	fprintf(out,"#\n");
 	fprintf(out,"# Unphysical penalty: %f\n",config->unphysicalpenalty);
 	fprintf(out,"# Minimum order: %d\n",config->minorder);
 	fprintf(out,"# Maximum order: %d\n",config->maxorder);
 	fprintf(out,"#\n");
 
-	fprintf(out,"# Iterations (done/planned): %ld/%ld\n",counter,config->iterations);
+	if(nr_processes>1)
+		fprintf(out,"# MPI processes: %d\n",nr_processes);
+
+	if(config->threads>1)
+		fprintf(out,"# Threads: %d\n",config->threads);
+
+	fprintf(out,"# Iterations (done/planned): %ld/%ld\n",counter,config->iterations*nr_snapshots);
 	fprintf(out,"# Thermalization: %ld\n",config->thermalization);
 	fprintf(out,"# Decorrelation: %d\n",config->decorrelation);
-	fprintf(out,"# Iterations in the physical sector: %f%%\n",sampling_ctx_get_physical_pct(sctx));
+	fprintf(out,"# Energy-weighted label sampling: %s\n",(config->energysampling==true)?("true"):("false"));
+	fprintf(out,"# Adaptive update probabilities: %s\n",(config->adaptiveupdates==true)?("true"):("false"));
+	fprintf(out,"# Iterations in the physical sector: %f%%\n",sampling_summaries_get_physical_pct(summaries,nr_snapshots));
 	fprintf(out,"#\n");
 
 	/*
-		Here we calculate the elapsed time.
+		The acceptance of the swaps between neighbouring replicas, over all chains.
 	*/
 
-	struct timeval now;
-	double elapsedtime;
+	if(config->replicas>1)
+	{
+		fprintf(out,"# Replicas: %d, swaps proposed every %ld iterations\n",config->replicas,config->replicaexchange);
+		fprintf(out,"# Penalties:");
 
-	gettimeofday(&now,NULL);
+		for(int r=0;r<config->replicas;r++)
+			fprintf(out," %f",replica_penalty(config,r));
 
-	elapsedtime=(now.tv_sec-starttime.tv_sec)*1000.0;
-	elapsedtime+=(now.tv_usec-starttime.tv_usec)/1000.0;
-	elapsedtime/=1000;
+		fprintf(out,"\n# Swap acceptance:");
+
+		for(int r=0;r<(config->replicas-1);r++)
+		{
+			long int proposed_swaps=0,accepted_swaps=0;
+
+			for(int c=0;c<nr_snapshots;c++)
+			{
+				proposed_swaps+=snapshots[c].proposed_swaps[r];
+				accepted_swaps+=snapshots[c].accepted_swaps[r];
+			}
+
+			fprintf(out," %d<->%d %f%%",r,r+1,(proposed_swaps>0)?(100.0f*accepted_swaps/proposed_swaps):(0.0f));
+		}
+
+		fprintf(out,"\n#\n");
+	}
+
+	/*
+		Here we print the elapsed time.
+	*/
 
 	fprintf(out,"# Total time: %f seconds\n",elapsedtime);
 	fprintf(out,"#\n");
 
 	/*
-		Now we print some update statistics
+		Now we print some update statistics. When adapted, the update
+		probabilities are different for each chain.
 	*/
 
-	long int total_proposed,total_accepted,total_rejected;
-	total_proposed=total_accepted=total_rejected=0;
+	if((config->adaptiveupdates==true)&&(nr_snapshots>1))
+	{
+		for(int c=0;c<nr_snapshots;c++)
+		{
+			fprintf(out,"# Chain #%d\n",c);
+			print_update_probabilities(out,snapshots[c].update_probability);
+		}
+	}
+	else
+	{
+		print_update_probabilities(out,snapshots[0].update_probability);
+	}
 
-	fprintf(out,"# Update statistics:\n");
+	print_update_statistics(out,proposed,accepted,rejected);
 
-	for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
+	/*
+		Finally, we output the actual results.
+	*/
+
+	sampling_summaries_print_report(summaries,nr_snapshots,config,out);
+
+	free(summaries);
+}
+
+/*
+	Checkpoints: every chain periodically writes its own state to a file, so that the run can be
+	resumed later, continuing exactly from where it stopped. The file contains a header, the update
+	statistics, the state of the amatrix_t (permutation matrices and RNG), the measurements
+	collected so far and the R factors, followed by the state of the replicas, if any. As for the cache files, it is first written under
+	a temporary name and then renamed, so that a valid checkpoint is always available.
+*/
+
+#define CHECKPOINT_FILE_MAGIC		"MPNCHKPT"
+#define CHECKPOINT_FILE_VERSION		(4)
+
+struct checkpoint_header_t
+{
+	char magic[8];
+	uint32_t version;
+	int32_t chain,nr_updates;
+	int32_t nocc,nvirt,minorder,maxorder;
+	int32_t nr_replicas;
+	int64_t counter;
+};
+
+/*
+	The update statistics and the diagram of a single chain or replica.
+*/
+
+bool chain_save_state(struct chain_ctx_t *chain,FILE *out)
+{
+	return (fwrite(chain->update_probability, sizeof(int), DIAGRAM_NR_UPDATES, out)==DIAGRAM_NR_UPDATES)&&
+	       (fwrite(chain->proposed, sizeof(long int), DIAGRAM_NR_UPDATES, out)==DIAGRAM_NR_UPDATES)&&
+	       (fwrite(chain->accepted, sizeof(long int), DIAGRAM_NR_UPDATES, out)==DIAGRAM_NR_UPDATES)&&
+	       (fwrite(chain->rejected, sizeof(long int), DIAGRAM_NR_UPDATES, out)==DIAGRAM_NR_UPDATES)&&
+	       (fwrite(chain->elapsed, sizeof(double), DIAGRAM_NR_UPDATES, out)==DIAGRAM_NR_UPDATES)&&
+	       (amatrix_save_state(chain->amx, out)==true);
+}
+
+bool chain_load_state(struct chain_ctx_t *chain,FILE *in)
+{
+	int update_probability[DIAGRAM_NR_UPDATES];
+
+	if((fread(update_probability, sizeof(int), DIAGRAM_NR_UPDATES, in)!=DIAGRAM_NR_UPDATES)||
+	   (update_probability[0]!=update_probability[1]))
+		return false;
+
+	if((fread(chain->proposed, sizeof(long int), DIAGRAM_NR_UPDATES, in)!=DIAGRAM_NR_UPDATES)||
+	   (fread(chain->accepted, sizeof(long int), DIAGRAM_NR_UPDATES, in)!=DIAGRAM_NR_UPDATES)||
+	   (fread(chain->rejected, sizeof(long int), DIAGRAM_NR_UPDATES, in)!=DIAGRAM_NR_UPDATES)||
+	   (fread(chain->elapsed, sizeof(double), DIAGRAM_NR_UPDATES, in)!=DIAGRAM_NR_UPDATES))
+		return false;
+
+	if(amatrix_load_state(chain->amx, in)==false)
+		return false;
+
+	chain_set_update_probabilities(chain,update_probability);
+
+	return true;
+}
+
+void chain_checkpoint_filename(struct chain_ctx_t *chain,char *filename,int length)
+{
+	snprintf(filename,length,"%s.chain%d.checkpoint",chain->config->prefix,chain->id);
+	filename[length-1]='\0';
+}
+
+bool chain_save_checkpoint(struct chain_ctx_t *chain,long int counter)
+{
+	struct checkpoint_header_t header;
+
+	memset(&header, 0, sizeof(struct checkpoint_header_t));
+	memcpy(header.magic, CHECKPOINT_FILE_MAGIC, 8);
+	header.version=CHECKPOINT_FILE_VERSION;
+	header.chain=chain->id;
+	header.nr_updates=DIAGRAM_NR_UPDATES;
+	header.nocc=chain->amx->nr_occupied;
+	header.nvirt=chain->amx->nr_virtual;
+	header.minorder=chain->config->minorder;
+	header.maxorder=chain->config->maxorder;
+	header.nr_replicas=(chain->replicas!=NULL)?(chain->replicas->nr_replicas):(1);
+	header.counter=counter;
+
+	char filename[1024],tmpfilename[1056];
+
+	chain_checkpoint_filename(chain,filename,1024);
+	snprintf(tmpfilename,1056,"%s.%d.tmp",filename,(int)(getpid()));
+	tmpfilename[1055]='\0';
+
+	FILE *f;
+
+	if(!(f=fopen(tmpfilename,"w+")))
+		return false;
+
+	bool success=(fwrite(&header, sizeof(struct checkpoint_header_t), 1, f)==1)&&
+	             (chain_save_state(chain, f)==true)&&
+	             (sampling_ctx_save_state(chain->sctx, f)==true)&&
+	             (rfactors_save_state(chain->rctx, f)==true);
+
+	if(chain->replicas!=NULL)
 	{
-		fprintf(out,"# Update #%d (%s): ",d,update_names[d]);
-		show_update_statistics(out,proposed[d],accepted[d],rejected[d]);
+		struct replica_set_t *set=chain->replicas;
 
-		total_proposed+=proposed[d];
-		total_accepted+=accepted[d];
-		total_rejected+=rejected[d];
+		for(int r=1;r<set->nr_replicas;r++)
+			success&=chain_save_state(set->chains[r], f);
+
+		success&=(fwrite(&set->parity, sizeof(int), 1, f)==1);
+		success&=(fwrite(set->proposed_swaps, sizeof(long int), MAX_REPLICAS, f)==MAX_REPLICAS);
+		success&=(fwrite(set->accepted_swaps, sizeof(long int), MAX_REPLICAS, f)==MAX_REPLICAS);
 	}
 
-	fprintf(out,"# Total: ");
-	show_update_statistics(out,total_proposed,total_accepted,total_rejected);
-	fprintf(out,"#\n");
+	if((fclose(f)!=0)||(success==false)||(rename(tmpfilename,filename)!=0))
+	{
+		remove(tmpfilename);
+		return false;
+	}
 
-	/*
-		Finally, we output the actual results...
-	*/
+	return true;
+}
+
+bool chain_load_checkpoint(struct chain_ctx_t *chain,FILE *in)
+{
+	struct checkpoint_header_t header;
+
+	if(fread(&header, sizeof(struct checkpoint_header_t), 1, in)!=1)
+		return false;
+
+	if((memcmp(header.magic, CHECKPOINT_FILE_MAGIC, 8)!=0)||(header.version!=CHECKPOINT_FILE_VERSION))
+		return false;
+
+	if((header.chain!=chain->id)||(header.nr_updates!=DIAGRAM_NR_UPDATES)||
+	   (header.nocc!=chain->amx->nr_occupied)||(header.nvirt!=chain->amx->nr_virtual)||
+	   (header.minorder!=chain->config->minorder)||(header.maxorder!=chain->config->maxorder)||
+	   (header.nr_replicas!=chain->config->replicas))
+		return false;
+
+	if((chain_load_state(chain, in)==false)||
+	   (sampling_ctx_load_state(chain->sctx, in)==false)||
+	   (rfactors_load_state(chain->rctx, in)==false))
+		return false;
 
-	sampling_ctx_print_report(sctx,amx,out,true);
+	chain->counter=header.counter;
 
 	/*
-		...the additional 'rfactors' statistics...
+		All the replicas are at the same iteration as the target one.
 	*/
 
-	char output2[1024];
+	if(chain->replicas!=NULL)
+	{
+		struct replica_set_t *set=chain->replicas;
+
+		for(int r=1;r<set->nr_replicas;r++)
+		{
+			if(chain_load_state(set->chains[r], in)==false)
+				return false;
+
+			set->chains[r]->counter=header.counter;
+			set->chains[r]->resumed=true;
+		}
+
+		if((fread(&set->parity, sizeof(int), 1, in)!=1)||
+		   (fread(set->proposed_swaps, sizeof(long int), MAX_REPLICAS, in)!=MAX_REPLICAS)||
+		   (fread(set->accepted_swaps, sizeof(long int), MAX_REPLICAS, in)!=MAX_REPLICAS))
+			return false;
+	}
+
+	return true;
+}
+
+void chain_write_checkpoint(struct chain_ctx_t *chain,long int counter)
+{
+	if(chain_save_checkpoint(chain,counter)==false)
+	{
+		char filename[1024];
+
+		chain_checkpoint_filename(chain,filename,1024);
+
+		pthread_mutex_lock(&stdout_mutex);
+		fprintf(stderr,"Warning: couldn't write the checkpoint file '%s'.\n",filename);
+		pthread_mutex_unlock(&stdout_mutex);
+	}
+
+	gettimeofday(&chain->last_checkpoint,NULL);
+}
+
+double chain_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC,&now);
+
+	return now.tv_sec+1e-9*now.tv_nsec;
+}
+
+#ifdef MPN_WITH_MPI
+
+/*
+	The main thread asks for a snapshot of all chains by incrementing the request counter,
+	each chain then copies its statistics at the next poll and signals the main thread.
+*/
+
+static pthread_mutex_t snapshot_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond=PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t snapshot_requested=0;
+
+void chain_serve_snapshot(struct chain_ctx_t *chain)
+{
+	if(chain->snapshot_served==snapshot_requested)
+		return;
+
+	pthread_mutex_lock(&snapshot_mutex);
+
+	chain_take_snapshot(chain,chain->snapshot);
+	chain->snapshot_served=snapshot_requested;
+
+	pthread_cond_broadcast(&snapshot_cond);
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
+void chain_set_finished(struct chain_ctx_t *chain)
+{
+	pthread_mutex_lock(&snapshot_mutex);
+
+	chain->finished=true;
+
+	pthread_cond_broadcast(&snapshot_cond);
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
+#endif
+
+/*
+	Called by all the replicas every 'replicaexchange' iterations, before performing the
+	current one. While all the replicas are waiting, the target one writes the checkpoint,
+	if needed, and proposes the swaps, unless the run has to stop. In that case the final
+	checkpoint will be written after the loop, and the swaps will be proposed on resuming.
+
+	Returns false if the chain has to stop.
+*/
+
+bool replica_exchange(struct chain_ctx_t *chain)
+{
+	struct replica_set_t *set=chain->replicas;
+	struct configuration_t *config=chain->config;
+
+	pthread_barrier_wait(&set->barrier);
+
+	if(chain->replica==0)
+	{
+		set->stopping=set->stop_requested;
 
-	snprintf(output2,1024,"%s.rfactors.dat",config->prefix);
-	output2[1023]='\0';
+		if(set->stopping==false)
+		{
+			if((config->checkpoint>0.0f)&&(elapsed_time_since(&chain->last_checkpoint)>config->checkpoint))
+				chain_write_checkpoint(chain,chain->counter);
+
+			replica_set_propose_swaps(set);
+		}
+	}
+
+	pthread_barrier_wait(&set->barrier);
+
+	if(set->stopping==true)
+	{
+		chain->keep_running=false;
+		return false;
+	}
 
-	rfactors_output_summary(output2);
+	return true;
+}
+
+/*
+	A single Markov chain, it can be run either directly or as a thread.
+*/
+
+void *diagmc_chain(void *data)
+{
+	struct chain_ctx_t *chain=(struct chain_ctx_t *)(data);
+	struct configuration_t *config=chain->config;
+	struct amatrix_t *amx=chain->amx;
 
 	/*
-		...and we perform some final cleanups!
+		Let's extend the matrix until we hit the minimum allowed dimensions.
 	*/
 
-	fini_amatrix(amx,true);
-	fini_sampling_ctx(sctx);
+	struct amatrix_backup_t root;
+	amatrix_save(amx,&root);
+
+	while((chain->resumed==false)&&(amx->pmxs[0]->dimensions<config->minorder))
+	{
+		struct amatrix_backup_t backup;
+
+		amatrix_save(amx,&backup);
+
+		int c=0;
+		while(update_extend(amx, false)!=UPDATE_ACCEPTED)
+		{
+			/*
+				If we get stuck, we can go back to the very beginning.
+			*/
+
+			if(++c>32768)
+			{
+				amatrix_restore(amx, &root);
+				break;
+			}
+		}
+
+		if(amatrix_check_connectedness(amx)==false)
+			amatrix_restore(amx, &backup);
+	}
+
+	/*
+		This is the main DiagMC loop
+	*/
+
+	const int *configured_probability=chain->configured_probability;
+	bool adapting=(config->adaptiveupdates==true)&&(chain->counter<config->thermalization);
+
+	for(;(chain->counter<config->iterations)&&(chain->keep_running==true);chain->counter++)
+	{
+		int update_type,status,selector;
+
+		if((chain->replicas!=NULL)&&((chain->counter%config->replicaexchange)==0))
+		{
+			if(replica_exchange(chain)==false)
+				break;
+
+			amx=chain->amx;
+		}
+
+		if(adapting==true)
+		{
+			if(chain->counter>=config->thermalization)
+			{
+				chain_adapt_updates(chain,configured_probability);
+				adapting=false;
+
+				if(chain->replica==0)
+				{
+					pthread_mutex_lock(&stdout_mutex);
+
+					if(config->threads>1)
+						fprintf(stdout,"# Chain #%d\n",chain->id);
+
+					print_update_probabilities(stdout,chain->update_probability);
+
+					pthread_mutex_unlock(&stdout_mutex);
+				}
+			}
+			else if((chain->counter>0)&&((chain->counter%ADAPTIVE_UPDATES_WINDOW)==0))
+			{
+				chain_adapt_updates(chain,configured_probability);
+			}
+		}
+
+		selector=gsl_rng_uniform_int(amx->rng_ctx, chain->cumulative_probability[DIAGRAM_NR_UPDATES-1]);
+		update_type=-1;
+
+		for(int c=0;c<DIAGRAM_NR_UPDATES;c++)
+		{
+			if(chain->cumulative_probability[c]>selector)
+			{
+				update_type=c;
+				break;
+			}
+		}
+
+		assert(update_type!=-1);
+
+		if(adapting==true)
+		{
+			double start=chain_clock();
+
+			status=updates[update_type](amx, false);
+
+			chain->elapsed[update_type]+=chain_clock()-start;
+		}
+		else
+		{
+			status=updates[update_type](amx, false);
+		}
+
+		chain->proposed[update_type]++;
+
+		switch(status)
+		{
+			case UPDATE_ACCEPTED:
+			chain->accepted[update_type]++;
+			break;
+
+			case UPDATE_UNPHYSICAL:
+			case UPDATE_REJECTED:
+			chain->rejected[update_type]++;
+			break;
+
+			case UPDATE_ERROR:
+			default:
+			assert(false);
+		}
+
+		/*
+			The replicas other than the target one are not measured, and they are stopped
+			and checkpointed together with the target one, see replica_exchange().
+		*/
+
+		if(chain->replica!=0)
+			continue;
+
+		sampling_ctx_measure(chain->sctx,amx,config,chain->counter);
+
+		if((chain->livestats!=NULL)&&((chain->counter%LIVESTATS_INTERVAL)==0))
+			chain_publish_livestats(chain,false);
+
+		if((chain->counter%262144)==0)
+		{
+			if(chain->progress!=NULL)
+				progressbar_inc(chain->progress);
+
+			if((config->timelimit>0.0f)&&(elapsed_time_since(chain->starttime)>config->timelimit))
+				chain_stop(chain);
+
+			if((sigint_received!=0)||(sigterm_received!=0)||(stop_requested!=0))
+				chain_stop(chain);
+
+			/*
+				The current iteration has already been completed, the checkpoint
+				must resume from the next one.
+			*/
+
+			if((config->checkpoint>0.0f)&&(chain->keep_running==true)&&(chain->replicas==NULL)&&
+			   (elapsed_time_since(&chain->last_checkpoint)>config->checkpoint))
+				chain_write_checkpoint(chain,chain->counter+1);
+
+#ifdef MPN_WITH_MPI
+
+			/*
+				With MPI, the signals are handled by the main thread for the whole run.
+			*/
+
+			chain_serve_snapshot(chain);
+
+#else
+
+			if(chain->sigusr1_processed!=sigusr1_received)
+			{
+				chain->sigusr1_processed=sigusr1_received;
+
+				pthread_mutex_lock(&stdout_mutex);
+
+				if(config->threads>1)
+					fprintf(stdout,"# Chain #%d\n",chain->id);
+
+				sampling_ctx_print_report(chain->sctx,config,stdout);
+
+				pthread_mutex_unlock(&stdout_mutex);
+			}
+
+			if(chain->sigusr2_processed!=sigusr2_received)
+			{
+				chain->sigusr2_processed=sigusr2_received;
+
+				pthread_mutex_lock(&stdout_mutex);
+
+				if(config->threads>1)
+					fprintf(stdout,"# Chain #%d\n",chain->id);
+
+				fprintf(stdout,"# Iterations in the physical sector: %f%%\n",sampling_ctx_get_physical_pct(chain->sctx));
+				print_update_statistics(stdout,chain->proposed,chain->accepted,chain->rejected);
+				fflush(stdout);
+
+				pthread_mutex_unlock(&stdout_mutex);
+			}
+
+#endif
+		}
+	}
+
+	/*
+		A last checkpoint, both when the chain is stopped earlier and when it completes
+		all the iterations, so that the run can be extended later.
+	*/
+
+	if(chain->replicas!=NULL)
+		pthread_barrier_wait(&chain->replicas->barrier);
+
+	if((config->checkpoint>0.0f)&&(chain->replica==0))
+		chain_write_checkpoint(chain,chain->counter);
+
+	if(chain->livestats!=NULL)
+		chain_publish_livestats(chain,true);
+
+#ifdef MPN_WITH_MPI
+	if(chain->replica==0)
+		chain_set_finished(chain);
+#endif
+
+	return NULL;
+}
+
+#ifdef MPN_WITH_MPI
+
+/*
+	Running with MPI, every process runs its chains as threads, while the main thread of
+	each process periodically agrees with the others on what has to be done: stopping the
+	run, as soon as one of the processes received SIGINT/SIGTERM or exceeded the time limit,
+	and collecting the statistics of all the chains in the first process, in order to print
+	a report on SIGUSR1/SIGUSR2 (received by any process) or to update the output file.
+*/
+
+#define MPI_MONITOR_INTERVAL	(250000)
+
+#define MONITOR_STOP		(0)
+#define MONITOR_SIGUSR1		(1)
+#define MONITOR_SIGUSR2		(2)
+#define MONITOR_REPORT		(3)
+#define MONITOR_RUNNING		(4)
+#define MONITOR_NR_FLAGS	(5)
+
+/*
+	Collects a snapshot of all the chains into the first process, the other processes get NULL.
+	If the chains are still running, each one is asked for its snapshot; this is a collective call.
+*/
+
+struct chain_snapshot_t *mpi_gather_snapshots(struct chain_ctx_t *chains,int nr_chains,bool running,int rank,int nr_processes)
+{
+	struct chain_snapshot_t *local=malloc(sizeof(struct chain_snapshot_t)*nr_chains);
+	struct chain_snapshot_t *all=NULL;
+
+	assert(local!=NULL);
+
+	if(running==true)
+	{
+		pthread_mutex_lock(&snapshot_mutex);
+
+		snapshot_requested++;
+
+		for(int c=0;c<nr_chains;c++)
+		{
+			while((chains[c].finished==false)&&(chains[c].snapshot_served!=snapshot_requested))
+				pthread_cond_wait(&snapshot_cond,&snapshot_mutex);
+
+			if(chains[c].finished==true)
+				chain_take_snapshot(&chains[c],&local[c]);
+			else
+				local[c]=*chains[c].snapshot;
+		}
+
+		pthread_mutex_unlock(&snapshot_mutex);
+	}
+	else
+	{
+		for(int c=0;c<nr_chains;c++)
+			chain_take_snapshot(&chains[c],&local[c]);
+	}
+
+	if(rank==0)
+	{
+		all=malloc(sizeof(struct chain_snapshot_t)*nr_chains*nr_processes);
+		assert(all!=NULL);
+	}
+
+	MPI_Gather(local,sizeof(struct chain_snapshot_t)*nr_chains,MPI_BYTE,
+	           all,sizeof(struct chain_snapshot_t)*nr_chains,MPI_BYTE,0,MPI_COMM_WORLD);
+
+	free(local);
+
+	return all;
+}
+
+void mpi_monitor_chains(struct chain_ctx_t *chains,int nr_chains,FILE *out,const char *output,int rank,int nr_processes)
+{
+	struct configuration_t *config=chains[0].config;
+	struct timeval last_report=*chains[0].starttime;
+	sig_atomic_t sigusr1_processed=0,sigusr2_processed=0;
+
+	while(true)
+	{
+		int flags[MONITOR_NR_FLAGS];
+		sig_atomic_t sigusr1=sigusr1_received,sigusr2=sigusr2_received;
+
+		usleep(MPI_MONITOR_INTERVAL);
+
+		flags[MONITOR_STOP]=(sigint_received!=0)||(sigterm_received!=0)||
+		                    ((config->timelimit>0.0f)&&(elapsed_time_since(chains[0].starttime)>config->timelimit));
+		flags[MONITOR_SIGUSR1]=(sigusr1!=sigusr1_processed);
+		flags[MONITOR_SIGUSR2]=(sigusr2!=sigusr2_processed);
+		flags[MONITOR_REPORT]=(rank==0)&&(config->reportinterval>0.0f)&&(elapsed_time_since(&last_report)>config->reportinterval);
+		flags[MONITOR_RUNNING]=0;
+
+		sigusr1_processed=sigusr1;
+		sigusr2_processed=sigusr2;
+
+		pthread_mutex_lock(&snapshot_mutex);
+
+		for(int c=0;c<nr_chains;c++)
+			if(chains[c].finished==false)
+				flags[MONITOR_RUNNING]=1;
+
+		pthread_mutex_unlock(&snapshot_mutex);
+
+		MPI_Allreduce(MPI_IN_PLACE,flags,MONITOR_NR_FLAGS,MPI_INT,MPI_MAX,MPI_COMM_WORLD);
+
+		if(flags[MONITOR_STOP]!=0)
+			stop_requested=1;
+
+		if((flags[MONITOR_RUNNING]!=0)&&((flags[MONITOR_SIGUSR1]!=0)||(flags[MONITOR_SIGUSR2]!=0)||(flags[MONITOR_REPORT]!=0)))
+		{
+			struct chain_snapshot_t *snapshots=mpi_gather_snapshots(chains,nr_chains,true,rank,nr_processes);
+			int nr_snapshots=nr_chains*nr_processes;
+
+			if(rank==0)
+			{
+				struct sampling_summary_t *summaries=malloc(sizeof(struct sampling_summary_t)*nr_snapshots);
+				long int proposed[DIAGRAM_NR_UPDATES], accepted[DIAGRAM_NR_UPDATES], rejected[DIAGRAM_NR_UPDATES];
+
+				assert(summaries!=NULL);
+
+				for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
+					proposed[d]=accepted[d]=rejected[d]=0;
+
+				for(int c=0;c<nr_snapshots;c++)
+				{
+					summaries[c]=snapshots[c].summary;
+
+					for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
+					{
+						proposed[d]+=snapshots[c].proposed[d];
+						accepted[d]+=snapshots[c].accepted[d];
+						rejected[d]+=snapshots[c].rejected[d];
+					}
+				}
+
+				if(flags[MONITOR_SIGUSR1]!=0)
+					sampling_summaries_print_report(summaries,nr_snapshots,config,stdout);
+
+				if(flags[MONITOR_SIGUSR2]!=0)
+				{
+					fprintf(stdout,"# Iterations in the physical sector: %f%%\n",sampling_summaries_get_physical_pct(summaries,nr_snapshots));
+					print_update_statistics(stdout,proposed,accepted,rejected);
+				}
+
+				fflush(stdout);
+				free(summaries);
+
+				/*
+					The output file is rewritten with the partial results.
+				*/
+
+				if(flags[MONITOR_REPORT]!=0)
+				{
+					write_report(out,config,output,snapshots,nr_snapshots,nr_processes,elapsed_time_since(chains[0].starttime));
+					fflush(out);
+
+					gettimeofday(&last_report,NULL);
+				}
+			}
+
+			free(snapshots);
+		}
+
+		if(flags[MONITOR_RUNNING]==0)
+			break;
+	}
+}
+
+#endif
+
+/*
+	Frees the first nr_chains chains, in reverse order: the energies context is shared,
+	and it is freed only together with the first chain.
+*/
+
+void fini_chains(struct chain_ctx_t *chains,int nr_chains)
+{
+	for(int c=nr_chains-1;c>=0;c--)
+	{
+		if(chains[c].replicas!=NULL)
+			fini_replica_set(chains[c].replicas);
+
+		fini_amatrix(chains[c].amx,(c==0)?(true):(false));
+		fini_sampling_ctx(chains[c].sctx);
+		fini_rfactors_ctx(chains[c].rctx);
+	}
+}
+
+/*
+	The actual DiagMC routine.
+*/
+
+int do_diagmc(struct configuration_t *config)
+{
+	int update_probability[DIAGRAM_NR_UPDATES];
+
+	/*
+		Update probabilities: note that they must be the same for complementary update pairs,
+		see chain_set_update_probabilities().
+	*/
+
+	update_probability[0]=config->extendsqueezeweight;
+	update_probability[1]=config->extendsqueezeweight;
+	update_probability[2]=config->shuffleweight;
+	update_probability[3]=config->modifyweight;
+	update_probability[4]=config->swapweight;
+	update_probability[5]=config->flip1weight;
+	update_probability[6]=config->flip2weight;
+
+	int total_probability=0;
+
+	for(int c=0;c<DIAGRAM_NR_UPDATES;c++)
+		total_probability+=update_probability[c];
+
+	if(total_probability<=0)
+	{
+		fprintf(stderr,"Error: at least one update must have a non-zero weight.\n");
+		return 0;
+	}
+
+	/*
+		With MPI, every process runs the same number of chains, and only the first
+		one prints messages and writes the output files.
+	*/
+
+	int rank=0,nr_processes=1;
+
+#ifdef MPN_WITH_MPI
+	MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+	MPI_Comm_size(MPI_COMM_WORLD,&nr_processes);
+#endif
+
+	/*
+		We print some informative message, and then we open the log file
+	*/
+
+	int nr_chains=config->threads;
+
+	if(rank==0)
+	{
+		if(nr_processes>1)
+			printf("Performing %ld iterations on each one of %d threads, on %d MPI processes\n",config->iterations,nr_chains,nr_processes);
+		else if(nr_chains>1)
+			printf("Performing %ld iterations on each one of %d threads\n",config->iterations,nr_chains);
+		else
+			printf("Performing %ld iterations\n",config->iterations);
+
+		if(config->replicas>1)
+			printf("Replica exchange with %d replicas per chain, each one on its own thread\n",config->replicas);
+	}
+
+	FILE *out=NULL;
+	char output[1024];
+
+	snprintf(output,1024,"%s.dat",config->prefix);
+	output[1023]='\0';
+
+	if(rank==0)
+	{
+		if(!(out=fopen(output,"w+")))
+		{
+			fprintf(stderr,"Error: couldn't open %s for writing\n",output);
+
+#ifdef MPN_WITH_MPI
+			MPI_Abort(MPI_COMM_WORLD,1);
+#endif
+
+			return 0;
+		}
+
+		printf("Writing results to '%s'\n",output);
+	}
+
+	/*
+		The diagram parameters are loaded from the configuration, as a new 'amatrix' is created
+		for each chain. The ERIs are loaded only once, and shared among all chains.
+	*/
+
+	struct chain_ctx_t *chains=malloc(sizeof(struct chain_ctx_t)*nr_chains);
+	struct chain_snapshot_t *snapshots=malloc(sizeof(struct chain_snapshot_t)*nr_chains);
+
+	assert((chains!=NULL)&&(snapshots!=NULL));
+
+	assert(config->maxorder>config->minorder);
+	assert(config->maxorder<MAX_ORDER);
+
+	struct timeval starttime;
+
+	for(int c=0;c<nr_chains;c++)
+	{
+		struct chain_ctx_t *chain=&chains[c];
+
+		chain->id=rank*nr_chains+c;
+		chain->config=config;
+
+		if(c==0)
+			chain->amx=init_amatrix(config);
+		else
+			chain->amx=init_amatrix_with_ectx(config,chains[0].amx->ectx);
+
+		if(!chain->amx)
+		{
+			fprintf(stderr,"Error: couldn't load the ERIs file (%s).\n",config->erisfile);
+
+			fini_chains(chains,c);
+			free(snapshots);
+			free(chains);
+
+			if(out)
+				fclose(out);
+
+			return 0;
+		}
+
+		/*
+			If the RNG is not seeded from /dev/urandom, we still want the chains to be different.
+		*/
+
+		if((config->seedrng==false)&&(chain->id>0))
+			gsl_rng_set(chain->amx->rng_ctx,chain->id);
+
+		/*
+			We reset the update statistics and prepare a sampling context for the measurements
+		*/
+
+		for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
+		{
+			chain->proposed[d]=chain->accepted[d]=chain->rejected[d]=0;
+			chain->elapsed[d]=0.0f;
+		}
+
+		chain->counter=0;
+		chain->configured_probability=update_probability;
+		chain_set_update_probabilities(chain,update_probability);
+
+		chain->sctx=init_sampling_ctx(config->maxorder);
+		chain->rctx=init_rfactors_ctx();
+
+		chain->keep_running=true;
+		chain->sigusr1_processed=chain->sigusr2_processed=0;
+
+		chain->progress=NULL;
+		chain->starttime=&starttime;
+
+		chain->finished=false;
+		chain->snapshot_served=0;
+		chain->snapshot=&snapshots[c];
+		chain->resumed=false;
+		chain->livestats=NULL;
+
+		/*
+			The replicas are copied from the chain, and they are resumed with it. They are seeded
+			after all the chains, when the RNG is not seeded from /dev/urandom.
+		*/
+
+		chain->replicas=NULL;
+		chain->replica=0;
+
+		if(config->replicas>1)
+			init_replica_set(chain,nr_chains*nr_processes+chain->id*(config->replicas-1));
+
+		/*
+			When resuming, the chain continues from its checkpoint, if available.
+		*/
+
+		if(config->resume==true)
+		{
+			char filename[1024];
+			FILE *in;
+
+			chain_checkpoint_filename(chain,filename,1024);
+
+			if(!(in=fopen(filename,"r")))
+			{
+				printf("Warning: couldn't open the checkpoint file '%s', chain #%d starts from scratch.\n",filename,chain->id);
+			}
+			else
+			{
+				bool success=chain_load_checkpoint(chain,in);
+
+				fclose(in);
+
+				if(success==false)
+				{
+					fprintf(stderr,"Error: '%s' is not a valid checkpoint for this run.\n",filename);
+
+#ifdef MPN_WITH_MPI
+					MPI_Abort(MPI_COMM_WORLD,1);
+#endif
+
+					fini_chains(chains,c+1);
+					free(snapshots);
+					free(chains);
+
+					if(out)
+						fclose(out);
+
+					return 0;
+				}
+
+				printf("Resuming chain #%d from '%s' (%ld iterations done)\n",chain->id,filename,chain->counter);
+				chain->resumed=true;
+			}
+		}
+
+		/*
+			Optionally, the measured samples are also streamed to a file, see timeseries.h
+		*/
+
+		if(config->timeseries==true)
+		{
+			char filename[1024];
+
+			snprintf(filename,1024,"%s.chain%d.timeseries",config->prefix,chain->id);
+			filename[1023]='\0';
+
+			if(sampling_ctx_start_timeseries(chain->sctx,filename,chain->id,config,chain->resumed)==false)
+			{
+				fprintf(stderr,"Error: couldn't %s the time series file '%s'.\n",(chain->resumed==true)?("resume"):("create"),filename);
+
+#ifdef MPN_WITH_MPI
+				MPI_Abort(MPI_COMM_WORLD,1);
+#endif
+
+				fini_chains(chains,c+1);
+				free(snapshots);
+				free(chains);
+
+				if(out)
+					fclose(out);
+
+				return 0;
+			}
+		}
+	}
+
+	/*
+		We setup a signal handler to gracefully handle a CTRL-C (i.e. SIGINT) or a SIGTERM
+		(e.g. from the batch system, at the end of the allocated time), and to print a
+		short summary on SIGUSR1.
+	*/
+
+	sigint_received=sigterm_received=0;
+	sigusr1_received=sigusr2_received=0;
+	stop_requested=0;
+
+	signal(SIGINT,signal_handler);
+	signal(SIGTERM,signal_handler);
+	signal(SIGUSR1,signal_handler);
+	signal(SIGUSR2,signal_handler);
+
+	/*
+		We initialize the progress bar, that is updated by the first chain only
+	*/
+
+	if((config->progressbar==true)&&(rank==0))
+		chains[0].progress=progressbar_new("Progress",config->iterations/262144);
+
+	/*
+		The chains publish their statistics in shared memory, for mpn-top. The replicas
+		are not measured, and they do not publish anything.
+	*/
+
+	struct livestats_t *livestats=NULL;
+
+	if(config->livestats==true)
+	{
+		struct livestats_header_t header;
+
+		memset(&header, 0, sizeof(struct livestats_header_t));
+		header.nr_chains=nr_chains;
+		header.nr_updates=DIAGRAM_NR_UPDATES;
+		header.minorder=config->minorder;
+		header.maxorder=config->maxorder;
+		header.iterations=config->iterations;
+
+		strncpy(header.prefix,config->prefix,63);
+
+		assert(DIAGRAM_NR_UPDATES<=LIVESTATS_MAX_UPDATES);
+
+		for(int d=0;d<DIAGRAM_NR_UPDATES;d++)
+			strncpy(header.update_names[d],update_names[d],15);
+
+		if(!(livestats=init_livestats(&header)))
+			fprintf(stderr,"Warning: couldn't create the shared memory segment for the live statistics.\n");
+
+		for(int c=0;(livestats!=NULL)&&(c<nr_chains);c++)
+		{
+			chains[c].livestats=livestats_get_chain(livestats,c);
+			chains[c].livestats_counter=chains[c].counter;
+			chains[c].livestats_elapsed=0.0f;
+		}
+	}
+
+	/*
+		We save the start time, and we start the chains. With MPI, all processes start
+		together, and the chains always run as threads, as the main thread is needed
+		to communicate with the other processes.
+	*/
+
+#ifdef MPN_WITH_MPI
+	MPI_Barrier(MPI_COMM_WORLD);
+#endif
+
+	gettimeofday(&starttime,NULL);
+
+	for(int c=0;c<nr_chains;c++)
+		chains[c].last_checkpoint=starttime;
+
+#ifndef MPN_WITH_MPI
+	if((nr_chains==1)&&(config->replicas==1))
+	{
+		diagmc_chain(&chains[0]);
+	}
+	else
+#endif
+	{
+		int nr_threads=nr_chains*config->replicas;
+		pthread_t *threads=malloc(sizeof(pthread_t)*nr_threads);
+
+		assert(threads!=NULL);
+
+		for(int c=0;c<nr_threads;c++)
+		{
+			struct chain_ctx_t *chain;
+
+			if(config->replicas>1)
+				chain=chains[c/config->replicas].replicas->chains[c%config->replicas];
+			else
+				chain=&chains[c];
+
+			if(pthread_create(&threads[c],NULL,diagmc_chain,chain)!=0)
+			{
+				fprintf(stderr,"Error: couldn't create thread #%d\n",c);
+
+#ifdef MPN_WITH_MPI
+				MPI_Abort(MPI_COMM_WORLD,1);
+#endif
+
+				exit(1);
+			}
+		}
+
+#ifdef MPN_WITH_MPI
+		mpi_monitor_chains(chains,nr_chains,out,output,rank,nr_processes);
+#endif
+
+		for(int c=0;c<nr_threads;c++)
+			pthread_join(threads[c],NULL);
+
+		free(threads);
+	}
+
+	double elapsedtime=elapsed_time_since(&starttime);
+	int stopped_earlier=0;
+
+	for(int c=0;c<nr_chains;c++)
+		if(chains[c].keep_running==false)
+			stopped_earlier=1;
+
+#ifdef MPN_WITH_MPI
+	MPI_Allreduce(MPI_IN_PLACE,&stopped_earlier,1,MPI_INT,MPI_MAX,MPI_COMM_WORLD);
+#endif
+
+	if((stopped_earlier!=0)&&(rank==0))
+	{
+		printf("Caught SIGINT/SIGTERM or time limit exceeded, exiting earlier.\n");
+	}
+
+	if(chains[0].progress!=NULL)
+		progressbar_finish(chains[0].progress);
+
+	/*
+		The R factors of all chains are merged into the first one. With MPI, they are
+		summed over all processes, together with the snapshots of all chains.
+	*/
+
+	struct rfactors_ctx_t *rctx=chains[0].rctx;
+
+	for(int c=1;c<nr_chains;c++)
+		rfactors_merge(rctx,chains[c].rctx);
+
+	int nr_snapshots=nr_chains*nr_processes;
+	struct chain_snapshot_t *report_snapshots=snapshots;
+
+#ifdef MPN_WITH_MPI
+	MPI_Reduce((rank==0)?(MPI_IN_PLACE):(rctx),rctx,sizeof(struct rfactors_ctx_t)/sizeof(long int),
+	           MPI_LONG,MPI_SUM,0,MPI_COMM_WORLD);
+
+	report_snapshots=mpi_gather_snapshots(chains,nr_chains,false,rank,nr_processes);
+#else
+	for(int c=0;c<nr_chains;c++)
+		chain_take_snapshot(&chains[c],&snapshots[c]);
+#endif
+
+	if(rank==0)
+	{
+		/*
+			The report...
+		*/
+
+		write_report(out,config,output,report_snapshots,nr_snapshots,nr_processes,elapsedtime);
+
+		/*
+			...the additional 'rfactors' statistics...
+		*/
+
+		char output2[1024];
+
+		snprintf(output2,1024,"%s.rfactors.dat",config->prefix);
+		output2[1023]='\0';
+
+		rfactors_output_summary(rctx,output2);
+
+		/*
+			...the machine-readable results of each chain, to be merged with other runs by mpn-merge...
+		*/
+
+		snprintf(output2,1024,"%s.results.bin",config->prefix);
+		output2[1023]='\0';
+
+		const struct chain_results_t **results=malloc(sizeof(struct chain_results_t *)*nr_snapshots);
+
+		assert(results!=NULL);
+
+		for(int c=0;c<nr_snapshots;c++)
+			results[c]=&report_snapshots[c].summary.results;
+
+		if(save_results(output2,results,nr_snapshots,config->minorder,config->maxorder)==false)
+			fprintf(stderr,"Warning: couldn't write the results to '%s'\n",output2);
+
+		free(results);
+	}
+
+#ifdef MPN_WITH_MPI
+	free(report_snapshots);
+#endif
+
+	/*
+		...and we perform some final cleanups!
+	*/
+
+	fini_chains(chains,nr_chains);
+
+	fini_livestats(livestats);
+
+	free(snapshots);
+	free(chains);
 
 	if(out)
 		fclose(out);
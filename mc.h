@@ -1,6 +1,8 @@
 #ifndef __MC_H__
 #define __MC_H__
 
+#include <sys/time.h>
+
 #include "amatrix.h"
 #include "config.h"
 
@@ -12,6 +14,26 @@
 int update_shuffle(struct amatrix_t *amx, bool always_accept);
 int update_extend(struct amatrix_t *amx, bool always_accept);
 int update_squeeze(struct amatrix_t *amx, bool always_accept);
+int update_modify(struct amatrix_t *amx, bool always_accept);
+int update_swap(struct amatrix_t *amx, bool always_accept);
+int update_flip1(struct amatrix_t *amx, bool always_accept);
+int update_flip2(struct amatrix_t *amx, bool always_accept);
+
+/*
+	All the updates, in the order used for the statistics and the update probabilities
+*/
+
+#define DIAGRAM_NR_UPDATES        (7)
+
+extern int (*updates[DIAGRAM_NR_UPDATES])(struct amatrix_t *amx, bool always_accept);
+extern const char *update_names[DIAGRAM_NR_UPDATES];
+
+/*
+	Wall-clock time in seconds since 'starttime', and a monotonic clock for timing the updates
+*/
+
+double elapsed_time_since(struct timeval *starttime);
+double chain_clock(void);
 
 int do_diagmc(struct configuration_t *config);
 
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "config.h"
+#include "sampling.h"
+#include "results.h"
+
+/*
+	Merges the results of many independent runs, as saved in the .results.bin files, and prints
+	the same report as mpn, with the contribution of each order and the order-by-order ratios.
+	Optionally, all the chains can also be saved to a single results file.
+*/
+
+void usage(char *argv0)
+{
+	printf("Usage: %s [-o <output results file>] <results file> [<results file> ...]\n",argv0);
+
+	exit(0);
+}
+
+int main(int argc,char *argv[])
+{
+	char *output=NULL;
+	int first=1;
+
+	if((argc>=3)&&(strcmp(argv[1],"-o")==0))
+	{
+		output=argv[2];
+		first=3;
+	}
+
+	if(first>=argc)
+		usage(argv[0]);
+
+	struct sampling_summary_t *summaries=NULL;
+	int nr_chains=0,minorder=-1,maxorder=-1;
+	long int nr_measurements=0;
+
+	for(int c=first;c<argc;c++)
+	{
+		struct chain_results_t *results;
+		int nr_results,thisminorder,thismaxorder;
+
+		if(!(results=load_results(argv[c],&nr_results,&thisminorder,&thismaxorder)))
+		{
+			fprintf(stderr,"Error: %s is not a valid results file.\n",argv[c]);
+			return 1;
+		}
+
+		if((minorder!=-1)&&((minorder!=thisminorder)||(maxorder!=thismaxorder)))
+		{
+			fprintf(stderr,"Error: the orders in %s (%d to %d) do not match the previous files (%d to %d).\n",
+				argv[c],thisminorder,thismaxorder,minorder,maxorder);
+			return 1;
+		}
+
+		minorder=thisminorder;
+		maxorder=thismaxorder;
+
+		summaries=realloc(summaries,sizeof(struct sampling_summary_t)*(nr_chains+nr_results));
+
+		if(!summaries)
+		{
+			fprintf(stderr,"Error: out of memory.\n");
+			return 1;
+		}
+
+		/*
+			Only the measurements are saved in the results files, so they are also
+			taken as the number of samples.
+		*/
+
+		for(int d=0;d<nr_results;d++)
+		{
+			struct sampling_summary_t *summary=&summaries[nr_chains+d];
+
+			summary->results=results[d];
+			summary->nr_samples=summary->nr_physical_samples=results[d].nr_measurements;
+			nr_measurements+=results[d].nr_measurements;
+		}
+
+		nr_chains+=nr_results;
+
+		free(results);
+	}
+
+	printf("# Merged %d chains from %d files\n",nr_chains,argc-first);
+	printf("# Minimum order: %d\n",minorder);
+	printf("# Maximum order: %d\n",maxorder);
+	printf("# Measurements: %ld\n",nr_measurements);
+	printf("#\n");
+
+	/*
+		The same report printed by mpn, which only needs the orders from the configuration.
+	*/
+
+	struct configuration_t config;
+
+	load_config_defaults(&config);
+	config.minorder=minorder;
+	config.maxorder=maxorder;
+
+	sampling_summaries_print_report(summaries,nr_chains,&config,stdout);
+
+	if(output!=NULL)
+	{
+		const struct chain_results_t **pointers=malloc(sizeof(struct chain_results_t *)*nr_chains);
+
+		for(int c=0;c<nr_chains;c++)
+			pointers[c]=&summaries[c].results;
+
+		if(save_results(output,pointers,nr_chains,minorder,maxorder)==false)
+		{
+			fprintf(stderr,"Error: couldn't write %s.\n",output);
+			free(pointers);
+			free(summaries);
+			return 1;
+		}
+
+		printf("# All the chains have been saved to %s\n",output);
+		free(pointers);
+	}
+
+	free(summaries);
+	free(config.prefix);
+
+	return 0;
+}
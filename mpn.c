@@ -1,9 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 
 #include <gsl/gsl_math.h>
-#include <gsl/gsl_matrix.h>
 
 #include "mpn.h"
 #include "amatrix.h"
@@ -76,11 +76,35 @@ int count_loops(struct label_t *labels, int *ilabels, int mels[MAX_MATRIX_ELEMEN
 	return loops;
 }
 
+/*
+	Auxiliary functions for the incidence matrix
+*/
+
+void incidence_print(struct incidence_t *B)
+{
+	for(size_t i=0;i<B->size1;i++)
+	{
+		for(size_t j=0;j<B->size2;j++)
+			printf("%d ", B->values[i][j]);
+
+		printf("\n");
+	}
+}
+
+bool incidence_columns_are_identical(struct incidence_t *B, size_t col1, size_t col2)
+{
+	for(size_t row=0;row<B->size1;row++)
+		if(B->values[row][col1]!=B->values[row][col2])
+			return false;
+
+	return true;
+}
+
 /*
 	This function calculates a diagram's weight given the incidence matrix
 */
 
-double incidence_to_weight(gsl_matrix_int *B, struct label_t *labels, int *ilabels, struct amatrix_t *amx)
+double incidence_to_weight(struct incidence_t *B, struct label_t *labels, int *ilabels, struct amatrix_t *amx)
 {
 	bool verbose=false;
 
@@ -98,7 +122,7 @@ double incidence_to_weight(gsl_matrix_int *B, struct label_t *labels, int *ilabe
 
 		printf("\n");
 
-		gsl_matrix_int_print(B);
+		incidence_print(B);
 	}
 
 	/*
@@ -114,7 +138,7 @@ double incidence_to_weight(gsl_matrix_int *B, struct label_t *labels, int *ilabe
 
 		for(size_t j=0;j<B->size2;j++)
 		{
-			if(gsl_matrix_int_get(B, i, j)==1)
+			if(B->values[i][j]==1)
 			{
 				if(mels[i][0]==-1)
 					mels[i][0]=j;
@@ -124,7 +148,7 @@ double incidence_to_weight(gsl_matrix_int *B, struct label_t *labels, int *ilabe
 					assert(false);
 			}
 
-			if(gsl_matrix_int_get(B, i, j)==-1)
+			if(B->values[i][j]==-1)
 			{
 				if(mels[i][2]==-1)
 					mels[i][2]=j;
@@ -134,7 +158,7 @@ double incidence_to_weight(gsl_matrix_int *B, struct label_t *labels, int *ilabe
 					assert(false);
 			}
 
-			if(gsl_matrix_int_get(B, i, j)==2)
+			if(B->values[i][j]==2)
 				has_selfloop=true;
 		}
 
@@ -152,7 +176,7 @@ double incidence_to_weight(gsl_matrix_int *B, struct label_t *labels, int *ilabe
 		int cnt=0;
 
 		for(size_t j=i+1;j<B->size2;j++)
-			if(columns_are_identical(B, i, j)==true)
+			if(incidence_columns_are_identical(B, i, j)==true)
 				cnt++;
 
 		if(cnt!=0)
@@ -165,6 +189,16 @@ double incidence_to_weight(gsl_matrix_int *B, struct label_t *labels, int *ilabe
 
 	double denominators=1.0f;
 
+	/*
+		The i-th denominator contains the labels whose column, summed over the first i+1 rows,
+		is non-zero: we keep the running sums for each column.
+	*/
+
+	int sums[2*PMATRIX_MAX_DIMENSIONS];
+
+	for(size_t j=0;j<B->size2;j++)
+		sums[j]=0;
+
 	for(size_t i=0;i<(B->size1-1);i++)
 	{
 		if(verbose==true)
@@ -175,12 +209,9 @@ double incidence_to_weight(gsl_matrix_int *B, struct label_t *labels, int *ilabe
 
 		for(size_t j=0;j<B->size2;j++)
 		{
-			int sum=0;
-
-			for(size_t k=0;k<=i;k++)
-				sum+=gsl_matrix_int_get(B,k,j);
+			sums[j]+=B->values[i][j];
 
-			if(sum!=0)
+			if(sums[j]!=0)
 			{
 				/*
 					The j-th label contributes to the i-th denominator
@@ -294,13 +325,14 @@ double incidence_to_weight(gsl_matrix_int *B, struct label_t *labels, int *ilabe
 	return pow(inversefactor,-1.0f)*numerators/denominators/amatrix_multiplicity(amx);
 }
 
-gsl_matrix_int *amatrix_calculate_incidence(struct amatrix_t *amx, struct label_t labels[MAX_LABELS], int *ilabels)
+void amatrix_calculate_incidence(struct amatrix_t *amx, struct incidence_t *incidence, struct label_t labels[MAX_LABELS], int *ilabels)
 {
 	int dimensions=amx->pmxs[0]->dimensions;
 	assert(dimensions>0);
 	assert(dimensions<=PMATRIX_MAX_DIMENSIONS);
 
-	gsl_matrix_int *incidence=gsl_matrix_int_alloc(dimensions,2*dimensions);
+	incidence->size1=dimensions;
+	incidence->size2=2*dimensions;
 
 	char *mnemonics[2]={"nopqrstuvwxyz","abcdefghijklm"};
 	int imnemonics[2]={0, 0};
@@ -317,8 +349,10 @@ gsl_matrix_int *amatrix_calculate_incidence(struct amatrix_t *amx, struct label_
 		{
 			if(i==j)
 			{
+#ifndef NDEBUG
 				if(amatrix_is_physical(amx)==true)
 					assert(pmatrix_get_entry(amx->pmxs[0], i, j)==0);
+#endif
 
 				/*
 					If we are here, we must be in the unphysical sector
@@ -329,11 +363,11 @@ gsl_matrix_int *amatrix_calculate_incidence(struct amatrix_t *amx, struct label_
 					assert(*ilabels<(2*dimensions));
 
 					for(int k=0;k<dimensions;k++)
-						gsl_matrix_int_set(incidence, k, *ilabels, 0);
+						incidence->values[k][*ilabels]=0;
 
 					for(int k=0;k<dimensions;k++)
 						if(k==i)
-							gsl_matrix_int_set(incidence, k, *ilabels, 2);
+							incidence->values[k][*ilabels]=2;
 
 					int qtype=pmatrix_entry_type(i,j);
 
@@ -362,11 +396,11 @@ gsl_matrix_int *amatrix_calculate_incidence(struct amatrix_t *amx, struct label_
 					assert(*ilabels<(2*dimensions));
 
 					for(int k=0;k<dimensions;k++)
-						gsl_matrix_int_set(incidence, k, *ilabels, 0);
+						incidence->values[k][*ilabels]=0;
 
 					for(int k=0;k<dimensions;k++)
 						if(k==i)
-							gsl_matrix_int_set(incidence, k, *ilabels, 2);
+							incidence->values[k][*ilabels]=2;
 
 					int qtype=pmatrix_entry_type(i,j);
 
@@ -397,14 +431,14 @@ gsl_matrix_int *amatrix_calculate_incidence(struct amatrix_t *amx, struct label_
 					assert(*ilabels<(2*dimensions));
 
 					for(int k=0;k<dimensions;k++)
-						gsl_matrix_int_set(incidence, k, *ilabels, 0);
+						incidence->values[k][*ilabels]=0;
 
 					for(int k=0;k<dimensions;k++)
 					{
 						if(k==i)
-							gsl_matrix_int_set(incidence, k, *ilabels, 1);
+							incidence->values[k][*ilabels]=1;
 						else if(k==j)
-							gsl_matrix_int_set(incidence, k, *ilabels, -1);
+							incidence->values[k][*ilabels]=-1;
 					}
 
 					int qtype=pmatrix_entry_type(i,j);
@@ -434,14 +468,14 @@ gsl_matrix_int *amatrix_calculate_incidence(struct amatrix_t *amx, struct label_
 					assert(*ilabels<(2*dimensions));
 
 					for(int k=0;k<dimensions;k++)
-						gsl_matrix_int_set(incidence, k, *ilabels, 0);
+						incidence->values[k][*ilabels]=0;
 
 					for(int k=0;k<dimensions;k++)
 					{
 						if(k==i)
-							gsl_matrix_int_set(incidence, k, *ilabels, 1);
+							incidence->values[k][*ilabels]=1;
 						else if(k==j)
-							gsl_matrix_int_set(incidence, k, *ilabels, -1);
+							incidence->values[k][*ilabels]=-1;
 					}
 
 					int qtype=pmatrix_entry_type(i,j);
@@ -482,10 +516,10 @@ gsl_matrix_int *amatrix_calculate_incidence(struct amatrix_t *amx, struct label_
 
 		for(int j=0;j<2*dimensions;j++)
 		{
-			if(gsl_matrix_int_get(incidence, i, j)!=2)
-				sumrow+=gsl_matrix_int_get(incidence, i, j);
+			if(incidence->values[i][j]!=2)
+				sumrow+=incidence->values[i][j];
 
-			abssumrow+=abs(gsl_matrix_int_get(incidence, i, j));
+			abssumrow+=abs(incidence->values[i][j]);
 		}
 
 		assert(sumrow==0);
@@ -498,10 +532,10 @@ gsl_matrix_int *amatrix_calculate_incidence(struct amatrix_t *amx, struct label_
 
 		for(int i=0;i<dimensions;i++)
 		{
-			if(gsl_matrix_int_get(incidence, i, j)!=2)
-				sumcolumn+=gsl_matrix_int_get(incidence, i, j);
+			if(incidence->values[i][j]!=2)
+				sumcolumn+=incidence->values[i][j];
 
-			abssumcolumn+=abs(gsl_matrix_int_get(incidence, i, j));
+			abssumcolumn+=abs(incidence->values[i][j]);
 		}
 
 		assert(sumcolumn==0);
@@ -509,6 +543,4 @@ gsl_matrix_int *amatrix_calculate_incidence(struct amatrix_t *amx, struct label_
 	}
 
 #endif
-
-	return incidence;
 }
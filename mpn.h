@@ -2,8 +2,8 @@
 #define __MPN_H__
 
 #include <stdbool.h>
-
-#include <gsl/gsl_matrix.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #include "loaderis.h"
 #include "limits.h"
@@ -24,11 +24,25 @@ struct label_t
 	bool selfloop;
 };
 
+/*
+	The incidence matrix, with a row for each matrix element and a column for each label.
+	Its size is fixed, so that it can be kept on the stack and no allocation is needed.
+*/
+
+struct incidence_t
+{
+	size_t size1,size2;
+	int8_t values[PMATRIX_MAX_DIMENSIONS][2*PMATRIX_MAX_DIMENSIONS];
+};
+
 struct amatrix_t;
 
 int count_loops(struct label_t *labels, int *ilabels, int mels[MAX_MATRIX_ELEMENTS][4], int nrmels);
 
-double incidence_to_weight(gsl_matrix_int *B, struct label_t *labels, int *ilabels, struct amatrix_t *amx);
-gsl_matrix_int *amatrix_calculate_incidence(struct amatrix_t *amx, struct label_t labels[MAX_LABELS], int *ilabels);
+void incidence_print(struct incidence_t *B);
+bool incidence_columns_are_identical(struct incidence_t *B, size_t col1, size_t col2);
+
+double incidence_to_weight(struct incidence_t *B, struct label_t *labels, int *ilabels, struct amatrix_t *amx);
+void amatrix_calculate_incidence(struct amatrix_t *amx, struct incidence_t *incidence, struct label_t labels[MAX_LABELS], int *ilabels);
 
 #endif //__MPN_H__
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <assert.h>
 
 #include "multiplicity.h"
@@ -220,7 +221,12 @@ int adjacency_matrix_multiplicity(gsl_matrix_int *adjacency)
 	return 1<<nrblocks;
 }
 
-double actual_amatrix_multiplicity(struct amatrix_t *amx)
+/*
+	The block decomposition above, working on a GSL copy of the adjacency matrix, is kept
+	as a reference for validating actual_amatrix_multiplicity(), see mpn-buildcache.
+*/
+
+double reference_amatrix_multiplicity(struct amatrix_t *amx)
 {
 	int dimensions=amx->pmxs[0]->dimensions;
 
@@ -240,10 +246,10 @@ double actual_amatrix_multiplicity(struct amatrix_t *amx)
 		{
 			int value=0;
 
-			if(amx->pmxs[0]->values[i][j]!=0)
+			if(pmatrix_get_col(amx->pmxs[0], i)==j)
 				value++;
 
-			if(amx->pmxs[1]->values[i][j]!=0)
+			if(pmatrix_get_col(amx->pmxs[1], i)==j)
 				value++;
 
 			gsl_matrix_int_set(adjacency, i, j, value);
@@ -258,11 +264,59 @@ double actual_amatrix_multiplicity(struct amatrix_t *amx)
 	return adjacency_matrix_multiplicity(adjacency);
 }
 
+/*
+	The same number of blocks, found directly from the two permutations.
+
+	Starting from a row, we move to the column of its non-zero entry in the first matrix,
+	and then to the row of the non-zero entry of the second matrix in that column, i.e.
+	the rows are mapped by the permutation
+
+		tau(i) = rows_1[cols_0[i]]
+
+	The fixed points of tau are exactly the '2' entries, which are removed by the algorithm
+	above, while each longer cycle of tau is one of the blocks. The rows already visited are
+	kept in a bitmask, so that the calculation is O(n) and does not allocate any memory.
+*/
+
+double actual_amatrix_multiplicity(struct amatrix_t *amx)
+{
+	int dimensions=amx->pmxs[0]->dimensions;
+
+	assert(dimensions>=1);
+	assert(dimensions<=PMATRIX_MAX_DIMENSIONS);
+
+	if(dimensions==1)
+		return 2;
+
+	uint32_t visited=0;
+	int nrblocks=0;
+
+	for(int i=0;i<dimensions;i++)
+	{
+		if((visited&(1U<<i))!=0)
+			continue;
+
+		int k=i,length=0;
+
+		do
+		{
+			visited|=(1U<<k);
+			k=amx->pmxs[1]->rows[amx->pmxs[0]->cols[k]];
+			length++;
+		} while(k!=i);
+
+		if(length>1)
+			nrblocks++;
+	}
+
+	return 1<<nrblocks;
+}
+
 double amatrix_multiplicity(struct amatrix_t *amx)
 {
 	int dimensions=amx->pmxs[0]->dimensions;
 
-	if((dimensions>1)&&(dimensions<=amatrix_cache_max_dimensions)&&(amatrix_cache_is_enabled==true))
+	if(cache_is_available(dimensions)==true)
 	{
 		assert(cached_amatrix_multiplicity(amx)==actual_amatrix_multiplicity(amx));
 		return cached_amatrix_multiplicity(amx);
@@ -3,6 +3,7 @@
 
 #include "amatrix.h"
 
+double reference_amatrix_multiplicity(struct amatrix_t *amx);
 double actual_amatrix_multiplicity(struct amatrix_t *amx);
 double amatrix_multiplicity(struct amatrix_t *amx);
 
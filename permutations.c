@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stdint.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_rng.h>
 
@@ -8,8 +9,7 @@
 
 /*
 	Given a N-permutation of number from 1 to N, returns its index in the lexicographic
-	sorting of all permutations. Note that this is the same order of the permutations listed
-	in file permutations.h
+	sorting of all permutations. Note that this is the same order used by unrank_permutation()
 
 	The algorithm is adapted from: http://www.geekviewpoint.com/java/numbers/permutation_index
 */
@@ -78,159 +78,111 @@ void matrix_to_permutation(gsl_matrix_int *m,int *permutation)
 
 void pmatrix_to_permutation(struct pmatrix_t *m,int *permutation)
 {
-	int dimensions=m->dimensions;
+	for(int i=0;i<m->dimensions;i++)
+		permutation[i]=pmatrix_get_col(m,i)+1;
+}
 
-	for(int i=0;i<dimensions;i++)
-	{
-		for(int j=0;j<dimensions;j++)
-		{
-			if(pmatrix_get_entry(m,i,j)!=0)
-			{
-				permutation[i]=j+1;
-				break;
-			}
-		}
-	}
+/*
+	The permutations of a given length are never tabulated: the pindex-th permutation in
+	lexicographic order is found directly from the digits of its Lehmer code, i.e. by writing
+	pindex in the factorial number system. The d-th digit selects the d-th smallest among the
+	numbers not used yet, which are kept in a bitmask.
+*/
+
+static const uint64_t permutation_factorials[PMATRIX_MAX_DIMENSIONS+1]=
+{
+	1ULL, 1ULL, 2ULL, 6ULL, 24ULL, 120ULL, 720ULL, 5040ULL, 40320ULL, 362880ULL, 3628800ULL,
+	39916800ULL, 479001600ULL, 6227020800ULL, 87178291200ULL, 1307674368000ULL, 20922789888000ULL
+};
+
+uint64_t get_nr_permutations(int dimensions)
+{
+	assert((dimensions>=0)&&(dimensions<=PMATRIX_MAX_DIMENSIONS));
+
+	return permutation_factorials[dimensions];
 }
 
-int permutations2[2][2];
-int permutations3[6][3];
-int permutations4[24][4];
-int permutations5[120][5];
-int permutations6[720][6];
-int permutations7[5040][7];
-int permutations8[40320][8];
-int permutations9[362880][9];
-int permutations10[3628800][10];
-
-void init_permutation_table(int dimensions)
+void unrank_permutation(int dimensions,uint64_t pindex,int *permutation)
 {
-	int index,numbers[MAX_ORDER];
+	assert((dimensions>=1)&&(dimensions<=PMATRIX_MAX_DIMENSIONS));
+	assert(pindex<permutation_factorials[dimensions]);
 
-	for(int c=0;c<MAX_ORDER;c++)
-		numbers[c]=1;
+	uint32_t unused=(1U<<dimensions)-1;
 
-	index=0;
-	while(numbers[dimensions]==1)
+	for(int c=0;c<dimensions;c++)
 	{
-		bool is_permutation=true;
+		uint64_t factor=permutation_factorials[dimensions-1-c];
+		int digit=pindex/factor;
 
-		for(int c=0;c<dimensions;c++)
-			for(int d=c+1;d<dimensions;d++)
-				if(numbers[c]==numbers[d])
-					is_permutation=false;
+		pindex%=factor;
 
-		if(is_permutation)
-		{
-			for(int c=0;c<dimensions;c++)
-			{
-				switch(dimensions)
-				{
-					case 2:
-					permutations2[index][c]=numbers[dimensions-1-c];
-					break;
-
-					case 3:
-					permutations3[index][c]=numbers[dimensions-1-c];
-					break;
-
-					case 4:
-					permutations4[index][c]=numbers[dimensions-1-c];
-					break;
-
-					case 5:
-					permutations5[index][c]=numbers[dimensions-1-c];
-					break;
-
-					case 6:
-					permutations6[index][c]=numbers[dimensions-1-c];
-					break;
-
-					case 7:
-					permutations7[index][c]=numbers[dimensions-1-c];
-					break;
-
-					case 8:
-					permutations8[index][c]=numbers[dimensions-1-c];
-					break;
-
-					case 9:
-					permutations9[index][c]=numbers[dimensions-1-c];
-					break;
-
-					case 10:
-					permutations10[index][c]=numbers[dimensions-1-c];
-					break;
-
-					default:
-					break;
-				}
-			}
+		/*
+			We look for the digit-th unused number
+		*/
 
-			index++;
-		}
+		uint32_t remaining=unused;
 
-		for(int c=0;c<MAX_ORDER;c++)
-		{
-			numbers[c]++;
+		for(int d=0;d<digit;d++)
+			remaining&=remaining-1;
 
-			if(numbers[c]==(dimensions+1))
-				numbers[c]=1;
-			else
-				break;
-		}
-	}
+		int value=__builtin_ctz(remaining);
 
-	assert(index==ifactorial(dimensions));
+		unused&=~(1U<<value);
+		permutation[c]=value+1;
+	}
 }
 
-void init_permutation_tables(int max_dimensions)
+/*
+	Single elements are usually requested one after the other for the same few permutations,
+	so the last ones are kept in a small cache, one for each thread.
+*/
+
+#define PERMUTATION_CACHE_SLOTS		(4)
+
+static _Thread_local struct
 {
-	for(int c=2;c<=max_dimensions;c++)
-		init_permutation_table(c);
+	int dimensions;
+	uint64_t pindex;
+	int permutation[PMATRIX_MAX_DIMENSIONS];
 }
+permutation_cache[PERMUTATION_CACHE_SLOTS];
 
-int get_permutation(int dimensions,int pindex,int element)
+int get_permutation(int dimensions,uint64_t pindex,int element)
 {
-	assert((dimensions>=2)&&(dimensions<=10));
-	assert((pindex>=0)&&(pindex<ifactorial(dimensions)));
+	assert((dimensions>=1)&&(dimensions<=PMATRIX_MAX_DIMENSIONS));
+	assert(pindex<permutation_factorials[dimensions]);
 	assert((element>=0)&&(element<dimensions));
 
-	switch(dimensions)
-	{
-		case 2:
-		return permutations2[pindex][element];
-
-		case 3:
-		return permutations3[pindex][element];
-
-		case 4:
-		return permutations4[pindex][element];
+	int slot=pindex%PERMUTATION_CACHE_SLOTS;
 
-		case 5:
-		return permutations5[pindex][element];
+	if((permutation_cache[slot].dimensions!=dimensions)||(permutation_cache[slot].pindex!=pindex))
+	{
+		unrank_permutation(dimensions,pindex,permutation_cache[slot].permutation);
+		permutation_cache[slot].dimensions=dimensions;
+		permutation_cache[slot].pindex=pindex;
+	}
 
-		case 6:
-		return permutations6[pindex][element];
+	return permutation_cache[slot].permutation[element];
+}
 
-		case 7:
-		return permutations7[pindex][element];
+/*
+	A random index, uniformly distributed between 0 and n!-1. If n! exceeds the range
+	of the random number generator, the Lehmer code digits are drawn one by one.
+*/
 
-		case 8:
-		return permutations8[pindex][element];
+uint64_t get_random_permutation_index(gsl_rng *rng_ctx,int dimensions)
+{
+	assert((dimensions>=1)&&(dimensions<=PMATRIX_MAX_DIMENSIONS));
 
-		case 9:
-		return permutations9[pindex][element];
+	if(permutation_factorials[dimensions]<=(gsl_rng_max(rng_ctx)-gsl_rng_min(rng_ctx)))
+		return gsl_rng_uniform_int(rng_ctx, permutation_factorials[dimensions]);
 
-		case 10:
-		return permutations10[pindex][element];
+	uint64_t pindex=0;
 
-		default:
-		break;
-	}
+	for(int c=0;c<dimensions;c++)
+		pindex+=gsl_rng_uniform_int(rng_ctx, dimensions-c)*permutation_factorials[dimensions-1-c];
 
-	assert(false);
-	return 0;
+	return pindex;
 }
 
 /*
@@ -16,13 +16,17 @@ struct pmatrix_t *init_pmatrix(int nr_occupied,int nr_virtual,gsl_rng *rngctx)
 	ret->dimensions=2;
 	ret->nr_occupied=nr_occupied;
 	ret->nr_virtual=nr_virtual;
+	ret->rank_is_valid=false;
+	ret->undo=NULL;
 
 	for(int i=0;i<PMATRIX_MAX_DIMENSIONS;i++)
-		for(int j=0;j<PMATRIX_MAX_DIMENSIONS;j++)
-			ret->values[i][j]=0;
+	{
+		ret->cols[i]=ret->rows[i]=-1;
+		ret->values[i]=0;
+	}
 
-	ret->values[0][0]=pmatrix_get_new_value(ret, rngctx, 0, 0);
-	ret->values[1][1]=pmatrix_get_new_value(ret, rngctx, 1, 1);
+	pmatrix_place_entry(ret, 0, 0, pmatrix_get_new_value(ret, rngctx, 0, 0));
+	pmatrix_place_entry(ret, 1, 1, pmatrix_get_new_value(ret, rngctx, 1, 1));
 
 	return ret;
 }
@@ -33,6 +37,91 @@ void fini_pmatrix(struct pmatrix_t *pmx)
 		free(pmx);
 }
 
+/*
+	Undo log: every function modifying the cols[], rows[] or values[] arrays records
+	their previous contents first, if an undo log is attached. Rolling back replays
+	the records in reverse order, so that the oldest contents are restored last.
+*/
+
+static inline void pmatrix_log_row(struct pmatrix_t *pmx, int i)
+{
+	struct pmatrix_undo_t *undo=pmx->undo;
+
+	if(undo)
+	{
+		assert(undo->nr_records<PMATRIX_UNDO_MAX_RECORDS);
+
+		undo->records[undo->nr_records].type=PMATRIX_UNDO_ROW;
+		undo->records[undo->nr_records].index=i;
+		undo->records[undo->nr_records].previous=pmx->cols[i];
+		undo->records[undo->nr_records].value=pmx->values[i];
+		undo->nr_records++;
+	}
+}
+
+static inline void pmatrix_log_col(struct pmatrix_t *pmx, int j)
+{
+	struct pmatrix_undo_t *undo=pmx->undo;
+
+	if(undo)
+	{
+		assert(undo->nr_records<PMATRIX_UNDO_MAX_RECORDS);
+
+		undo->records[undo->nr_records].type=PMATRIX_UNDO_COL;
+		undo->records[undo->nr_records].index=j;
+		undo->records[undo->nr_records].previous=pmx->rows[j];
+		undo->nr_records++;
+	}
+}
+
+void pmatrix_undo_begin(struct pmatrix_t *pmx, struct pmatrix_undo_t *undo)
+{
+	assert(pmx->undo==NULL);
+
+	undo->dimensions=pmx->dimensions;
+	undo->nr_records=0;
+	undo->rank=pmx->rank;
+	undo->rank_is_valid=pmx->rank_is_valid;
+
+	pmx->undo=undo;
+}
+
+void pmatrix_undo_end(struct pmatrix_t *pmx)
+{
+	assert(pmx->undo!=NULL);
+
+	pmx->undo=NULL;
+}
+
+void pmatrix_undo_rollback(struct pmatrix_t *pmx)
+{
+	struct pmatrix_undo_t *undo=pmx->undo;
+
+	assert(undo!=NULL);
+
+	for(int c=undo->nr_records-1;c>=0;c--)
+	{
+		int index=undo->records[c].index;
+
+		switch(undo->records[c].type)
+		{
+			case PMATRIX_UNDO_ROW:
+			pmx->cols[index]=undo->records[c].previous;
+			pmx->values[index]=undo->records[c].value;
+			break;
+
+			case PMATRIX_UNDO_COL:
+			pmx->rows[index]=undo->records[c].previous;
+			break;
+		}
+	}
+
+	pmx->dimensions=undo->dimensions;
+	pmx->rank=undo->rank;
+	pmx->rank_is_valid=undo->rank_is_valid;
+	pmx->undo=NULL;
+}
+
 /*
 	Basic matrix operations. Note that the matrix format is (i,j):
 
@@ -41,21 +130,26 @@ void fini_pmatrix(struct pmatrix_t *pmx)
 	(2,0) (2,1) (2,2)
 
 	so i is the row, while j is the column.
+
+	Only the non-zero entries are stored, so the 'set' functions can only change the
+	value of an existing non-zero entry. The arrangement of non-zero entries is changed
+	using pmatrix_place_entry(), or by the higher-level operations below.
 */
 
 int pmatrix_get_entry(struct pmatrix_t *pmx, int i, int j)
 {
 	assert((i>=0)&&(i<pmx->dimensions));
 	assert((j>=0)&&(j<pmx->dimensions));
-	assert(pmx->values[i][j]>=0);
 
-	if(pmx->values[i][j]==0)
+	if(pmx->cols[i]!=j)
 		return 0;
 
+	assert(pmx->values[i]>0);
+
 	if(pmatrix_entry_type(i,j)==QTYPE_VIRTUAL)
-		return 1+((pmx->values[i][j]-1)%pmx->nr_virtual);
+		return 1+((pmx->values[i]-1)%pmx->nr_virtual);
 	else if(pmatrix_entry_type(i,j)==QTYPE_OCCUPIED)
-		return 1+((pmx->values[i][j]-1)%pmx->nr_occupied);
+		return 1+((pmx->values[i]-1)%pmx->nr_occupied);
 
 	assert(false);
 	return 0;
@@ -65,34 +159,118 @@ void pmatrix_set_entry(struct pmatrix_t *pmx, int i, int j, int value)
 {
 	assert((i>=0)&&(i<pmx->dimensions));
 	assert((j>=0)&&(j<pmx->dimensions));
-	assert(pmx->values[i][j]>=0);
-	assert(value>=0);
+	assert(pmx->cols[i]==j);
+	assert(value>0);
 
 	if(pmatrix_entry_type(i,j)==QTYPE_OCCUPIED)
 		assert(value<=pmx->nr_occupied);
 	else if(pmatrix_entry_type(i,j)==QTYPE_VIRTUAL)
 		assert(value<=pmx->nr_virtual);
 
-	pmx->values[i][j]=value;
+	pmatrix_log_row(pmx, i);
+	pmx->values[i]=value;
 }
 
 int pmatrix_get_raw_entry(struct pmatrix_t *pmx, int i, int j)
 {
 	assert((i>=0)&&(i<pmx->dimensions));
 	assert((j>=0)&&(j<pmx->dimensions));
-	assert(pmx->values[i][j]>=0);
 
-	return pmx->values[i][j];
+	if(pmx->cols[i]!=j)
+		return 0;
+
+	assert(pmx->values[i]>0);
+
+	return pmx->values[i];
 }
 
 void pmatrix_set_raw_entry(struct pmatrix_t *pmx, int i, int j, int value)
 {
 	assert((i>=0)&&(i<pmx->dimensions));
 	assert((j>=0)&&(j<pmx->dimensions));
-	assert(pmx->values[i][j]>=0);
-	assert(value>=0);
+	assert(pmx->cols[i]==j);
+	assert(value>0);
+
+	pmatrix_log_row(pmx, i);
+	pmx->values[i]=value;
+}
+
+/*
+	Column of the non-zero entry on the i-th row, and row of the
+	non-zero entry on the j-th column.
+*/
+
+int pmatrix_get_col(struct pmatrix_t *pmx, int i)
+{
+	assert((i>=0)&&(i<pmx->dimensions));
+
+	return pmx->cols[i];
+}
+
+int pmatrix_get_row(struct pmatrix_t *pmx, int j)
+{
+	assert((j>=0)&&(j<pmx->dimensions));
+
+	return pmx->rows[j];
+}
+
+/*
+	Puts the non-zero entry of the i-th row in the j-th column, with the given raw value.
+
+	The caller is responsible for the consistency of the whole matrix, i.e. after
+	placing the entries of all rows they must form a permutation.
+*/
+
+void pmatrix_place_entry(struct pmatrix_t *pmx, int i, int j, int value)
+{
+	assert((i>=0)&&(i<pmx->dimensions));
+	assert((j>=0)&&(j<pmx->dimensions));
+	assert(value>0);
+
+	pmatrix_log_row(pmx, i);
+	pmatrix_log_col(pmx, j);
+
+	pmx->cols[i]=j;
+	pmx->rows[j]=i;
+	pmx->values[i]=value;
+	pmx->rank_is_valid=false;
+}
+
+/*
+	The rank of the permutation is given by its Lehmer code: the i-th digit is the number
+	of elements following the i-th one that are smaller than it, and it is weighted
+	by (n-1-i)!. The elements already seen are kept in a bitmask, so that each
+	digit is found with a single popcount and the calculation is O(n).
+*/
+
+static uint64_t pmatrix_calculate_rank(struct pmatrix_t *pmx)
+{
+	uint32_t seen=0;
+	uint64_t rank=0,factor=1;
+
+	for(int i=pmx->dimensions-1,position=1;i>=0;i--,position++)
+	{
+		int value=pmx->cols[i];
+
+		rank+=__builtin_popcount(seen&((1U<<value)-1))*factor;
+		factor*=position;
+		seen|=(1U<<value);
+	}
+
+	return rank;
+}
+
+uint64_t pmatrix_get_rank(struct pmatrix_t *pmx)
+{
+	if(pmx->rank_is_valid==false)
+	{
+		pmx->rank=pmatrix_calculate_rank(pmx);
+		pmx->rank_is_valid=true;
+	}
 
-	pmx->values[i][j]=value;
+	assert(pmx->rank==pmatrix_calculate_rank(pmx));
+
+	return pmx->rank;
 }
 
 void pmatrix_print(struct pmatrix_t *pmx)
@@ -140,91 +318,52 @@ void pmatrix_extend(struct pmatrix_t *pmx, gsl_rng *rngctx, int *targeti, int *t
 	if(selector<pmx->dimensions)
 	{
 		/*
-			First we increase the dimensions of the matrix
-		*/
-
-		pmx->dimensions++;
-
-		/*
-			Then we need to cleanup the new entries
-		*/
-
-		for(int i=0;i<pmx->dimensions;i++)
-		{
-			pmatrix_set_entry(pmx, pmx->dimensions-1, i, 0);
-			pmatrix_set_entry(pmx, i, pmx->dimensions-1, 0);
-		}
-
-		/*
-			Then we look for a non-zero element on the j-th column (j=selector)
+			The non-zero element on the j-th column (j=selector) lies on the i-th row.
 		*/
 
-		int i,j=selector;
+		int j=selector;
+		int i=pmx->rows[j];
+		int value=pmx->values[i];
 
-		for(i=0;i<(pmx->dimensions-1);i++)
-			if(pmatrix_get_entry(pmx, i, j)!=0)
-				break;
+		assert(pmx->cols[i]==j);
 
 		/*
-			There should be only at most one non-zero element on each column
+			We increase the dimensions of the matrix, and we move the element to
+			the new row and column. One of the two new elements keeps the old value,
+			the other one has a different type and it is set to 1.
 		*/
 
-		assert(i<(pmx->dimensions-1));
+		int last=pmx->dimensions++;
 
-		for(int i2=i+1;i2<(pmx->dimensions-1);i2++)
-			assert(pmatrix_get_entry(pmx, i2, j)==0);
-
-		/*
-			Finally we set the two new values.
-		*/
-
-		if(pmatrix_entry_type(i,pmx->dimensions-1)==pmatrix_entry_type(i,j))
+		if(pmatrix_entry_type(i,last)==pmatrix_entry_type(i,j))
 		{
-			pmatrix_set_raw_entry(pmx, i, pmx->dimensions-1, pmatrix_get_raw_entry(pmx, i, j));
+			pmatrix_place_entry(pmx, i, last, value);
 		}
 		else
 		{
-			pmatrix_set_entry(pmx, i, pmx->dimensions-1, 1);
+			pmatrix_place_entry(pmx, i, last, 1);
 			*targeti=i;
-			*targetj=pmx->dimensions-1;
+			*targetj=last;
 		}
 
-		if(pmatrix_entry_type(pmx->dimensions-1, j)==pmatrix_entry_type(i,j))
+		if(pmatrix_entry_type(last, j)==pmatrix_entry_type(i,j))
 		{
-			pmatrix_set_raw_entry(pmx, pmx->dimensions-1, j, pmatrix_get_raw_entry(pmx, i, j));
+			pmatrix_place_entry(pmx, last, j, value);
 		}
 		else
 		{
-			pmatrix_set_entry(pmx, pmx->dimensions-1, j, 1);
-			*targeti=pmx->dimensions-1;
+			pmatrix_place_entry(pmx, last, j, 1);
+			*targeti=last;
 			*targetj=j;
 		}
 
-		assert((pmatrix_entry_type(i,pmx->dimensions-1)==pmatrix_entry_type(i,j))!=
-		       (pmatrix_entry_type(pmx->dimensions-1, j)==pmatrix_entry_type(i,j)));
-
-		pmatrix_set_entry(pmx, i, j, 0);
+		assert((pmatrix_entry_type(i,last)==pmatrix_entry_type(i,j))!=
+		       (pmatrix_entry_type(last, j)==pmatrix_entry_type(i,j)));
 
 		return;
 	}
 	else if(selector==pmx->dimensions)
 	{
-		/*
-			First we increase the dimensions of the matrix
-		*/
-
-		pmx->dimensions++;
-
-		/*
-			Then we need to cleanup the new entries
-		*/
-
-		for(int i=0;i<pmx->dimensions;i++)
-		{
-			pmatrix_set_entry(pmx, pmx->dimensions-1, i, 0);
-			pmatrix_set_entry(pmx, i, pmx->dimensions-1, 0);
-		}
-
 		/*
 			We just add the new element in the corner.
 
@@ -232,10 +371,12 @@ void pmatrix_extend(struct pmatrix_t *pmx, gsl_rng *rngctx, int *targeti, int *t
 			modifying it, if needed;
 		*/
 
-		*targeti=pmx->dimensions-1;
-		*targetj=pmx->dimensions-1;
+		int last=pmx->dimensions++;
+
+		*targeti=last;
+		*targetj=last;
 
-		pmatrix_set_entry(pmx, pmx->dimensions-1, pmx->dimensions-1, 1);
+		pmatrix_place_entry(pmx, last, last, 1);
 
 		return;
 	}
@@ -243,45 +384,51 @@ void pmatrix_extend(struct pmatrix_t *pmx, gsl_rng *rngctx, int *targeti, int *t
 	assert(false);
 }
 
-void pmatrix_squeeze(struct pmatrix_t *pmx, gsl_rng *rngctx)
+/*
+	The position of the entry whose value is discarded by pmatrix_squeeze(), i.e. the
+	entry that pmatrix_extend() would return as a target in the inverse update.
+*/
+
+void pmatrix_squeeze_target(struct pmatrix_t *pmx, int *targeti, int *targetj)
 {
 	assert(pmx->dimensions>1);
 
-	int i,j;
-
-	/*
-		First we look at the non-zero element in the last column
-	*/
-
-	for(i=0;i<pmx->dimensions;i++)
-		if(pmatrix_get_entry(pmx, i, pmx->dimensions-1)!=0)
-			break;
-
-	/*
-		There should be only at most one non-zero element on each column
-	*/
-
-	assert(i<pmx->dimensions);
+	int last=pmx->dimensions-1;
+	int i=pmx->rows[last];
+	int j=pmx->cols[last];
 
-	for(int i2=i+1;i2<pmx->dimensions;i2++)
-		assert(pmatrix_get_entry(pmx, i2, pmx->dimensions-1)==0);
+	if(i==last)
+	{
+		*targeti=*targetj=last;
+	}
+	else if(pmatrix_entry_type(i, last)==pmatrix_entry_type(i,j))
+	{
+		*targeti=last;
+		*targetj=j;
+	}
+	else
+	{
+		*targeti=i;
+		*targetj=last;
+	}
+}
 
-	/*
-		Then we look at the non-zero element in the last row
-	*/
+void pmatrix_squeeze(struct pmatrix_t *pmx, gsl_rng *rngctx)
+{
+	assert(pmx->dimensions>1);
 
-	for(j=0;j<pmx->dimensions;j++)
-		if(pmatrix_get_entry(pmx, pmx->dimensions-1, j)!=0)
-			break;
+	int last=pmx->dimensions-1;
 
 	/*
-		There should be only at most one non-zero element on each row
+		The non-zero element in the last column is on the i-th row,
+		the one in the last row is on the j-th column.
 	*/
 
-	assert(j<pmx->dimensions);
+	int i=pmx->rows[last];
+	int j=pmx->cols[last];
 
-	for(int j2=j+1;j2<pmx->dimensions;j2++)
-		assert(pmatrix_get_entry(pmx, pmx->dimensions-1, j2)==0);
+	assert((i>=0)&&(i<pmx->dimensions));
+	assert((j>=0)&&(j<pmx->dimensions));
 
 	/*
 		Finally we can squeeze the matrix.
@@ -289,39 +436,37 @@ void pmatrix_squeeze(struct pmatrix_t *pmx, gsl_rng *rngctx)
 		Case b): the element to remove is in the bottom right corner.
 	*/
 
-	if(i==(pmx->dimensions-1))
+	if(i==last)
 	{
-		assert(j==(pmx->dimensions-1));
-		pmatrix_set_entry(pmx, i, j, 0);
-
-		pmx->dimensions--;
-
-		return;
+		assert(j==last);
 	}
+	else
+	{
+		/*
+			...otherwise we have case a) two different entries on the last row
+			and column are being removed, and a new entry is added to the matrix.
+		*/
 
-	/*
-		...otherwise we have case a) two different entries on the last row
-		and column are being removed, and a new entry is added to the matrix.
-	*/
-
-	assert(pmatrix_get_entry(pmx, i, pmx->dimensions-1)!=0);
-	assert(pmatrix_get_entry(pmx, pmx->dimensions-1, j)!=0);
+		int newvalue=-1;
 
-	int newvalue=-1;
+		if(pmatrix_entry_type(i, last)==pmatrix_entry_type(i,j))
+			newvalue=pmx->values[i];
+		else if(pmatrix_entry_type(last, j)==pmatrix_entry_type(i,j))
+			newvalue=pmx->values[last];
 
-	if(pmatrix_entry_type(i, pmx->dimensions-1)==pmatrix_entry_type(i,j))
-		newvalue=pmatrix_get_raw_entry(pmx, i, pmx->dimensions-1);
-	else if(pmatrix_entry_type(pmx->dimensions-1, j)==pmatrix_entry_type(i,j))
-		newvalue=pmatrix_get_raw_entry(pmx, pmx->dimensions-1, j);
+		assert(newvalue!=-1);
 
-	assert(newvalue!=-1);
+		pmatrix_place_entry(pmx, i, j, newvalue);
+	}
 
-	pmatrix_set_entry(pmx, i, pmx->dimensions-1, 0);
-	pmatrix_set_entry(pmx, pmx->dimensions-1, j, 0);
+	pmatrix_log_row(pmx, last);
+	pmatrix_log_col(pmx, last);
 
-	pmatrix_set_raw_entry(pmx, i, j, newvalue);
+	pmx->cols[last]=pmx->rows[last]=-1;
+	pmx->values[last]=0;
 
 	pmx->dimensions--;
+	pmx->rank_is_valid=false;
 }
 
 void pmatrix_swap_rows(struct pmatrix_t *pmx, int i1, int i2, gsl_rng *rngctx)
@@ -332,13 +477,13 @@ void pmatrix_swap_rows(struct pmatrix_t *pmx, int i1, int i2, gsl_rng *rngctx)
 	assert(i2<pmx->dimensions);
 	assert(pmatrix_check_consistency(pmx)==true);
 
-	for(int j=0;j<pmx->dimensions;j++)
-	{
-		int tmp=pmatrix_get_raw_entry(pmx, i1, j);
+	int j1=pmx->cols[i1];
+	int j2=pmx->cols[i2];
+	int value1=pmx->values[i1];
+	int value2=pmx->values[i2];
 
-		pmatrix_set_raw_entry(pmx, i1, j, pmatrix_get_raw_entry(pmx, i2, j));
-		pmatrix_set_raw_entry(pmx, i2, j, tmp);
-	}
+	pmatrix_place_entry(pmx, i1, j2, value2);
+	pmatrix_place_entry(pmx, i2, j1, value1);
 
 	assert(pmatrix_check_consistency(pmx)==true);
 }
@@ -351,62 +496,57 @@ void pmatrix_swap_cols(struct pmatrix_t *pmx, int j1, int j2, gsl_rng *rngctx)
 	assert(j2<pmx->dimensions);
 	assert(pmatrix_check_consistency(pmx)==true);
 
-	for(int i=0;i<pmx->dimensions;i++)
-	{
-		int tmp=pmatrix_get_raw_entry(pmx, i, j1);
+	int i1=pmx->rows[j1];
+	int i2=pmx->rows[j2];
 
-		pmatrix_set_raw_entry(pmx, i, j1, pmatrix_get_raw_entry(pmx, i, j2));
-		pmatrix_set_raw_entry(pmx, i, j2, tmp);
-	}
+	pmatrix_place_entry(pmx, i1, j2, pmx->values[i1]);
+	pmatrix_place_entry(pmx, i2, j1, pmx->values[i2]);
 
 	assert(pmatrix_check_consistency(pmx)==true);
 }
 
 bool pmatrix_check_consistency(struct pmatrix_t *pmx)
 {
+	/*
+		The rows and columns arrays must be the inverse of each other,
+		which also guarantees that they are permutations.
+	*/
+
 	for(int i=0;i<pmx->dimensions;i++)
 	{
-		int nonzero_entries=0;
+		int j=pmx->cols[i];
 
-		for(int j=0;j<pmx->dimensions;j++)
-			if(pmatrix_get_entry(pmx, i, j)!=0)
-				nonzero_entries++;
+		if((j<0)||(j>=pmx->dimensions))
+			return false;
 
-		if(nonzero_entries!=1)
+		if(pmx->rows[j]!=i)
 			return false;
 	}
 
 	for(int j=0;j<pmx->dimensions;j++)
 	{
-		int nonzero_entries=0;
+		int i=pmx->rows[j];
 
-		for(int i=0;i<pmx->dimensions;i++)
-			if(pmatrix_get_entry(pmx, i, j)!=0)
-				nonzero_entries++;
+		if((i<0)||(i>=pmx->dimensions))
+			return false;
 
-		if(nonzero_entries!=1)
+		if(pmx->cols[i]!=j)
 			return false;
 	}
 
 	for(int i=0;i<pmx->dimensions;i++)
 	{
-		for(int j=0;j<pmx->dimensions;j++)
+		int entry=pmatrix_get_entry(pmx, i, pmx->cols[i]);
+
+		if(pmatrix_entry_type(i,pmx->cols[i])==QTYPE_OCCUPIED)
+		{
+			if(!((entry>0)&&(entry<=pmx->nr_occupied)))
+				return false;
+		}
+		else
 		{
-			int entry;
-
-			if((entry=pmatrix_get_entry(pmx, i, j))!=0)
-			{
-				if(pmatrix_entry_type(i,j)==QTYPE_OCCUPIED)
-				{
-					if(!((entry>0)&&(entry<=pmx->nr_occupied)))
-						return false;
-				}
-				else
-				{
-					if(!((entry>0)&&(entry<=pmx->nr_virtual)))
-						return false;
-				}
-			}
+			if(!((entry>0)&&(entry<=pmx->nr_virtual)))
+				return false;
 		}
 	}
 
@@ -1,19 +1,70 @@
 #ifndef __PMATRIX_H__
 #define __PMATRIX_H__
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <gsl/gsl_rng.h>
 
 #include "loaderis.h"
 #include "limits.h"
 
+/*
+	An undo log, recording the previous contents of each row and column modified while
+	it is attached to a pmatrix_t, so that the changes can be rolled back cheaply.
+*/
+
+#define PMATRIX_UNDO_MAX_RECORDS	(4*PMATRIX_MAX_DIMENSIONS)
+
+#define PMATRIX_UNDO_ROW		(0)
+#define PMATRIX_UNDO_COL		(1)
+
+struct pmatrix_undo_t
+{
+	int dimensions,nr_records;
+
+	uint64_t rank;
+	bool rank_is_valid;
+
+	struct
+	{
+		int8_t type,index,previous;
+		int value;
+	}
+	records[PMATRIX_UNDO_MAX_RECORDS];
+};
+
 struct pmatrix_t
 {
 	/*
-		The dimensions, maximum value and the actual values in the matrix
+		The dimensions and the maximum values
 	*/
 
 	int dimensions,nr_occupied,nr_virtual;
-	int values[PMATRIX_MAX_DIMENSIONS][PMATRIX_MAX_DIMENSIONS];
+
+	/*
+		Every row and every column contain exactly one non-zero entry, so the matrix
+		is stored as a permutation: the non-zero entry of the i-th row lies in
+		column cols[i] and has (raw) value values[i]. The inverse permutation rows[]
+		gives the row of the non-zero entry of each column.
+	*/
+
+	int8_t cols[PMATRIX_MAX_DIMENSIONS],rows[PMATRIX_MAX_DIMENSIONS];
+	int values[PMATRIX_MAX_DIMENSIONS];
+
+	/*
+		The rank of the permutation, i.e. its index in lexicographic order, used for indexing
+		the caches. It is recalculated lazily, only after the arrangement of non-zero entries
+		has changed, so that it is not affected by the updates changing only the values.
+	*/
+
+	uint64_t rank;
+	bool rank_is_valid;
+
+	/*
+		The undo log the changes are being recorded to, if any
+	*/
+
+	struct pmatrix_undo_t *undo;
 };
 
 struct pmatrix_t *init_pmatrix(int nr_occupied,int nr_virtual,gsl_rng *rngctx);
@@ -25,9 +76,16 @@ void pmatrix_set_entry(struct pmatrix_t *pmx, int i, int j, int value);
 int pmatrix_get_raw_entry(struct pmatrix_t *pmx, int i, int j);
 void pmatrix_set_raw_entry(struct pmatrix_t *pmx, int i, int j, int value);
 
+int pmatrix_get_col(struct pmatrix_t *pmx, int i);
+int pmatrix_get_row(struct pmatrix_t *pmx, int j);
+void pmatrix_place_entry(struct pmatrix_t *pmx, int i, int j, int value);
+
+uint64_t pmatrix_get_rank(struct pmatrix_t *pmx);
+
 void pmatrix_print(struct pmatrix_t *pmx);
 
 void pmatrix_extend(struct pmatrix_t *pmx, gsl_rng *rngctx, int *targeti, int *targetj);
+void pmatrix_squeeze_target(struct pmatrix_t *pmx, int *targeti, int *targetj);
 void pmatrix_squeeze(struct pmatrix_t *pmx, gsl_rng *rngctx);
 
 void pmatrix_swap_rows(struct pmatrix_t *pmx, int i1, int i2, gsl_rng *rngctx);
@@ -35,6 +93,10 @@ void pmatrix_swap_cols(struct pmatrix_t *pmx, int i1, int i2, gsl_rng *rngctx);
 
 bool pmatrix_check_consistency(struct pmatrix_t *pmx);
 
+void pmatrix_undo_begin(struct pmatrix_t *pmx, struct pmatrix_undo_t *undo);
+void pmatrix_undo_end(struct pmatrix_t *pmx);
+void pmatrix_undo_rollback(struct pmatrix_t *pmx);
+
 int pmatrix_entry_type(int i,int j);
 int pmatrix_get_new_value(struct pmatrix_t *pmx, gsl_rng *rngctx, int i, int j);
 
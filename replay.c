@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "config.h"
+#include "sampling.h"
+#include "results.h"
+#include "timeseries.h"
+#include "limits.h"
+
+/*
+	Reads the time series written by one or more chains (see timeseries.h) and prints the same
+	report as mpn, calculated again from the samples. The first samples of each chain can be
+	discarded, as a further thermalization, and only one sample every 'decorrelation' can be
+	kept. Optionally, the results of all the chains are also saved, so that they can be merged
+	with other runs by mpn-merge.
+*/
+
+void usage(char *argv0)
+{
+	printf("Usage: %s [-t <samples to discard>] [-d <decorrelation>] [-o <output results file>] <time series> [<time series> ...]\n",argv0);
+
+	exit(0);
+}
+
+int main(int argc,char *argv[])
+{
+	long int discard=0;
+	int decorrelation=1;
+	char *output=NULL;
+	int first=1;
+
+	while(((first+1)<argc)&&(argv[first][0]=='-'))
+	{
+		if(strcmp(argv[first],"-t")==0)
+			discard=atol(argv[first+1]);
+		else if(strcmp(argv[first],"-d")==0)
+			decorrelation=atoi(argv[first+1]);
+		else if(strcmp(argv[first],"-o")==0)
+			output=argv[first+1];
+		else
+			usage(argv[0]);
+
+		first+=2;
+	}
+
+	if((first>=argc)||(discard<0)||(decorrelation<1))
+		usage(argv[0]);
+
+	int nr_chains=argc-first,minorder=-1,maxorder=-1;
+	long int nr_measurements=0;
+
+	struct sampling_summary_t *summaries=malloc(sizeof(struct sampling_summary_t)*nr_chains);
+	struct timeseries_sample_t *samples=malloc(sizeof(struct timeseries_sample_t)*TIMESERIES_BUFFER_SIZE);
+
+	if((!summaries)||(!samples))
+	{
+		fprintf(stderr,"Error: out of memory.\n");
+		return 1;
+	}
+
+	for(int c=0;c<nr_chains;c++)
+	{
+		struct timeseries_header_t header;
+		FILE *in;
+
+		if(!(in=timeseries_open(argv[first+c],&header))||(header.minorder<0)||(header.maxorder>=MAX_ORDER))
+		{
+			fprintf(stderr,"Error: %s is not a valid time series.\n",argv[first+c]);
+			return 1;
+		}
+
+		if((minorder!=-1)&&((minorder!=header.minorder)||(maxorder!=header.maxorder)))
+		{
+			fprintf(stderr,"Error: the orders in %s (%d to %d) do not match the previous files (%d to %d).\n",
+				argv[first+c],header.minorder,header.maxorder,minorder,maxorder);
+			return 1;
+		}
+
+		minorder=header.minorder;
+		maxorder=header.maxorder;
+
+		/*
+			The samples are read in blocks, and fed to the same accumulators used by mpn.
+		*/
+
+		struct sampling_summary_t *summary=&summaries[c];
+		long int index=0;
+		size_t nr_samples;
+
+		memset(summary, 0, sizeof(struct sampling_summary_t));
+		init_chain_results(&summary->results);
+
+		while((nr_samples=fread(samples, sizeof(struct timeseries_sample_t), TIMESERIES_BUFFER_SIZE, in))>0)
+		{
+			for(size_t d=0;d<nr_samples;d++,index++)
+			{
+				if((samples[d].order<minorder)||(samples[d].order>maxorder))
+				{
+					fprintf(stderr,"Error: %s contains an invalid sample (order %d).\n",argv[first+c],samples[d].order);
+					return 1;
+				}
+
+				if((index>=discard)&&(((index-discard)%decorrelation)==0))
+					chain_results_add(&summary->results,samples[d].order,samples[d].sign);
+			}
+		}
+
+		fclose(in);
+
+		summary->nr_samples=summary->nr_physical_samples=index;
+		nr_measurements+=summary->results.nr_measurements;
+
+		printf("# %s: chain #%d, %ld samples (thermalization: %ld, decorrelation: %d)\n",
+			argv[first+c],header.chain,index,(long int)(header.thermalization),header.decorrelation);
+	}
+
+	free(samples);
+
+	printf("# Discarded samples: %ld per chain\n",discard);
+	printf("# Further decorrelation: %d\n",decorrelation);
+	printf("# Measurements: %ld\n",nr_measurements);
+	printf("#\n");
+
+	/*
+		The report only needs the orders from the configuration.
+	*/
+
+	struct configuration_t config;
+
+	load_config_defaults(&config);
+	config.minorder=minorder;
+	config.maxorder=maxorder;
+
+	sampling_summaries_print_report(summaries,nr_chains,&config,stdout);
+
+	if(output!=NULL)
+	{
+		const struct chain_results_t **pointers=malloc(sizeof(struct chain_results_t *)*nr_chains);
+
+		for(int c=0;c<nr_chains;c++)
+			pointers[c]=&summaries[c].results;
+
+		if(save_results(output,pointers,nr_chains,minorder,maxorder)==false)
+		{
+			fprintf(stderr,"Error: couldn't write %s.\n",output);
+			free(pointers);
+			free(summaries);
+			return 1;
+		}
+
+		printf("# All the chains have been saved to %s\n",output);
+		free(pointers);
+	}
+
+	free(summaries);
+	free(config.prefix);
+
+	return 0;
+}
@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "results.h"
+
+void init_chain_results(struct chain_results_t *results)
+{
+	memset(results, 0, sizeof(struct chain_results_t));
+
+	results->bin_size=1;
+}
+
+void chain_results_add(struct chain_results_t *results, int order, double sign)
+{
+	assert((order>=0)&&(order<MAX_ORDER));
+
+	/*
+		The sample goes into the current bin, the one following the complete ones.
+	*/
+
+	results->nr_measurements++;
+
+	if(sign>=0.0f)
+	{
+		results->nr_positive[order]++;
+		results->positive[results->nr_bins][order]++;
+	}
+	else
+	{
+		results->nr_negative[order]++;
+		results->negative[results->nr_bins][order]++;
+	}
+
+	if(++results->current_fill<results->bin_size)
+		return;
+
+	results->nr_bins++;
+	results->current_fill=0;
+
+	/*
+		If there is no more room we merge the bins pairwise, so that the next ones will be twice as large.
+	*/
+
+	if(results->nr_bins==RESULTS_NR_BINS)
+	{
+		for(int c=0;c<RESULTS_NR_BINS/2;c++)
+		{
+			for(int d=0;d<MAX_ORDER;d++)
+			{
+				results->positive[c][d]=results->positive[2*c][d]+results->positive[2*c+1][d];
+				results->negative[c][d]=results->negative[2*c][d]+results->negative[2*c+1][d];
+			}
+		}
+
+		memset(results->positive[RESULTS_NR_BINS/2], 0, sizeof(int64_t)*MAX_ORDER*RESULTS_NR_BINS/2);
+		memset(results->negative[RESULTS_NR_BINS/2], 0, sizeof(int64_t)*MAX_ORDER*RESULTS_NR_BINS/2);
+
+		results->nr_bins=RESULTS_NR_BINS/2;
+		results->bin_size*=2;
+	}
+}
+
+/*
+	As for the cache files, the file is first written under a temporary name and then renamed.
+*/
+
+bool save_results(const char *filename, const struct chain_results_t **results, int nr_chains, int minorder, int maxorder)
+{
+	struct results_header_t header;
+
+	memset(&header, 0, sizeof(struct results_header_t));
+	memcpy(header.magic, RESULTS_FILE_MAGIC, 8);
+	header.version=RESULTS_FILE_VERSION;
+	header.minorder=minorder;
+	header.maxorder=maxorder;
+	header.nr_chains=nr_chains;
+	header.max_order=MAX_ORDER;
+	header.nr_bins=RESULTS_NR_BINS;
+
+	char tmpfilename[1024];
+
+	snprintf(tmpfilename,1024,"%s.%d.tmp",filename,(int)(getpid()));
+	tmpfilename[1023]='\0';
+
+	FILE *f;
+
+	if(!(f=fopen(tmpfilename,"w+")))
+		return false;
+
+	bool success=(fwrite(&header, sizeof(struct results_header_t), 1, f)==1);
+
+	for(int c=0;c<nr_chains;c++)
+		success&=(fwrite(results[c], sizeof(struct chain_results_t), 1, f)==1);
+
+	if((fclose(f)!=0)||(success==false)||(rename(tmpfilename,filename)!=0))
+	{
+		remove(tmpfilename);
+		return false;
+	}
+
+	return true;
+}
+
+struct chain_results_t *load_results(const char *filename, int *nr_chains, int *minorder, int *maxorder)
+{
+	struct results_header_t header;
+	FILE *in;
+
+	if(!(in=fopen(filename,"r")))
+		return NULL;
+
+	if((fread(&header, sizeof(struct results_header_t), 1, in)!=1)||
+	   (memcmp(header.magic, RESULTS_FILE_MAGIC, 8)!=0)||(header.version!=RESULTS_FILE_VERSION)||
+	   (header.max_order!=MAX_ORDER)||(header.nr_bins!=RESULTS_NR_BINS)||(header.nr_chains<1)||
+	   (header.minorder<0)||(header.minorder>header.maxorder)||(header.maxorder>=MAX_ORDER))
+	{
+		fclose(in);
+		return NULL;
+	}
+
+	struct chain_results_t *ret=malloc(sizeof(struct chain_results_t)*header.nr_chains);
+	assert(ret!=NULL);
+
+	if(fread(ret, sizeof(struct chain_results_t), header.nr_chains, in)!=(size_t)(header.nr_chains))
+	{
+		free(ret);
+		fclose(in);
+		return NULL;
+	}
+
+	/*
+		The bins are also checked, since they are used as indices.
+	*/
+
+	for(int c=0;c<header.nr_chains;c++)
+	{
+		if((ret[c].bin_size<1)||(ret[c].nr_bins<0)||(ret[c].nr_bins>=RESULTS_NR_BINS)||
+		   (ret[c].current_fill<0)||(ret[c].current_fill>=ret[c].bin_size))
+		{
+			free(ret);
+			fclose(in);
+			return NULL;
+		}
+	}
+
+	fclose(in);
+
+	*nr_chains=header.nr_chains;
+	*minorder=header.minorder;
+	*maxorder=header.maxorder;
+
+	return ret;
+}
+
+/*
+	Every observable is a linear combination of the positive and negative samples at a given order.
+*/
+
+static void observable_coefficients(int observable, double *cpositive, double *cnegative)
+{
+	switch(observable)
+	{
+		case RESULTS_POSITIVE:
+		*cpositive=1.0f;
+		*cnegative=0.0f;
+		break;
+
+		case RESULTS_NEGATIVE:
+		*cpositive=0.0f;
+		*cnegative=1.0f;
+		break;
+
+		case RESULTS_FRACTION:
+		*cpositive=1.0f;
+		*cnegative=1.0f;
+		break;
+
+		case RESULTS_CONTRIBUTION:
+		*cpositive=1.0f;
+		*cnegative=-1.0f;
+		break;
+
+		default:
+		assert(false);
+		*cpositive=*cnegative=0.0f;
+	}
+}
+
+static double chain_results_sum(struct chain_results_t *results, int observable, int order)
+{
+	double cpositive,cnegative;
+
+	observable_coefficients(observable, &cpositive, &cnegative);
+
+	return cpositive*results->nr_positive[order]+cnegative*results->nr_negative[order];
+}
+
+static double chain_results_bin(struct chain_results_t *results, int bin, int observable, int order)
+{
+	double cpositive,cnegative;
+
+	observable_coefficients(observable, &cpositive, &cnegative);
+
+	return cpositive*results->positive[bin][order]+cnegative*results->negative[bin][order];
+}
+
+double results_observable_mean(struct chain_results_t *results, int nr_chains, int observable, int order)
+{
+	double total,sum;
+
+	total=sum=0.0f;
+	for(int c=0;c<nr_chains;c++)
+	{
+		total+=results[c].nr_measurements;
+		sum+=chain_results_sum(&results[c], observable, order);
+	}
+
+	return (total>0.0f)?(sum/total):(0.0f);
+}
+
+/*
+	The covariance of the means of two observables, for a single chain, as estimated from the
+	bin averages. If there are not enough bins, the measurements are assumed to be uncorrelated:
+	note that a measurement contributes to a single order only.
+*/
+
+static double chain_results_covariance(struct chain_results_t *results, int observable1, int order1, int observable2, int order2)
+{
+	int64_t nr_bins=results->nr_bins;
+
+	if(nr_bins>=2)
+	{
+		double mean1,mean2,covariance;
+
+		mean1=mean2=0.0f;
+		for(int c=0;c<nr_bins;c++)
+		{
+			mean1+=chain_results_bin(results, c, observable1, order1);
+			mean2+=chain_results_bin(results, c, observable2, order2);
+		}
+
+		mean1/=nr_bins;
+		mean2/=nr_bins;
+
+		covariance=0.0f;
+		for(int c=0;c<nr_bins;c++)
+			covariance+=(chain_results_bin(results, c, observable1, order1)-mean1)*
+			            (chain_results_bin(results, c, observable2, order2)-mean2);
+
+		return covariance/(nr_bins*(nr_bins-1))/(results->bin_size*results->bin_size);
+	}
+
+	double n=results->nr_measurements;
+
+	if(n<2)
+		return 0.0f;
+
+	double cpositive1,cnegative1,cpositive2,cnegative2;
+
+	observable_coefficients(observable1, &cpositive1, &cnegative1);
+	observable_coefficients(observable2, &cpositive2, &cnegative2);
+
+	double mean1=chain_results_sum(results, observable1, order1)/n;
+	double mean2=chain_results_sum(results, observable2, order2)/n;
+	double mean12=0.0f;
+
+	if(order1==order2)
+		mean12=(cpositive1*cpositive2*results->nr_positive[order1]+cnegative1*cnegative2*results->nr_negative[order1])/n;
+
+	return (mean12-mean1*mean2)/(n-1);
+}
+
+double results_observable_covariance(struct chain_results_t *results, int nr_chains, int observable1, int order1, int observable2, int order2)
+{
+	double total,covariance;
+
+	total=covariance=0.0f;
+	for(int c=0;c<nr_chains;c++)
+	{
+		double n=results[c].nr_measurements;
+
+		total+=n;
+		covariance+=n*n*chain_results_covariance(&results[c], observable1, order1, observable2, order2);
+	}
+
+	return (total>0.0f)?(covariance/(total*total)):(0.0f);
+}
+
+double results_mean(struct chain_results_t *results, int nr_chains, int order)
+{
+	return results_observable_mean(results, nr_chains, RESULTS_CONTRIBUTION, order);
+}
+
+double results_covariance(struct chain_results_t *results, int nr_chains, int order1, int order2)
+{
+	return results_observable_covariance(results, nr_chains, RESULTS_CONTRIBUTION, order1, RESULTS_CONTRIBUTION, order2);
+}
+
+/*
+	The variance of the mean as estimated from the bins is compared with the one expected
+	for the same number of uncorrelated samples.
+*/
+
+double chain_results_tau(struct chain_results_t *results, int order)
+{
+	double n=results->nr_measurements;
+
+	if((results->nr_bins<2)||(n<2))
+		return 0.0f;
+
+	double mean=chain_results_sum(results, RESULTS_CONTRIBUTION, order)/n;
+	double variance=chain_results_sum(results, RESULTS_FRACTION, order)/n-mean*mean;
+
+	if(variance<=0.0f)
+		return 0.0f;
+
+	double binned=chain_results_covariance(results, RESULTS_CONTRIBUTION, order, RESULTS_CONTRIBUTION, order);
+
+	return 0.5f*(binned*results->nr_bins*results->bin_size/variance-1.0f);
+}
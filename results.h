@@ -0,0 +1,91 @@
+#ifndef __RESULTS_H__
+#define __RESULTS_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "limits.h"
+
+/*
+	The machine-readable results of a single Markov chain, which are also the accumulators filled
+	during the sampling: for each order, the number of positive and negative samples, and the same
+	numbers collected in bins, so that the errors can be estimated taking the autocorrelation into
+	account, and the results of independent runs can be merged later on by mpn-merge.
+
+	The memory is fixed and a measurement costs O(1): the samples are collected in a fixed number
+	of bins, when all of them are full pairs of neighbouring bins are merged and the bin size is
+	doubled.
+*/
+
+#define RESULTS_NR_BINS		(128)
+
+struct chain_results_t
+{
+	int64_t nr_measurements;
+	int64_t nr_positive[MAX_ORDER],nr_negative[MAX_ORDER];
+
+	/*
+		The positive and negative samples in each bin: there are nr_bins complete bins,
+		followed by the current one, which contains current_fill samples so far.
+	*/
+
+	int64_t bin_size,nr_bins,current_fill;
+	int64_t positive[RESULTS_NR_BINS][MAX_ORDER],negative[RESULTS_NR_BINS][MAX_ORDER];
+};
+
+void init_chain_results(struct chain_results_t *results);
+void chain_results_add(struct chain_results_t *results, int order, double sign);
+
+/*
+	The results file: this header, followed by nr_chains chain_results_t structs,
+	in the native byte order.
+*/
+
+#define RESULTS_FILE_MAGIC	"MPNRSLTS"
+#define RESULTS_FILE_VERSION	(2)
+
+struct results_header_t
+{
+	char magic[8];
+	uint32_t version;
+	int32_t minorder,maxorder,nr_chains;
+	int32_t max_order,nr_bins;
+};
+
+bool save_results(const char *filename, const struct chain_results_t **results, int nr_chains, int minorder, int maxorder);
+struct chain_results_t *load_results(const char *filename, int *nr_chains, int *minorder, int *maxorder);
+
+/*
+	The observables that can be estimated at each order: the fraction of positive samples, of negative
+	samples, of all samples and the contribution, i.e. the difference between positive and negative
+	samples. A sign of course is +1 or -1: it contributes to a single order.
+*/
+
+enum results_observable_t
+{
+	RESULTS_POSITIVE=0,
+	RESULTS_NEGATIVE,
+	RESULTS_FRACTION,
+	RESULTS_CONTRIBUTION
+};
+
+/*
+	Statistics over many independent chains: each chain is weighted with the number of its
+	measurements, and the errors are estimated from the bins of each chain.
+*/
+
+double results_observable_mean(struct chain_results_t *results, int nr_chains, int observable, int order);
+double results_observable_covariance(struct chain_results_t *results, int nr_chains, int observable1, int order1, int observable2, int order2);
+
+double results_mean(struct chain_results_t *results, int nr_chains, int order);
+double results_covariance(struct chain_results_t *results, int nr_chains, int order1, int order2);
+
+/*
+	The integrated autocorrelation time of the contribution at a given order, in units of
+	measurements, as estimated from the bins of a chain: it is zero for uncorrelated samples.
+*/
+
+double chain_results_tau(struct chain_results_t *results, int order);
+
+#endif //__RESULTS_H__
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <assert.h>
 
@@ -6,64 +7,105 @@
 #include "cache.h"
 #include "rfactors.h"
 
-/*
-        This is not thread safe!
-*/
+struct rfactors_ctx_t *init_rfactors_ctx(void)
+{
+	struct rfactors_ctx_t *ret=malloc(sizeof(struct rfactors_ctx_t));
+
+	assert(ret!=NULL);
 
-long int rfactor4global[2];
-long int rfactors4[576][2];
+	ret->rfactor4global[0]=ret->rfactor4global[1]=0;
+
+	for(int c=0;c<576;c++)
+		ret->rfactors4[c][0]=ret->rfactors4[c][1]=0;
+
+	return ret;
+}
 
-void rfactors_init(void)
+void fini_rfactors_ctx(struct rfactors_ctx_t *rctx)
 {
+	if(rctx)
+		free(rctx);
 }
 
-void rfactors_sample_sign(struct amatrix_t *amx, int sign)
+void rfactors_sample_sign(struct rfactors_ctx_t *rctx, struct amatrix_t *amx, int sign)
 {
 	assert((sign==1)||(sign==-1));
 
 	if(amx->pmxs[0]->dimensions!=4)
 		return;
 
-	int index=amatrix_to_index(amx);
+	uint64_t index=amatrix_to_index(amx);
 
 	if(sign==1)
 	{
-		rfactor4global[0]++;
-		rfactors4[index][0]++;
+		rctx->rfactor4global[0]++;
+		rctx->rfactors4[index][0]++;
 	}
 	else
 	{
-		rfactor4global[1]++;
-		rfactors4[index][1]++;
+		rctx->rfactor4global[1]++;
+		rctx->rfactors4[index][1]++;
 	}
 }
 
-void rfactors_output_summary(const char *filename)
+/*
+	The statistics collected by different chains are simply added up.
+*/
+
+void rfactors_merge(struct rfactors_ctx_t *target, struct rfactors_ctx_t *source)
+{
+	target->rfactor4global[0]+=source->rfactor4global[0];
+	target->rfactor4global[1]+=source->rfactor4global[1];
+
+	for(int c=0;c<576;c++)
+	{
+		target->rfactors4[c][0]+=source->rfactors4[c][0];
+		target->rfactors4[c][1]+=source->rfactors4[c][1];
+	}
+}
+
+/*
+	The counters are saved to (and restored from) a checkpoint as they are.
+*/
+
+bool rfactors_save_state(struct rfactors_ctx_t *rctx, FILE *out)
+{
+	return fwrite(rctx, sizeof(struct rfactors_ctx_t), 1, out)==1;
+}
+
+bool rfactors_load_state(struct rfactors_ctx_t *rctx, FILE *in)
+{
+	return fread(rctx, sizeof(struct rfactors_ctx_t), 1, in)==1;
+}
+
+void rfactors_output_summary(struct rfactors_ctx_t *rctx, const char *filename)
 {
 	FILE *out=fopen(filename,"w+");
 
+	if(!out)
+		return;
+
 	{
 		double num,den;
 
-		num=labs(rfactor4global[0]-rfactor4global[1]);
-		den=rfactor4global[0]+rfactor4global[1];
+		num=labs(rctx->rfactor4global[0]-rctx->rfactor4global[1]);
+		den=rctx->rfactor4global[0]+rctx->rfactor4global[1];
 
 		fprintf(out,"# GLOBAL: %f\n",num/den);
 	}
 
 	for(int c=0;c<576;c++)
 	{
-		if((rfactors4[c][0]+rfactors4[c][1])==0)
+		if((rctx->rfactors4[c][0]+rctx->rfactors4[c][1])==0)
 			continue;
 
 		double num,den;
 
-		num=labs(rfactors4[c][0]-rfactors4[c][1]);
-		den=rfactors4[c][0]+rfactors4[c][1];
+		num=labs(rctx->rfactors4[c][0]-rctx->rfactors4[c][1]);
+		den=rctx->rfactors4[c][0]+rctx->rfactors4[c][1];
 
-		fprintf(out,"%d %f # %s\n",c,num/den,(rfactors4[c][0]>rfactors4[c][1])?("positive"):("negative"));
+		fprintf(out,"%d %f # %s\n",c,num/den,(rctx->rfactors4[c][0]>rctx->rfactors4[c][1])?("positive"):("negative"));
 	}
 
-	if(out)
-		fclose(out);
+	fclose(out);
 }
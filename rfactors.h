@@ -1,10 +1,28 @@
 #ifndef __RFACTORS_H__
 #define __RFACTORS_H__
 
+#include <stdio.h>
+#include <stdbool.h>
+
 #include "amatrix.h"
 
-void rfactors_init(void);
-void rfactors_sample_sign(struct amatrix_t *amx, int sign);
-void rfactors_output_summary(const char *filename);
+/*
+	Sign statistics for each order 4 topology, every chain keeps its own copy.
+*/
+
+struct rfactors_ctx_t
+{
+	long int rfactor4global[2];
+	long int rfactors4[576][2];
+};
+
+struct rfactors_ctx_t *init_rfactors_ctx(void);
+void fini_rfactors_ctx(struct rfactors_ctx_t *rctx);
+
+void rfactors_sample_sign(struct rfactors_ctx_t *rctx, struct amatrix_t *amx, int sign);
+void rfactors_merge(struct rfactors_ctx_t *target, struct rfactors_ctx_t *source);
+bool rfactors_save_state(struct rfactors_ctx_t *rctx, FILE *out);
+bool rfactors_load_state(struct rfactors_ctx_t *rctx, FILE *in);
+void rfactors_output_summary(struct rfactors_ctx_t *rctx, const char *filename);
 
 #endif //__RFACTORS_H__
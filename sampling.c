@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <gsl/gsl_math.h>
+
+#include "amatrix.h"
+#include "weight.h"
+#include "weight2.h"
+#include "cache.h"
+#include "sampling.h"
+#include "results.h"
+#include "timeseries.h"
+#include "auxx.h"
+#include "limits.h"
+
+int gsl_matrix_int_compare(gsl_matrix_int *a,const gsl_matrix_int *b)
+{
+	if(a->size1>b->size1)
+		return 1;
+	else if(a->size1<b->size1)
+		return -1;
+
+	if(a->size2>b->size2)
+		return 1;
+	else if(a->size2<b->size2)
+		return -1;
+
+	for(size_t i=0;i<a->size1;i++)
+	{
+		for(size_t j=0;j<a->size2;j++)
+		{
+			if(gsl_matrix_int_get(a,i,j)>gsl_matrix_int_get(b,i,j))
+				return 1;
+			else if(gsl_matrix_int_get(a,i,j)<gsl_matrix_int_get(b,i,j))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+	All the measurements are collected in a chain_results_t, which has a fixed size and is
+	updated in O(1) for each sample: the errors are estimated from its bins at the end.
+	Optionally, the samples are also streamed to a file, see timeseries.h
+*/
+
+struct sampling_ctx_t
+{
+	long int nr_samples, nr_physical_samples;
+
+	int maxdimensions;
+
+	struct chain_results_t results;
+	struct timeseries_ctx_t *timeseries;
+};
+
+struct sampling_ctx_t *init_sampling_ctx(int maxdimensions)
+{
+	struct sampling_ctx_t *ret=malloc(sizeof(struct sampling_ctx_t));
+
+	assert(ret!=NULL);
+
+	ret->maxdimensions=maxdimensions;
+	ret->nr_samples=ret->nr_physical_samples=0;
+
+	init_chain_results(&ret->results);
+	ret->timeseries=NULL;
+
+	return ret;
+}
+
+void fini_sampling_ctx(struct sampling_ctx_t *sctx)
+{
+	if(sctx)
+	{
+		if(fini_timeseries_ctx(sctx->timeseries)==false)
+			fprintf(stderr,"Warning: couldn't write the time series of the samples.\n");
+
+		free(sctx);
+	}
+}
+
+/*
+	The samples measured from now on are also written to a file. When resuming, the samples
+	in the file are the ones measured before the checkpoint, the following ones are appended.
+*/
+
+bool sampling_ctx_start_timeseries(struct sampling_ctx_t *sctx,const char *filename,int chain,struct configuration_t *config,bool resume)
+{
+	struct timeseries_header_t header;
+
+	memset(&header, 0, sizeof(struct timeseries_header_t));
+	memcpy(header.magic, TIMESERIES_FILE_MAGIC, 8);
+	header.version=TIMESERIES_FILE_VERSION;
+	header.chain=chain;
+	header.minorder=config->minorder;
+	header.maxorder=config->maxorder;
+	header.decorrelation=config->decorrelation;
+	header.sample_size=sizeof(struct timeseries_sample_t);
+	header.thermalization=config->thermalization;
+
+	sctx->timeseries=init_timeseries_ctx(filename,&header,resume,sctx->results.nr_measurements);
+
+	return sctx->timeseries!=NULL;
+}
+
+void sampling_ctx_measure(struct sampling_ctx_t *sctx,struct amatrix_t *amx,struct configuration_t *config,long int counter)
+{
+	sctx->nr_samples++;
+
+	if(amatrix_is_physical(amx))
+	{
+		sctx->nr_physical_samples++;
+
+		if((counter>config->thermalization)&&((sctx->nr_physical_samples%config->decorrelation)==0))
+		{
+			double weight=amatrix_weight(amx);
+			double sign=(weight>=0.0f) ? (1.0f) : (-1.0f);
+
+			int order=amx->pmxs[0]->dimensions;
+
+			chain_results_add(&sctx->results,order,sign);
+
+			if(sctx->timeseries!=NULL)
+			{
+				uint64_t topology=(order<=CACHE_MAX_DIMENSIONS)?(amatrix_to_index(amx)):(TIMESERIES_NO_TOPOLOGY);
+
+				timeseries_add(sctx->timeseries,order,(int)(sign),log(fabs(weight)),topology);
+			}
+		}
+	}
+}
+
+/*
+	The counters are saved together with the accumulators, so that the sampling can continue
+	exactly from where it stopped. The time series, if any, has to contain all the samples
+	counted in the checkpoint.
+*/
+
+struct sampling_counters_t
+{
+	long int nr_samples, nr_physical_samples;
+	int maxdimensions;
+};
+
+bool sampling_ctx_save_state(struct sampling_ctx_t *sctx,FILE *out)
+{
+	struct sampling_counters_t counters;
+
+	if((sctx->timeseries!=NULL)&&(timeseries_flush(sctx->timeseries)==false))
+		return false;
+
+	memset(&counters, 0, sizeof(struct sampling_counters_t));
+	counters.nr_samples=sctx->nr_samples;
+	counters.nr_physical_samples=sctx->nr_physical_samples;
+	counters.maxdimensions=sctx->maxdimensions;
+
+	return (fwrite(&counters, sizeof(struct sampling_counters_t), 1, out)==1)&&
+	       (fwrite(&sctx->results, sizeof(struct chain_results_t), 1, out)==1);
+}
+
+bool sampling_ctx_load_state(struct sampling_ctx_t *sctx,FILE *in)
+{
+	struct sampling_counters_t counters;
+
+	if((fread(&counters, sizeof(struct sampling_counters_t), 1, in)!=1)||(counters.maxdimensions!=sctx->maxdimensions))
+		return false;
+
+	if(fread(&sctx->results, sizeof(struct chain_results_t), 1, in)!=1)
+		return false;
+
+	sctx->nr_samples=counters.nr_samples;
+	sctx->nr_physical_samples=counters.nr_physical_samples;
+
+	return true;
+}
+
+void sampling_ctx_summarize(struct sampling_ctx_t *sctx,struct sampling_summary_t *summary)
+{
+	summary->nr_samples=sctx->nr_samples;
+	summary->nr_physical_samples=sctx->nr_physical_samples;
+	summary->results=sctx->results;
+}
+
+double sampling_ctx_get_physical_pct(struct sampling_ctx_t *sctx)
+{
+	return sampling_ctx_get_merged_physical_pct(&sctx,1);
+}
+
+double sampling_ctx_get_merged_physical_pct(struct sampling_ctx_t **sctxs,int nr_sctxs)
+{
+	long int nr_samples,nr_physical_samples;
+
+	nr_samples=nr_physical_samples=0;
+	for(int c=0;c<nr_sctxs;c++)
+	{
+		nr_samples+=sctxs[c]->nr_samples;
+		nr_physical_samples+=sctxs[c]->nr_physical_samples;
+	}
+
+	return 100.0f*((double)(nr_physical_samples))/((double)(nr_samples));
+}
+
+double sampling_summaries_get_physical_pct(struct sampling_summary_t *summaries,int nr_summaries)
+{
+	long int nr_samples,nr_physical_samples;
+
+	nr_samples=nr_physical_samples=0;
+	for(int c=0;c<nr_summaries;c++)
+	{
+		nr_samples+=summaries[c].nr_samples;
+		nr_physical_samples+=summaries[c].nr_physical_samples;
+	}
+
+	return 100.0f*((double)(nr_physical_samples))/((double)(nr_samples));
+}
+
+void sampling_ctx_print_report(struct sampling_ctx_t *sctx,struct configuration_t *config,FILE *out)
+{
+	sampling_ctx_print_merged_report(&sctx,1,config,out);
+}
+
+void sampling_ctx_print_merged_report(struct sampling_ctx_t **sctxs,int nr_sctxs,struct configuration_t *config,FILE *out)
+{
+	struct sampling_summary_t *summaries=malloc(sizeof(struct sampling_summary_t)*nr_sctxs);
+
+	assert(summaries!=NULL);
+
+	for(int d=0;d<nr_sctxs;d++)
+		sampling_ctx_summarize(sctxs[d],&summaries[d]);
+
+	sampling_summaries_print_report(summaries,nr_sctxs,config,out);
+
+	free(summaries);
+}
+
+void sampling_summaries_print_report(struct sampling_summary_t *summaries,int nr_summaries,struct configuration_t *config,FILE *out)
+{
+	int minorder=config->minorder;
+	int maxorder=config->maxorder;
+
+	/*
+		Results coming from independent chains are combined by weighting each one with the
+		number of samples it comes from, see results_observable_mean() and the following ones.
+	*/
+
+	struct chain_results_t *results=malloc(sizeof(struct chain_results_t)*nr_summaries);
+
+	assert(results!=NULL);
+
+	for(int d=0;d<nr_summaries;d++)
+		results[d]=summaries[d].results;
+
+	fprintf(out,"# <Order> <Positive physical samples> <Negative physical samples> <Percentage> <Sign> <Positive fraction> <Negative fraction> <Sign (with error)>\n");
+
+	long int total_positive, total_negative;
+
+	total_positive=total_negative=0;
+	for(int order=minorder;order<=maxorder;order++)
+	{
+		for(int d=0;d<nr_summaries;d++)
+		{
+			total_positive+=results[d].nr_positive[order];
+			total_negative+=results[d].nr_negative[order];
+		}
+	}
+
+	for(int order=minorder;order<=maxorder;order++)
+	{
+		long int nr_positive_samples, nr_negative_samples;
+
+		nr_positive_samples=nr_negative_samples=0;
+		for(int d=0;d<nr_summaries;d++)
+		{
+			nr_positive_samples+=results[d].nr_positive[order];
+			nr_negative_samples+=results[d].nr_negative[order];
+		}
+
+		double pct, sign;
+
+		if((total_positive-total_negative)!=0)
+			pct=100.0f*((double)(nr_positive_samples-nr_negative_samples))/
+				(total_positive-total_negative);
+		else
+			pct=NAN;
+
+		if((nr_positive_samples+nr_negative_samples)!=0)
+			sign=((double)(nr_positive_samples-nr_negative_samples))/
+				((double)(nr_positive_samples+nr_negative_samples));
+		else
+			sign=NAN;
+
+		fprintf(out, "%d %ld %ld %f %f ", order, nr_positive_samples, nr_negative_samples, pct, sign);
+
+		double plus, sigmaplus, minus, sigmaminus;
+
+		plus=results_observable_mean(results, nr_summaries, RESULTS_POSITIVE, order);
+		minus=results_observable_mean(results, nr_summaries, RESULTS_NEGATIVE, order);
+		sigmaplus=sqrt(results_observable_covariance(results, nr_summaries, RESULTS_POSITIVE, order, RESULTS_POSITIVE, order));
+		sigmaminus=sqrt(results_observable_covariance(results, nr_summaries, RESULTS_NEGATIVE, order, RESULTS_NEGATIVE, order));
+
+		/*
+			The sign at a given order is the ratio between the contribution and the
+			fraction of samples at that order, its error follows from the error propagation formula.
+		*/
+
+		double f, varphi, varf, covphif, sigmasign;
+
+		f=results_observable_mean(results, nr_summaries, RESULTS_FRACTION, order);
+		varphi=results_observable_covariance(results, nr_summaries, RESULTS_CONTRIBUTION, order, RESULTS_CONTRIBUTION, order);
+		varf=results_observable_covariance(results, nr_summaries, RESULTS_FRACTION, order, RESULTS_FRACTION, order);
+		covphif=results_observable_covariance(results, nr_summaries, RESULTS_CONTRIBUTION, order, RESULTS_FRACTION, order);
+
+		sigmasign=sqrt(fabs(varphi-2.0f*sign*covphif+sign*sign*varf))/f;
+
+		fprintf(out, "%f+-%f %f+-%f ", plus, sigmaplus, minus, sigmaminus);
+		fprintf(out, "%f+-%f\n", sign, sigmasign);
+	}
+
+	/*
+		The overall sign is the sum of the contributions at all orders.
+	*/
+
+	double overall_sign, variance;
+
+	overall_sign=variance=0.0f;
+	for(int order1=minorder;order1<=maxorder;order1++)
+	{
+		overall_sign+=results_mean(results, nr_summaries, order1);
+
+		for(int order2=minorder;order2<=maxorder;order2++)
+			variance+=results_covariance(results, nr_summaries, order1, order2);
+	}
+
+	fprintf(out, "# Overall sign: %f +- %f\n", overall_sign, sqrt(fabs(variance)));
+	fprintf(out, "# Order-by-order ratios:\n");
+
+	for(int order1=minorder;order1<=maxorder;order1++)
+	{
+		for(int order2=minorder;order2<=maxorder;order2++)
+		{
+			if(order1==order2)
+				continue;
+
+			/*
+				We calculate the contributions at each order, their covariance, and then
+				the ratio and its error using the usual error propagation formula. The
+				contributions at different orders are anticorrelated, since every measurement
+				contributes to a single order.
+			*/
+
+			double phi1, phi2, var1, var2, cov12;
+
+			phi1=results_mean(results, nr_summaries, order1);
+			phi2=results_mean(results, nr_summaries, order2);
+			var1=results_covariance(results, nr_summaries, order1, order1);
+			var2=results_covariance(results, nr_summaries, order2, order2);
+			cov12=results_covariance(results, nr_summaries, order1, order2);
+
+			char desc1[128], desc2[128];
+
+			order_description(desc1, 128, order1);
+			order_description(desc2, 128, order2);
+
+			double ratio, sigmaratio;
+
+			ratio=phi1/phi2;
+			sigmaratio=fabs(ratio)*sqrt(fabs(var1/(phi1*phi1)+var2/(phi2*phi2)-2.0f*cov12/(phi1*phi2)));
+
+			fprintf(out, "%s/%s %f +- %f (%f%%)\n", desc1, desc2, ratio, sigmaratio,
+				100.0f*sigmaratio/fabs(ratio));
+		}
+	}
+
+	/*
+		The autocorrelation time is a property of a single chain: we take the largest one
+		over the orders, and report the average over chains.
+	*/
+
+	double tau=0.0f;
+
+	for(int d=0;d<nr_summaries;d++)
+	{
+		double chaintau=0.0f;
+
+		for(int order=minorder;order<=maxorder;order++)
+			chaintau=fmax(chaintau, chain_results_tau(&results[d], order));
+
+		tau+=chaintau;
+	}
+
+	fprintf(out,"# Measured autocorrelation time = %f\n",tau/nr_summaries);
+	fflush(out);
+
+	free(results);
+}
@@ -6,6 +6,8 @@
 
 #include "amatrix.h"
 #include "config.h"
+#include "limits.h"
+#include "results.h"
 
 struct sampling_ctx_t;
 
@@ -14,9 +16,29 @@ void fini_sampling_ctx(struct sampling_ctx_t *sctx);
 
 void sampling_ctx_measure(struct sampling_ctx_t *sctx,struct amatrix_t *amx,struct configuration_t *config,long int counter);
 double sampling_ctx_get_physical_pct(struct sampling_ctx_t *sctx);
-void sampling_ctx_print_report(struct sampling_ctx_t *sctx,struct amatrix_t *amx,FILE *out,bool finalize);
+void sampling_ctx_print_report(struct sampling_ctx_t *sctx,struct configuration_t *config,FILE *out);
 
-void rfactors_sample_sign(struct amatrix_t *amx, int sign);
-void rfactors_output_summary(const char *filename);
+bool sampling_ctx_start_timeseries(struct sampling_ctx_t *sctx,const char *filename,int chain,struct configuration_t *config,bool resume);
+
+bool sampling_ctx_save_state(struct sampling_ctx_t *sctx,FILE *out);
+bool sampling_ctx_load_state(struct sampling_ctx_t *sctx,FILE *in);
+
+double sampling_ctx_get_merged_physical_pct(struct sampling_ctx_t **sctxs,int nr_sctxs);
+void sampling_ctx_print_merged_report(struct sampling_ctx_t **sctxs,int nr_sctxs,struct configuration_t *config,FILE *out);
+
+/*
+	A plain summary of the accumulators of a chain, which can be copied around (e.g. between
+	MPI processes) and merged with the summaries of other chains to print the report.
+*/
+
+struct sampling_summary_t
+{
+	long int nr_samples,nr_physical_samples;
+	struct chain_results_t results;
+};
+
+void sampling_ctx_summarize(struct sampling_ctx_t *sctx,struct sampling_summary_t *summary);
+double sampling_summaries_get_physical_pct(struct sampling_summary_t *summaries,int nr_summaries);
+void sampling_summaries_print_report(struct sampling_summary_t *summaries,int nr_summaries,struct configuration_t *config,FILE *out);
 
 #endif //__SAMPLING_H__
@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "timeseries.h"
+
+struct timeseries_ctx_t
+{
+	FILE *out;
+
+	/*
+		The buffers are used in a circular way: nr_queued buffers, starting from the first one,
+		are waiting to be written, and the following one is being filled by the chain.
+	*/
+
+	struct timeseries_sample_t *buffers[TIMESERIES_NR_BUFFERS];
+	int sizes[TIMESERIES_NR_BUFFERS];
+	int first,nr_queued;
+
+	/*
+		Only the chain accesses the buffer being filled, everything else is protected by the mutex.
+	*/
+
+	int current_buffer,current_fill;
+
+	pthread_t writer;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool stop,failed;
+};
+
+static void *timeseries_writer(void *data)
+{
+	struct timeseries_ctx_t *tctx=(struct timeseries_ctx_t *)(data);
+
+	pthread_mutex_lock(&tctx->mutex);
+
+	while(true)
+	{
+		while((tctx->nr_queued==0)&&(tctx->stop==false))
+			pthread_cond_wait(&tctx->cond,&tctx->mutex);
+
+		if(tctx->nr_queued==0)
+			break;
+
+		int buffer=tctx->first;
+		int size=tctx->sizes[buffer];
+
+		/*
+			The buffer is not touched by the chain until it is released, so it can be
+			written without holding the mutex.
+		*/
+
+		pthread_mutex_unlock(&tctx->mutex);
+
+		bool success=(fwrite(tctx->buffers[buffer], sizeof(struct timeseries_sample_t), size, tctx->out)==(size_t)(size));
+
+		pthread_mutex_lock(&tctx->mutex);
+
+		if(success==false)
+			tctx->failed=true;
+
+		tctx->first=(tctx->first+1)%TIMESERIES_NR_BUFFERS;
+		tctx->nr_queued--;
+
+		pthread_cond_broadcast(&tctx->cond);
+	}
+
+	pthread_mutex_unlock(&tctx->mutex);
+
+	return NULL;
+}
+
+static bool timeseries_read_header(FILE *in,struct timeseries_header_t *header)
+{
+	return (fread(header, sizeof(struct timeseries_header_t), 1, in)==1)&&
+	       (memcmp(header->magic, TIMESERIES_FILE_MAGIC, 8)==0)&&(header->version==TIMESERIES_FILE_VERSION)&&
+	       (header->sample_size==sizeof(struct timeseries_sample_t));
+}
+
+/*
+	When resuming, the samples measured after the checkpoint are discarded: the first
+	nr_samples ones are kept, and the following ones are appended.
+*/
+
+struct timeseries_ctx_t *init_timeseries_ctx(const char *filename,const struct timeseries_header_t *header,bool resume,int64_t nr_samples)
+{
+	FILE *out;
+
+	if(resume==true)
+	{
+		struct timeseries_header_t previous;
+
+		if(!(out=fopen(filename,"r+")))
+			return NULL;
+
+		long int length=sizeof(struct timeseries_header_t)+nr_samples*sizeof(struct timeseries_sample_t);
+
+		if((timeseries_read_header(out,&previous)==false)||(previous.chain!=header->chain)||
+		   (previous.minorder!=header->minorder)||(previous.maxorder!=header->maxorder)||
+		   (fseek(out,0,SEEK_END)!=0)||(ftell(out)<length)||
+		   (ftruncate(fileno(out),length)!=0)||(fseek(out,0,SEEK_END)!=0))
+		{
+			fclose(out);
+			return NULL;
+		}
+	}
+	else
+	{
+		if(!(out=fopen(filename,"w")))
+			return NULL;
+
+		if(fwrite(header, sizeof(struct timeseries_header_t), 1, out)!=1)
+		{
+			fclose(out);
+			return NULL;
+		}
+	}
+
+	struct timeseries_ctx_t *ret=malloc(sizeof(struct timeseries_ctx_t));
+	assert(ret!=NULL);
+
+	ret->out=out;
+
+	for(int c=0;c<TIMESERIES_NR_BUFFERS;c++)
+	{
+		ret->buffers[c]=malloc(sizeof(struct timeseries_sample_t)*TIMESERIES_BUFFER_SIZE);
+		assert(ret->buffers[c]!=NULL);
+
+		ret->sizes[c]=0;
+	}
+
+	ret->first=ret->nr_queued=0;
+	ret->current_buffer=ret->current_fill=0;
+	ret->stop=ret->failed=false;
+
+	pthread_mutex_init(&ret->mutex,NULL);
+	pthread_cond_init(&ret->cond,NULL);
+
+	/*
+		Without the writer nothing would drain the buffers, and the chain would wait forever.
+	*/
+
+	if(pthread_create(&ret->writer,NULL,timeseries_writer,ret)!=0)
+	{
+		pthread_mutex_destroy(&ret->mutex);
+		pthread_cond_destroy(&ret->cond);
+
+		for(int c=0;c<TIMESERIES_NR_BUFFERS;c++)
+			free(ret->buffers[c]);
+
+		fclose(out);
+		free(ret);
+
+		return NULL;
+	}
+
+	return ret;
+}
+
+/*
+	The buffer being filled is passed to the writer. If all the other buffers are still
+	waiting to be written, the chain has to wait.
+*/
+
+static void timeseries_queue_current(struct timeseries_ctx_t *tctx)
+{
+	pthread_mutex_lock(&tctx->mutex);
+
+	while(tctx->nr_queued==(TIMESERIES_NR_BUFFERS-1))
+		pthread_cond_wait(&tctx->cond,&tctx->mutex);
+
+	tctx->sizes[tctx->current_buffer]=tctx->current_fill;
+	tctx->nr_queued++;
+
+	pthread_cond_broadcast(&tctx->cond);
+	pthread_mutex_unlock(&tctx->mutex);
+
+	tctx->current_buffer=(tctx->current_buffer+1)%TIMESERIES_NR_BUFFERS;
+	tctx->current_fill=0;
+}
+
+void timeseries_add(struct timeseries_ctx_t *tctx,int order,int sign,double logweight,uint64_t topology)
+{
+	struct timeseries_sample_t *sample=&tctx->buffers[tctx->current_buffer][tctx->current_fill];
+
+	sample->topology=topology;
+	sample->logweight=logweight;
+	sample->order=order;
+	sample->sign=sign;
+	sample->reserved[0]=sample->reserved[1]=0;
+
+	if(++tctx->current_fill==TIMESERIES_BUFFER_SIZE)
+		timeseries_queue_current(tctx);
+}
+
+/*
+	Waits until all the samples collected so far have been written, e.g. before a checkpoint.
+*/
+
+bool timeseries_flush(struct timeseries_ctx_t *tctx)
+{
+	if(tctx->current_fill>0)
+		timeseries_queue_current(tctx);
+
+	pthread_mutex_lock(&tctx->mutex);
+
+	while(tctx->nr_queued>0)
+		pthread_cond_wait(&tctx->cond,&tctx->mutex);
+
+	bool success=(tctx->failed==false)&&(fflush(tctx->out)==0);
+
+	pthread_mutex_unlock(&tctx->mutex);
+
+	return success;
+}
+
+bool fini_timeseries_ctx(struct timeseries_ctx_t *tctx)
+{
+	if(!tctx)
+		return true;
+
+	bool success=timeseries_flush(tctx);
+
+	pthread_mutex_lock(&tctx->mutex);
+	tctx->stop=true;
+	pthread_cond_broadcast(&tctx->cond);
+	pthread_mutex_unlock(&tctx->mutex);
+
+	pthread_join(tctx->writer,NULL);
+	pthread_mutex_destroy(&tctx->mutex);
+	pthread_cond_destroy(&tctx->cond);
+
+	success&=(fclose(tctx->out)==0);
+
+	for(int c=0;c<TIMESERIES_NR_BUFFERS;c++)
+		free(tctx->buffers[c]);
+
+	free(tctx);
+
+	return success;
+}
+
+/*
+	Opens a time series for reading: on success the samples follow.
+*/
+
+FILE *timeseries_open(const char *filename,struct timeseries_header_t *header)
+{
+	FILE *in;
+
+	if(!(in=fopen(filename,"r")))
+		return NULL;
+
+	if(timeseries_read_header(in,header)==false)
+	{
+		fclose(in);
+		return NULL;
+	}
+
+	return in;
+}
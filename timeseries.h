@@ -0,0 +1,63 @@
+#ifndef __TIMESERIES_H__
+#define __TIMESERIES_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+	An optional stream of all the measured samples of a chain, so that they can be analyzed
+	again later on, e.g. with a different thermalization or decorrelation, without repeating
+	the simulation, see replay.c
+
+	The file contains this header, followed by the samples in the order they have been
+	measured, in the native byte order.
+*/
+
+#define TIMESERIES_FILE_MAGIC		"MPNTMSRS"
+#define TIMESERIES_FILE_VERSION		(1)
+
+struct timeseries_header_t
+{
+	char magic[8];
+	uint32_t version;
+	int32_t chain,minorder,maxorder;
+	int32_t decorrelation,sample_size;
+	int64_t thermalization;
+};
+
+/*
+	The topology index is the one calculated by amatrix_to_index(), or TIMESERIES_NO_TOPOLOGY
+	for diagrams that are too large for it.
+*/
+
+#define TIMESERIES_NO_TOPOLOGY		(UINT64_MAX)
+
+struct timeseries_sample_t
+{
+	uint64_t topology;
+	float logweight;
+	int8_t order,sign;
+	uint8_t reserved[2];
+};
+
+/*
+	The samples are collected in a few large buffers: when one is full it is passed to a
+	background thread writing it to the file, so that the chain never waits for the I/O,
+	unless all the buffers are waiting to be written.
+*/
+
+#define TIMESERIES_NR_BUFFERS		(4)
+#define TIMESERIES_BUFFER_SIZE		(65536)
+
+struct timeseries_ctx_t;
+
+struct timeseries_ctx_t *init_timeseries_ctx(const char *filename,const struct timeseries_header_t *header,bool resume,int64_t nr_samples);
+bool fini_timeseries_ctx(struct timeseries_ctx_t *tctx);
+
+void timeseries_add(struct timeseries_ctx_t *tctx,int order,int sign,double logweight,uint64_t topology);
+bool timeseries_flush(struct timeseries_ctx_t *tctx);
+
+FILE *timeseries_open(const char *filename,struct timeseries_header_t *header);
+
+#endif //__TIMESERIES_H__
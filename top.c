@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <curses.h>
+
+#include "livestats.h"
+#include "auxx.h"
+
+/*
+	A top-like monitor for all the mpn processes running on this machine: each process publishes
+	the statistics of its chains in a shared memory segment (see livestats.h), and the segments
+	of all of them are shown together, refreshed every few seconds. With -n the statistics are
+	printed only once, without the full-screen interface, e.g. to be used in scripts.
+*/
+
+void usage(char *argv0)
+{
+	printf("Usage: %s [-n] [-d <seconds between updates>]\n",argv0);
+
+	exit(0);
+}
+
+/*
+	The lines are printed either on stdout or on the screen, clipped to its size.
+*/
+
+bool interactive=false;
+int row=0;
+
+void top_line(const char *format,...)
+{
+	char line[1024];
+	va_list args;
+
+	va_start(args,format);
+	vsnprintf(line,1024,format,args);
+	va_end(args);
+
+	line[1023]='\0';
+
+	if(interactive==false)
+	{
+		printf("%s\n",line);
+		return;
+	}
+
+	if(row<LINES)
+		mvaddnstr(row++,0,line,COLS);
+}
+
+struct top_totals_t
+{
+	int nr_processes,nr_chains;
+	double rate;
+};
+
+bool top_show_process(const char *name,struct top_totals_t *totals)
+{
+	const struct livestats_header_t *header;
+	size_t length;
+
+	if(!(header=livestats_map(name,&length)))
+		return false;
+
+	/*
+		The segments of processes that died in the meantime are skipped.
+	*/
+
+	if(livestats_is_stale(header)==true)
+	{
+		livestats_unmap(header,length);
+		return false;
+	}
+
+	top_line("");
+	top_line("PID %d, '%s': %d chains, orders %d to %d, %ld iterations per chain",header->pid,header->prefix,
+		header->nr_chains,header->minorder,header->maxorder,(long int)(header->iterations));
+	top_line("%8s %14s %8s %12s %8s %8s  %s","CHAIN","ITERATIONS","DONE","IT/S","PHYS%","ACCEPT%","STATE");
+
+	for(int c=0;c<header->nr_chains;c++)
+	{
+		struct livestats_data_t data;
+
+		if(livestats_read_chain(livestats_get_mapped_chain(header,c),&data)==false)
+		{
+			top_line("%8s (busy)","");
+			continue;
+		}
+
+		long int proposed,accepted;
+
+		proposed=accepted=0;
+		for(int d=0;d<header->nr_updates;d++)
+		{
+			proposed+=data.proposed[d];
+			accepted+=data.accepted[d];
+		}
+
+		double done=(header->iterations>0)?(100.0f*data.counter/header->iterations):(0.0f);
+		double physical=(data.nr_samples>0)?(100.0f*data.nr_physical_samples/data.nr_samples):(0.0f);
+		double acceptance=(proposed>0)?(100.0f*accepted/proposed):(0.0f);
+
+		top_line("%8d %14ld %7.2f%% %12.0f %7.2f%% %7.2f%%  %s",data.id,(long int)(data.counter),done,
+			(data.finished==true)?(0.0f):(data.rate),physical,acceptance,(data.finished==true)?("finished"):("running"));
+
+		/*
+			The acceptance of each update, and the contribution at each order
+		*/
+
+		char line[1024];
+		int position=0;
+
+		line[0]='\0';
+
+		for(int d=0;(d<header->nr_updates)&&(position<1024);d++)
+		{
+			double ratio=(data.proposed[d]>0)?(100.0f*data.accepted[d]/data.proposed[d]):(0.0f);
+
+			position+=snprintf(&line[position],1024-position," %s %.1f%%",header->update_names[d],ratio);
+		}
+
+		top_line("%8s%s","",line);
+
+		position=0;
+		for(int order=header->minorder;(order<=header->maxorder)&&(position<1024);order++)
+		{
+			char desc[128];
+
+			order_description(desc,128,order);
+
+			position+=snprintf(&line[position],1024-position," %s %f +- %f (%ld)",desc,data.contribution[order],
+				data.stderror[order],(long int)(data.nr_positive[order]+data.nr_negative[order]));
+		}
+
+		top_line("%8s%s","",line);
+
+		totals->nr_chains++;
+
+		if(data.finished==false)
+			totals->rate+=data.rate;
+	}
+
+	totals->nr_processes++;
+	livestats_unmap(header,length);
+
+	return true;
+}
+
+/*
+	The shared memory segments are found in /dev/shm, without the leading slash.
+*/
+
+void top_show_all(void)
+{
+	struct top_totals_t totals;
+	DIR *dir;
+
+	totals.nr_processes=totals.nr_chains=0;
+	totals.rate=0.0f;
+
+	top_line("mpn-top: live statistics of the mpn processes on this machine%s",(interactive==true)?(" (q to quit)"):(""));
+
+	livestats_remove_stale();
+
+	if((dir=opendir("/dev/shm"))!=NULL)
+	{
+		struct dirent *entry;
+
+		while((entry=readdir(dir))!=NULL)
+		{
+			char name[1024];
+
+			if(strncmp(entry->d_name,LIVESTATS_PREFIX+1,strlen(LIVESTATS_PREFIX)-1)!=0)
+				continue;
+
+			snprintf(name,1024,"/%s",entry->d_name);
+			name[1023]='\0';
+
+			top_show_process(name,&totals);
+		}
+
+		closedir(dir);
+	}
+
+	top_line("");
+
+	if(totals.nr_processes==0)
+		top_line("No running mpn processes found.");
+	else
+		top_line("Total: %d processes, %d chains, %.0f iterations/s",totals.nr_processes,totals.nr_chains,totals.rate);
+}
+
+int main(int argc,char *argv[])
+{
+	bool once=false;
+	int delay=2;
+
+	for(int c=1;c<argc;c++)
+	{
+		if(strcmp(argv[c],"-n")==0)
+			once=true;
+		else if((strcmp(argv[c],"-d")==0)&&((c+1)<argc))
+			delay=atoi(argv[++c]);
+		else
+			usage(argv[0]);
+	}
+
+	if(delay<1)
+		usage(argv[0]);
+
+	if(once==true)
+	{
+		top_show_all();
+		return 0;
+	}
+
+	interactive=true;
+
+	initscr();
+	cbreak();
+	noecho();
+	curs_set(0);
+	timeout(1000*delay);
+
+	while(true)
+	{
+		erase();
+		row=0;
+
+		top_show_all();
+		refresh();
+
+		int key=getch();
+
+		if((key=='q')||(key=='Q'))
+			break;
+	}
+
+	endwin();
+
+	return 0;
+}
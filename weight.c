@@ -3,7 +3,6 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <gsl/gsl_math.h>
-#include <gsl/gsl_matrix_int.h>
 
 #include "amatrix.h"
 #include "weight.h"
@@ -11,6 +10,7 @@
 #include "permutations.h"
 #include "auxx.h"
 #include "weight2.h"
+#include "cache.h"
 
 struct amatrix_t *init_amatrix_from_amatrix(struct amatrix_t *amx)
 {
@@ -36,6 +36,12 @@ struct amatrix_t *init_amatrix_from_amatrix(struct amatrix_t *amx)
 	ret->cached_weight=0.0f;
 	ret->cached_weight_is_valid=false;
 
+	ret->private_weight_info=malloc(sizeof(struct weight_info_t));
+	ret->weight_info=ret->private_weight_info;
+	ret->weight_info_is_valid=false;
+
+	assert(ret->private_weight_info!=NULL);
+
 	return ret;
 }
 
@@ -46,29 +52,55 @@ double amatrix_projection_multiplicity(struct amatrix_t *amx)
 	nr_occupied_entries=nr_virtual_entries=0;
 	for(int i=0;i<amx->pmxs[0]->dimensions;i++)
 	{
-		for(int j=0;j<amx->pmxs[0]->dimensions;j++)
+		for(int c=0;c<2;c++)
 		{
-			if(pmatrix_get_entry(amx->pmxs[0],i,j)!=0)
-			{
-				if(pmatrix_entry_type(i,j)==QTYPE_OCCUPIED)
-					nr_occupied_entries++;
-				else
-					nr_virtual_entries++;
-			}
-
-			if(pmatrix_get_entry(amx->pmxs[1],i,j)!=0)
-			{
-				if(pmatrix_entry_type(i,j)==QTYPE_OCCUPIED)
-					nr_occupied_entries++;
-				else
-					nr_virtual_entries++;
-			}
+			if(pmatrix_entry_type(i,pmatrix_get_col(amx->pmxs[c],i))==QTYPE_OCCUPIED)
+				nr_occupied_entries++;
+			else
+				nr_virtual_entries++;
 		}
 	}
 
 	return pow(amx->nr_virtual,nr_occupied_entries)*pow(amx->nr_occupied,nr_virtual_entries);
 }
 
+/*
+	Returns the 'weight_info_t' struct for the current topology, looking it up in the topology
+	cache. If it is not there it is calculated from the incidence matrix, and stored in the cache.
+
+	If the cache cannot be used, the result is saved in 'scratch' and a pointer to it is returned.
+*/
+
+static const struct weight_info_t *amatrix_get_weight_info(struct amatrix_t *amx, struct weight_info_t *scratch)
+{
+	int dimensions=amx->pmxs[0]->dimensions;
+	bool use_cache=topology_cache_is_available(dimensions);
+	uint64_t index=0;
+
+	const struct weight_info_t *ret;
+
+	if(use_cache==true)
+	{
+		index=amatrix_to_index(amx);
+
+		if((ret=topology_cache_get_entry(index, dimensions))!=NULL)
+			return ret;
+	}
+
+	struct label_t labels[MAX_LABELS];
+	int ilabels=0;
+
+	struct incidence_t incidence;
+
+	amatrix_calculate_incidence(amx, &incidence, labels, &ilabels);
+	*scratch=incidence_to_weight_info(&incidence, labels, &ilabels, amx);
+
+	if((use_cache==true)&&((ret=topology_cache_set_entry(index, dimensions, scratch))!=NULL))
+		return ret;
+
+	return scratch;
+}
+
 /*
 	Here we calculate the weight associated to a 'amatrix'
 */
@@ -124,20 +156,50 @@ double amatrix_weight(struct amatrix_t *amx)
 
 		return amx->cached_weight;
 	}
+	else if(amx->weight_info_is_valid==true)
+	{
+		/*
+			If only the quantum numbers have changed since the last time the 'weight_info_t'
+			struct has been built, we can quickly reconstruct the weight.
+		*/
+
+		double ret=reconstruct_weight(amx, amx->weight_info)/amatrix_projection_multiplicity(amx);
+
+#ifndef NDEBUG
+		amx->weight_info_is_valid=false;
+		amx->cached_weight_is_valid=false;
+
+		assert(gsl_fcmp(ret,amatrix_weight(amx),1e-6)==0);
+
+		amx->weight_info_is_valid=true;
+#endif
+
+		amx->cached_weight=ret;
+		amx->cached_weight_is_valid=true;
+
+		return amx->cached_weight;
+	}
 	else
 	{
 		double ret=0;
 
-		struct label_t labels[MAX_LABELS];
-		int ilabels=0;
-
 		if(amatrix_check_connectedness(amx)==true)
 		{
-			gsl_matrix_int *incidence=amatrix_calculate_incidence(amx, labels, &ilabels);
-			ret=incidence_to_weight(incidence, labels, &ilabels, amx);
-			gsl_matrix_int_free(incidence);
+			struct weight_info_t scratch;
+			const struct weight_info_t *awt=amatrix_get_weight_info(amx, &scratch);
+
+			/*
+				Entries in the topology cache can be used for the following label-only updates.
+				On the other hand 'scratch' goes out of scope.
+			*/
+
+			if(awt!=&scratch)
+			{
+				amx->weight_info=awt;
+				amx->weight_info_is_valid=true;
+			}
 
-			ret/=amatrix_projection_multiplicity(amx);
+			ret=reconstruct_weight(amx, awt)/amatrix_projection_multiplicity(amx);
 		}
 
 		amx->cached_weight=ret;
@@ -149,3 +211,62 @@ double amatrix_weight(struct amatrix_t *amx)
 	assert(false);
 	return 0.0f;
 }
+
+/*
+	Builds the 'weight_info_t' struct for the current arrangement of zero/non-zero entries,
+	if needed. Returns false if the weight cannot be reconstructed this way, i.e. in dimension
+	1 and for disconnected diagrams.
+
+	This function must not be called while an update is being proposed, since it might
+	overwrite private_weight_info, see amatrix_restore().
+*/
+
+bool amatrix_update_weight_info(struct amatrix_t *amx)
+{
+	if(amx->weight_info_is_valid==true)
+		return true;
+
+	if(amx->pmxs[0]->dimensions==1)
+		return false;
+
+	if(amatrix_check_connectedness(amx)==false)
+		return false;
+
+	amx->weight_info=amatrix_get_weight_info(amx, amx->private_weight_info);
+	amx->weight_info_is_valid=true;
+
+	return true;
+}
+
+/*
+	Changes the quantum number of a single entry, updating the cached weight by recalculating
+	only the numerators and denominators the corresponding label appears in.
+*/
+
+void amatrix_relabel(struct amatrix_t *amx, int pmatrix, int i, int j, int value)
+{
+	if((amx->weight_info_is_valid==false)||(amx->cached_weight_is_valid==false))
+	{
+		pmatrix_set_raw_entry(amx->pmxs[pmatrix], i, j, value);
+		amx->cached_weight_is_valid=false;
+		return;
+	}
+
+	int label=weight_info_label_index(amx->weight_info, i, j, pmatrix);
+	double before=label_factors(amx, amx->weight_info, label);
+
+	pmatrix_set_raw_entry(amx->pmxs[pmatrix], i, j, value);
+
+	/*
+		If one of the factors vanishes we cannot take the ratio, and the
+		weight is reconstructed from scratch instead.
+	*/
+
+	if(before==0.0f)
+	{
+		amx->cached_weight_is_valid=false;
+		return;
+	}
+
+	amx->cached_weight*=label_factors(amx, amx->weight_info, label)/before;
+}
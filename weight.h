@@ -6,4 +6,7 @@
 
 double amatrix_weight(struct amatrix_t *amx);
 
+bool amatrix_update_weight_info(struct amatrix_t *amx);
+void amatrix_relabel(struct amatrix_t *amx, int pmatrix, int i, int j, int value);
+
 #endif //__WEIGHT_H__
@@ -8,34 +8,11 @@
 #include "multiplicity.h"
 #include "auxx.h"
 
-void add_denominator_entry(struct weight_info_t *awt, int label, int qtype)
-{
-	int index=awt->denominators[awt->nr_denominators].ilabels;
-
-	awt->denominators[awt->nr_denominators].labels[index]=label;
-	awt->denominators[awt->nr_denominators].qtypes[index]=qtype;
-	awt->denominators[awt->nr_denominators].ilabels++;
-}
-
-void add_numerator(struct weight_info_t *awt, int l1, int l2, int l3, int l4)
-{
-	awt->numerators[awt->nr_numerators].labels[0]=l1;
-	awt->numerators[awt->nr_numerators].labels[1]=l2;
-	awt->numerators[awt->nr_numerators].labels[2]=l3;
-	awt->numerators[awt->nr_numerators].labels[3]=l4;
-	awt->nr_numerators++;
-}
-
-void add_unphysical_penalty(struct weight_info_t *awt, double penalty)
-{
-	awt->unphysical_penalty*=penalty;
-}
-
 /*
 	This function calculates a diagram's weight given the incidence matrix
 */
 
-struct weight_info_t incidence_to_weight_info(gsl_matrix_int *B, struct label_t *labels, int *ilabels, struct amatrix_t *amx)
+struct weight_info_t incidence_to_weight_info(struct incidence_t *B, struct label_t *labels, int *ilabels, struct amatrix_t *amx)
 {
 	int mels[MAX_MATRIX_ELEMENTS][4];
 	assert(B->size1<=MAX_MATRIX_ELEMENTS);
@@ -55,7 +32,7 @@ struct weight_info_t incidence_to_weight_info(gsl_matrix_int *B, struct label_t
 
 		for(size_t j=0;j<B->size2;j++)
 		{
-			if(gsl_matrix_int_get(B, i, j)==1)
+			if(B->values[i][j]==1)
 			{
 				if(mels[i][0]==-1)
 					mels[i][0]=j;
@@ -65,7 +42,7 @@ struct weight_info_t incidence_to_weight_info(gsl_matrix_int *B, struct label_t
 					assert(false);
 			}
 
-			if(gsl_matrix_int_get(B, i, j)==-1)
+			if(B->values[i][j]==-1)
 			{
 				if(mels[i][2]==-1)
 					mels[i][2]=j;
@@ -75,7 +52,7 @@ struct weight_info_t incidence_to_weight_info(gsl_matrix_int *B, struct label_t
 					assert(false);
 			}
 
-			if(gsl_matrix_int_get(B, i, j)==2)
+			if(B->values[i][j]==2)
 				has_selfloop=true;
 		}
 
@@ -93,7 +70,7 @@ struct weight_info_t incidence_to_weight_info(gsl_matrix_int *B, struct label_t
 		int cnt=0;
 
 		for(size_t j=i+1;j<B->size2;j++)
-			if(columns_are_identical(B, i, j)==true)
+			if(incidence_columns_are_identical(B, i, j)==true)
 				cnt++;
 
 		if(cnt!=0)
@@ -101,69 +78,62 @@ struct weight_info_t incidence_to_weight_info(gsl_matrix_int *B, struct label_t
 	}
 
 	/*
-		This structure will contain the final calculated weight, along with plenty of
-		additional information, allowing one to reconstruct the weight from scratch.
+		This structure will contain all the information needed to reconstruct
+		the weight, once the quantum numbers are given.
 	*/
 
 	struct weight_info_t ret;
 
-	ret.nr_denominators=0;
-	ret.nr_numerators=0;
-	ret.unphysical_penalty=1.0f;
+	assert(B->size1<=MAX_NUMERATORS);
+	assert((B->size1-1)<=MAX_DENOMINATORS);
+	assert(B->size2<=MAX_LABELS);
+
+	ret.ilabels=*ilabels;
+
+	for(int c=0;c<*ilabels;c++)
+	{
+		ret.labels[c].i=labels[c].i;
+		ret.labels[c].j=labels[c].j;
+		ret.labels[c].pmatrix=labels[c].pmatrix;
+		ret.labels[c].qtype=labels[c].qtype;
+		ret.labels[c].nr_numerators=0;
+	}
 
 	/*
-		Rule 4: denominators
+		Rule 4: denominators. The column sums up to the i-th row are non-zero for a
+		contiguous range of rows, so for each label we only need to save the first and
+		the last denominator it appears in.
 	*/
 
-	double denominators=1.0f;
+	int sums[2*PMATRIX_MAX_DIMENSIONS];
 
-	for(size_t i=0;i<(B->size1-1);i++)
+	for(size_t j=0;j<B->size2;j++)
 	{
-		double denominator=0.0f;
-		int energies_in_denominator=0;
+		sums[j]=0;
 
-		ret.denominators[ret.nr_denominators].ilabels=0;
+		ret.labels[j].first=B->size1;
+		ret.labels[j].last=-1;
+	}
 
+	for(size_t i=0;i<(B->size1-1);i++)
+	{
 		for(size_t j=0;j<B->size2;j++)
 		{
-			int sum=0;
+			sums[j]+=B->values[i][j];
 
-			for(size_t k=0;k<=i;k++)
-				sum+=gsl_matrix_int_get(B,k,j);
-
-			if(sum!=0)
+			if(sums[j]!=0)
 			{
-				/*
-					The j-th label contributes to the i-th denominator
-				*/
-
-				add_denominator_entry(&ret, j, labels[j].qtype);
-
-				switch(labels[j].qtype)
-				{
-					case QTYPE_OCCUPIED:
-					denominator+=get_occupied_energy(amx->ectx,labels[j].value-1);
-					energies_in_denominator++;
-					break;
+				if(ret.labels[j].first>(int)(i))
+					ret.labels[j].first=i;
 
-					case QTYPE_VIRTUAL:
-					denominator-=get_virtual_energy(amx->ectx,labels[j].value-1);
-					energies_in_denominator++;
-					break;
-
-					default:
-					assert(false);
-				}
+				assert((ret.labels[j].last==-1)||(ret.labels[j].last==(int)(i-1)));
+				ret.labels[j].last=i;
 			}
 		}
-
-		if(energies_in_denominator>0)
-		{
-			denominators*=denominator;
-			ret.nr_denominators++;
-		}
 	}
 
+	ret.nr_denominators=B->size1-1;
+
 	/*
 		Additional rule: phase factor
 	*/
@@ -180,61 +150,45 @@ struct weight_info_t incidence_to_weight_info(gsl_matrix_int *B, struct label_t
 	inversefactor*=pow(-1.0f,l+h);
 
 	/*
-		Finally we build up the total weight.
+		The numerators, one for each row of the incidence matrix. If the four entries are not set,
+		it means that the i-th line of the adjacency matrix contains a '2' entry, coming from the
+		unphysical sector, and we will assign an unphysical penalty to it.
 	*/
 
-	double numerators=1.0f;
+	ret.nr_numerators=0;
 
 	for(size_t i=0;i<B->size1;i++)
 	{
-		/*
-			If these four entries are not set, it means that the i-th line of the adjacency matrix
-			contains a '2' entry, coming from the unphysical sector.
-
-			Therefore, it cannot give rise to a proper matrix element.
-		*/
+		int c=ret.nr_numerators++;
 
 		if((mels[i][0]==-1)||(mels[i][1]==-1)||(mels[i][2]==-1)||(mels[i][3]==-1))
 		{
-			/*
-				We assign an unphysical penalty for 'selfloops', i.e. edges on the
-				graph connecting a vertex with itself, appearing only in the unphysical sector.
-			*/
-
-			numerators*=amx->config->unphysicalpenalty;
-			add_unphysical_penalty(&ret,amx->config->unphysicalpenalty);
+			for(int d=0;d<4;d++)
+				ret.numerators[c][d]=-1;
 
 			continue;
 		}
 
-		/*
-			We have to convert the quantum numbers into the format used by get_eri()
-		*/
-
-		int i1,i2,i3,i4;
+		for(int d=0;d<4;d++)
+		{
+			int label=mels[i][d];
 
-		i1=labels[mels[i][0]].value-1+((labels[mels[i][0]].qtype==QTYPE_VIRTUAL)?(amx->ectx->nocc):(0));
-		i2=labels[mels[i][1]].value-1+((labels[mels[i][1]].qtype==QTYPE_VIRTUAL)?(amx->ectx->nocc):(0));
-		i3=labels[mels[i][2]].value-1+((labels[mels[i][2]].qtype==QTYPE_VIRTUAL)?(amx->ectx->nocc):(0));
-		i4=labels[mels[i][3]].value-1+((labels[mels[i][3]].qtype==QTYPE_VIRTUAL)?(amx->ectx->nocc):(0));
+			ret.numerators[c][d]=label;
 
-		numerators*=get_eri(amx->ectx, i1, i2, i3, i4);
+			assert(ret.labels[label].nr_numerators<2);
+			ret.labels[label].numerators[ret.labels[label].nr_numerators++]=c;
+		}
 
-		add_numerator(&ret,mels[i][0],mels[i][1],mels[i][2],mels[i][3]);
+		ret.eripatterns[c]=eri_pattern(labels[mels[i][0]].qtype==QTYPE_VIRTUAL,
+		                               labels[mels[i][1]].qtype==QTYPE_VIRTUAL,
+		                               labels[mels[i][2]].qtype==QTYPE_VIRTUAL,
+		                               labels[mels[i][3]].qtype==QTYPE_VIRTUAL);
 	}
 
-	/*
-		Finally we put all the results into an 'weight_info_t' struct and
-		we return it.
-	*/
-
-	memcpy(ret.labels,labels,sizeof(struct label_t)*MAX_LABELS);
-	ret.ilabels=*ilabels;
-
 	ret.l=l;
 	ret.h=h;
 	ret.inversefactor=inversefactor;
-	ret.weight=pow(inversefactor,-1.0f)*numerators/denominators/amatrix_multiplicity(amx);
+	ret.multiplicity=amatrix_multiplicity(amx);
 
 #ifndef NDEBUG
 	{
@@ -256,61 +210,88 @@ struct weight_info_t incidence_to_weight_info(gsl_matrix_int *B, struct label_t
 	return ret;
 }
 
-double reconstruct_weight(struct amatrix_t *amx, struct weight_info_t *awt)
+/*
+	Only the first 'ilabels' entries of the labels array are meaningful, so that a
+	'weight_info_t' can be stored using less memory than its full size.
+*/
+
+size_t weight_info_size(const struct weight_info_t *awt)
+{
+	return offsetof(struct weight_info_t, labels)+awt->ilabels*sizeof(awt->labels[0]);
+}
+
+/*
+	The quantum numbers are always read from the permutation matrices, so that a 'weight_info_t'
+	stays valid as long as the arrangement of zero/non-zero entries does not change.
+*/
+
+static inline int weight_info_label_value(struct amatrix_t *amx, const struct weight_info_t *awt, int label)
 {
-	/*
-		Keep in mind that here we do not check for connectedness.
-	*/
+	return pmatrix_get_entry(amx->pmxs[awt->labels[label].pmatrix], awt->labels[label].i, awt->labels[label].j);
+}
 
-	double denominators=1.0f;
+double weight_info_denominator(struct amatrix_t *amx, const struct weight_info_t *awt, int c)
+{
+	double denominator=0.0f;
+	int energies_in_denominator=0;
 
-	for(int c=0;c<awt->nr_denominators;c++)
+	for(int label=0;label<awt->ilabels;label++)
 	{
-		double denominator=0.0f;
+		if((c<awt->labels[label].first)||(c>awt->labels[label].last))
+			continue;
 
-		for(int d=0;d<awt->denominators[c].ilabels;d++)
+		switch(awt->labels[label].qtype)
 		{
-			int label=awt->denominators[c].labels[d];
+			case QTYPE_OCCUPIED:
+			denominator+=get_occupied_energy(amx->ectx, weight_info_label_value(amx, awt, label)-1);
+			energies_in_denominator++;
+			break;
+
+			case QTYPE_VIRTUAL:
+			denominator-=get_virtual_energy(amx->ectx, weight_info_label_value(amx, awt, label)-1);
+			energies_in_denominator++;
+			break;
+		}
+	}
 
-			switch(awt->denominators[c].qtypes[d])
-			{
-				case QTYPE_OCCUPIED:
-				denominator+=get_occupied_energy(amx->ectx, awt->labels[label].value-1);
-				break;
+	return (energies_in_denominator>0)?(denominator):(1.0f);
+}
 
-				case QTYPE_VIRTUAL:
-				denominator-=get_virtual_energy(amx->ectx, awt->labels[label].value-1);
-				break;
-			}
-		}
+double weight_info_numerator(struct amatrix_t *amx, const struct weight_info_t *awt, int c)
+{
+	int indices[4];
 
-		denominators*=denominator;
-	}
+	if(awt->numerators[c][0]==-1)
+		return amx->config->unphysicalpenalty;
 
-	double numerators=1.0f;
+	/*
+		The indices are local, i.e. counted separately for occupied and virtual orbitals,
+		and the pattern was determined when the 'weight_info_t' struct was built.
+	*/
 
-	for(int c=0;c<awt->nr_numerators;c++)
-	{
-		int l1,l2,l3,l4;
+	for(int d=0;d<4;d++)
+		indices[d]=weight_info_label_value(amx, awt, awt->numerators[c][d])-1;
 
-		l1=awt->numerators[c].labels[0];
-		l2=awt->numerators[c].labels[1];
-		l3=awt->numerators[c].labels[2];
-		l4=awt->numerators[c].labels[3];
+	return get_eri_pattern(amx->ectx, awt->eripatterns[c], indices[0], indices[1], indices[2], indices[3]);
+}
 
-		int i1,i2,i3,i4;
+double reconstruct_weight(struct amatrix_t *amx, const struct weight_info_t *awt)
+{
+	/*
+		Keep in mind that here we do not check for connectedness.
+	*/
 
-		i1=awt->labels[l1].value-1+((awt->labels[l1].qtype==QTYPE_VIRTUAL)?(amx->ectx->nocc):(0));
-		i2=awt->labels[l2].value-1+((awt->labels[l2].qtype==QTYPE_VIRTUAL)?(amx->ectx->nocc):(0));
-		i3=awt->labels[l3].value-1+((awt->labels[l3].qtype==QTYPE_VIRTUAL)?(amx->ectx->nocc):(0));
-		i4=awt->labels[l4].value-1+((awt->labels[l4].qtype==QTYPE_VIRTUAL)?(amx->ectx->nocc):(0));
+	double denominators=1.0f;
 
-		numerators*=get_eri(amx->ectx, i1, i2, i3, i4);
-	}
+	for(int c=0;c<awt->nr_denominators;c++)
+		denominators*=weight_info_denominator(amx, awt, c);
 
-	numerators*=awt->unphysical_penalty;
+	double numerators=1.0f;
+
+	for(int c=0;c<awt->nr_numerators;c++)
+		numerators*=weight_info_numerator(amx, awt, c);
 
-	double weight=pow(awt->inversefactor,-1.0f)*numerators/denominators/amatrix_multiplicity(amx);
+	double weight=pow(awt->inversefactor,-1.0f)*numerators/denominators/awt->multiplicity;
 
 	/*
 		Lindelöf resummation should happen here, if needed.
@@ -319,10 +300,29 @@ double reconstruct_weight(struct amatrix_t *amx, struct weight_info_t *awt)
 	return weight;
 }
 
-int coordinate_to_label_index(struct label_t *labels,int ilabels,int i,int j,int pmatrix)
+/*
+	Returns the product of all the factors in which a given label appears, i.e. the numerators
+	divided by the denominators. When a single quantum number is changed, the weight changes
+	by the ratio of the values returned by this function before and after the change.
+*/
+
+double label_factors(struct amatrix_t *amx, const struct weight_info_t *awt, int label)
+{
+	double result=1.0f;
+
+	for(int c=0;c<awt->labels[label].nr_numerators;c++)
+		result*=weight_info_numerator(amx, awt, awt->labels[label].numerators[c]);
+
+	for(int c=awt->labels[label].first;c<=awt->labels[label].last;c++)
+		result/=weight_info_denominator(amx, awt, c);
+
+	return result;
+}
+
+int weight_info_label_index(const struct weight_info_t *awt, int i, int j, int pmatrix)
 {
-	for(int c=0;c<ilabels;c++)
-		if((labels[c].i==i)&&(labels[c].j==j)&&(labels[c].pmatrix==pmatrix))
+	for(int c=0;c<awt->ilabels;c++)
+		if((awt->labels[c].i==i)&&(awt->labels[c].j==j)&&(awt->labels[c].pmatrix==pmatrix))
 			return c;
 
 	assert(false);
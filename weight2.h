@@ -1,7 +1,8 @@
 #ifndef __WEIGHT2_H__
 #define __WEIGHT2_H__
 
-#include <gsl/gsl_matrix_int.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "amatrix.h"
 #include "mpn.h"
@@ -9,44 +10,73 @@
 #include "limits.h"
 
 /*
-	This structure saves most of the intermediate results that can be used to recalculate the weight after
-	having modified a quantum number
+	This structure saves the part of the weight calculation that depends only on the arrangement
+	of zero/non-zero entries, i.e. on the topology of the diagram. The weight is then reconstructed
+	by plugging in the quantum numbers, that are always read from the permutation matrices.
+
+	Since it does not depend on the quantum numbers, it can be shared between all the diagrams
+	with the same topology, see the topology cache in cache.c.
 */
 
 struct weight_info_t
 {
 	/*
-		This information can be used to reconstruct the weight, given the labels.
+		The phase factor (-1)^(l+h), the factorials coming from identical columns
+		in the incidence matrix and the multiplicity.
 	*/
 
+	double inversefactor,multiplicity;
 	int l,h;
 
-	struct
-	{
-		int labels[MAX_LABELS];
-		int qtypes[MAX_LABELS];
-		int ilabels;
-	}
-	denominators[MAX_DENOMINATORS];
-	int nr_denominators;
+	/*
+		One entry for each row in the incidence matrix, i.e. for each matrix element <l0 l1||l2 l3>,
+		given as four label indices. Rows coming from the unphysical sector have l0 set to -1,
+		and give rise to the unphysical penalty instead.
+	*/
 
-	struct
-	{
-		int labels[4];
-	}
-	numerators[MAX_NUMERATORS];
+	int8_t numerators[MAX_NUMERATORS][4];
 	int nr_numerators;
 
-	double inversefactor,unphysical_penalty,weight;
+	/*
+		The occupied/virtual pattern of each numerator, selecting the block of the
+		ERI tensor it is read from, see get_eri_pattern().
+	*/
+
+	int8_t eripatterns[MAX_NUMERATORS];
+
+	/*
+		The number of denominators: each label contributes to all the denominators from
+		labels[].first to labels[].last.
+	*/
+
+	int nr_denominators;
+
+	/*
+		Position and type of each label, with the factors it appears in.
+
+		This has to be the last field: only the first 'ilabels' entries are copied
+		around, see weight_info_size().
+	*/
 
-	struct label_t labels[MAX_LABELS];
 	int ilabels;
+
+	struct
+	{
+		int8_t i,j,pmatrix,qtype;
+		int8_t first,last;
+
+		int8_t numerators[2];
+		int8_t nr_numerators;
+	}
+	labels[MAX_LABELS];
 };
 
-struct weight_info_t incidence_to_weight_info(gsl_matrix_int *B, struct label_t *labels, int *ilabels, struct amatrix_t *amx);
+struct weight_info_t incidence_to_weight_info(struct incidence_t *B, struct label_t *labels, int *ilabels, struct amatrix_t *amx);
+size_t weight_info_size(const struct weight_info_t *awt);
 
-double reconstruct_weight(struct amatrix_t *amx, struct weight_info_t *awt);
+double reconstruct_weight(struct amatrix_t *amx, const struct weight_info_t *awt);
+double label_factors(struct amatrix_t *amx, const struct weight_info_t *awt, int label);
 
-int coordinate_to_label_index(struct label_t *labels,int ilabels,int i,int j,int pmatrix);
+int weight_info_label_index(const struct weight_info_t *awt, int i, int j, int pmatrix);
 
 #endif //__WEIGHT2_H__